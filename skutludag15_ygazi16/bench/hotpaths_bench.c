@@ -0,0 +1,331 @@
+/*
+ * Benchmark suite: the shell's hot paths on generated data, the baseline
+ * for every performance change. Each benchmark repeats one operation and
+ * reports operations per second, the mean and the p50/p90/p99/max latency,
+ * and MB/s where the operation has a data size. With -j every result is
+ * one JSON object per line, for scripts to compare runs.
+ *
+ *   make bench BENCH_FLAGS="-j"
+ *   ./hotpaths_bench [-j] [-q] [benchmark...]
+ *
+ * -q runs on smaller data, as a quick check that everything works. Naming
+ * benchmarks runs only those whose names start with one of them:
+ *
+ *   parse          parse_command() on a 1 MB line of mixed words and operators
+ *   spawn          an external command (true) launched and waited for
+ *   pipeline       cat file | cat | wc -c over a generated text file
+ *   kdiff-a        kdiff -a on two large text files, one line in 100 changed
+ *   kdiff-b        kdiff -b on two large binary files, a byte changed per MB
+ *   highlight      highlight of three words over a large text file
+ *   shortdir-set   shortdir set (replacing one bookmark) among many
+ *   shortdir-jump  shortdir jump by name among many bookmarks
+ *   shortdir-find  shortdir jump by path fragments among many bookmarks
+ *   shortdir-list  shortdir list of many bookmarks
+ *
+ * Everything the commands print goes to /dev/null. The data lives in a
+ * temporary directory, removed at the end.
+ */
+#define SEASHELL_NO_MAIN
+#include "../seashell.c"
+
+FILE *report_out; // stdout from before it was pointed at /dev/null
+bool report_json = false;
+bool quick = false;
+char data_dir[PATH_MAX];
+char **filters; // benchmark names asked for on the command line
+int filter_count;
+
+long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int compare_long(const void *a, const void *b) {
+    long x = *(const long *) a, y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Whether a benchmark, or any in a group when group is set, was asked for
+ */
+bool selected(const char *name, bool group) {
+    for (int i = 0; i < filter_count; ++i)
+        if (strncmp(name, filters[i], strlen(filters[i])) == 0 ||
+            (group && strncmp(filters[i], name, strlen(name)) == 0))
+            return true;
+    return filter_count == 0;
+}
+
+/**
+ * Run a command line the way the shell does
+ */
+void run_line(const char *line) {
+    char *buf = strdup(line);
+    struct command_t *command = arena_zalloc(&line_arena, sizeof(struct command_t));
+    if (parse_command(buf, command) == SUCCESS)
+        process_command(command);
+    fflush(stdout);
+    arena_reset(&line_arena);
+    free(buf);
+}
+
+/**
+ * Time n runs of op (after one untimed run) and report them
+ * @param  bytes  data handled by one run, 0 if it has no size
+ */
+void measure(const char *name, void (*op)(void *), void *arg, int n, size_t bytes) {
+    if (!selected(name, false))
+        return;
+    long *samples = malloc(sizeof(long) * n), total = 0;
+    op(arg); // warm the caches and the PATH table
+    for (int i = 0; i < n; ++i) {
+        long t = now_ns();
+        op(arg);
+        samples[i] = now_ns() - t;
+        total += samples[i];
+    }
+    qsort(samples, n, sizeof(long), compare_long);
+    double seconds = total / 1e9, mb = bytes ? (double) bytes * n / 1048576.0 / seconds : 0;
+    double mean = total / 1e3 / n, p50 = samples[n / 2] / 1e3, p90 = samples[n * 90 / 100] / 1e3,
+           p99 = samples[n * 99 / 100] / 1e3, max = samples[n - 1] / 1e3;
+    if (report_json)
+        fprintf(report_out, "{\"benchmark\":\"%s\",\"ops\":%d,\"ops_per_sec\":%.2f,\"mean_us\":%.2f,"
+                "\"p50_us\":%.2f,\"p90_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f,\"bytes_per_op\":%zu,"
+                "\"mb_per_sec\":%.2f}\n", name, n, n / seconds, mean, p50, p90, p99, max, bytes, mb);
+    else
+        fprintf(report_out, "%-14s %6d %11.1f %11.1f %11.1f %11.1f %11.1f %11.1f %9.1f\n", name, n, n / seconds,
+                mean, p50, p90, p99, max, mb);
+    fflush(report_out);
+    free(samples);
+}
+
+/*
+ * Data generators. Everything is derived from a fixed seed, so every run
+ * sees the same data.
+ */
+unsigned rng_state = 1;
+
+unsigned rng() {
+    rng_state = rng_state * 1103515245 + 12345;
+    return rng_state >> 8;
+}
+
+/**
+ * Text of about size bytes: numbered lines of words, now and then one of
+ * the words highlight looks for
+ */
+void generate_text(const char *path, size_t size) {
+    static const char *words[] = {"the", "shell", "reads", "a", "line", "and", "runs", "every", "command",
+                                  "in", "it", "pipeline", "process", "file", "with", "data", "error",
+                                  "warning", "fatal", "status"};
+    FILE *f = fopen(path, "w");
+    for (size_t written = 0, line = 0; written < size; ++line) {
+        written += fprintf(f, "%zu", line);
+        for (int w = 0, count = 4 + rng() % 12; w < count; ++w)
+            written += fprintf(f, " %s", words[rng() % 20]);
+        fputc('\n', f);
+        written++;
+    }
+    fclose(f);
+}
+
+/**
+ * A copy of a text file with one line in every changed lines rewritten
+ */
+void generate_edited(const char *from, const char *to, int every) {
+    FILE *in = fopen(from, "r"), *out = fopen(to, "w");
+    char *line = NULL;
+    size_t capacity = 0;
+    for (long i = 0; getline(&line, &capacity, in) != -1; ++i) {
+        if (i % every == every / 2)
+            fprintf(out, "%ld changed line %u\n", i, rng());
+        else
+            fputs(line, out);
+    }
+    free(line);
+    fclose(in);
+    fclose(out);
+}
+
+/**
+ * Pseudo-random bytes, and a copy with one of them changed per MB
+ */
+void generate_binary(const char *path, const char *edited, size_t size) {
+    FILE *f = fopen(path, "w"), *g = fopen(edited, "w");
+    unsigned *block = malloc(1 << 20);
+    for (size_t written = 0; written < size; written += 1 << 20) {
+        for (size_t i = 0; i < (1 << 20) / sizeof(unsigned); ++i)
+            block[i] = rng();
+        fwrite(block, 1, 1 << 20, f);
+        ((char *) block)[rng() % (1 << 20)] ^= 0x5a;
+        fwrite(block, 1, 1 << 20, g);
+    }
+    free(block);
+    fclose(f);
+    fclose(g);
+}
+
+char *generate_line(size_t size) {
+    static const char *words[] = {"\"quoted word with spaces\"", "'single quoted'", "esc\\ aped", "|", "grep",
+                                  "-v", ">out.txt", "2>err.log", "&&", "echo", ";", "src/module/file_0001.c",
+                                  "a\"b c\"d", "<in.txt", "--verbose"};
+    char *line = malloc(size + 64);
+    size_t len = sprintf(line, "cmd");
+    while (len < size) {
+        const char *word = words[rng() % 15];
+        if (word[0] == '|' || word[0] == '&' || word[0] == ';')
+            len += sprintf(line + len, " %s cmd", word); // keep the grammar valid
+        else
+            len += sprintf(line + len, " %s", word);
+    }
+    return line;
+}
+
+/*
+ * Benchmarks
+ */
+struct parse_case {
+    char *pristine, *buf;
+    size_t length;
+};
+
+void parse_op(void *arg) {
+    struct parse_case *p = arg;
+    memcpy(p->buf, p->pristine, p->length + 1); // parse_command tokenizes in place
+    struct command_t *command = arena_zalloc(&line_arena, sizeof(struct command_t));
+    parse_command(p->buf, command);
+    arena_reset(&line_arena);
+}
+
+void line_op(void *arg) {
+    run_line(arg);
+}
+
+void bench_parse() {
+    struct parse_case p;
+    p.pristine = generate_line(1 << 20);
+    p.length = strlen(p.pristine);
+    p.buf = malloc(p.length + 1);
+    measure("parse", parse_op, &p, quick ? 10 : 100, p.length);
+    free(p.buf);
+    free(p.pristine);
+}
+
+void bench_spawn() {
+    measure("spawn", line_op, "true", quick ? 100 : 2000, 0);
+}
+
+void bench_pipeline() {
+    char path[PATH_MAX + 16], line[2 * PATH_MAX];
+    size_t size = (quick ? 8 : 128) << 20;
+    snprintf(path, sizeof(path), "%s/pipeline.txt", data_dir);
+    generate_text(path, size);
+    snprintf(line, sizeof(line), "cat %s | cat | wc -c", path);
+    measure("pipeline", line_op, line, quick ? 5 : 20, size);
+}
+
+void bench_kdiff() {
+    char a[PATH_MAX + 16], b[PATH_MAX + 16], line[3 * PATH_MAX];
+    size_t text = (quick ? 4 : 64) << 20, binary = (quick ? 16 : 256) << 20;
+    snprintf(a, sizeof(a), "%s/kdiff-a.1", data_dir);
+    snprintf(b, sizeof(b), "%s/kdiff-a.2", data_dir);
+    generate_text(a, text);
+    generate_edited(a, b, 100);
+    snprintf(line, sizeof(line), "kdiff -a %s %s", a, b);
+    measure("kdiff-a", line_op, line, quick ? 3 : 10, text);
+
+    snprintf(a, sizeof(a), "%s/kdiff-b.1", data_dir);
+    snprintf(b, sizeof(b), "%s/kdiff-b.2", data_dir);
+    generate_binary(a, b, binary);
+    snprintf(line, sizeof(line), "kdiff -b %s %s", a, b);
+    measure("kdiff-b", line_op, line, quick ? 3 : 10, binary);
+}
+
+void bench_highlight() {
+    char path[PATH_MAX + 16], line[2 * PATH_MAX];
+    size_t size = (quick ? 8 : 128) << 20;
+    snprintf(path, sizeof(path), "%s/highlight.txt", data_dir);
+    generate_text(path, size);
+    snprintf(line, sizeof(line), "highlight -w error red -w warning yellow -w fatal magenta %s", path);
+    measure("highlight", line_op, line, quick ? 3 : 10, size);
+}
+
+void bench_shortdir() {
+    int count = quick ? 500 : 5000;
+    char line[64];
+    // bookmarks go to the data directory, all of them pointing at it
+    setenv("SEASHELL_HOME", data_dir, 1);
+    if (chdir(data_dir) == -1)
+        return;
+    for (int i = 0; i < count; ++i) {
+        char name[32];
+        snprintf(name, sizeof(name), "mark%05d", i);
+        bookmark_update(name, data_dir);
+    }
+    snprintf(line, sizeof(line), "shortdir set mark%05d", count / 2);
+    measure("shortdir-set", line_op, line, quick ? 20 : 200, 0);
+    snprintf(line, sizeof(line), "shortdir jump mark%05d", count / 3);
+    measure("shortdir-jump", line_op, line, quick ? 200 : 5000, 0);
+    measure("shortdir-find", line_op, "shortdir jump tmp seashell-bench", quick ? 200 : 5000, 0);
+    measure("shortdir-list", line_op, "shortdir list", quick ? 20 : 200, 0);
+}
+
+struct {
+    const char *name; // the first of the benchmarks it runs, for selecting it
+    void (*run)(void);
+} benchmarks[] = {
+    {"parse", bench_parse}, {"spawn", bench_spawn}, {"pipeline", bench_pipeline}, {"kdiff", bench_kdiff},
+    {"highlight", bench_highlight}, {"shortdir", bench_shortdir},
+};
+
+int main(int argc, char **argv) {
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; ++i) {
+        if (strcmp(argv[i], "-j") == 0) {
+            report_json = true;
+        } else if (strcmp(argv[i], "-q") == 0) {
+            quick = true;
+        } else {
+            fprintf(stderr, "usage: %s [-j] [-q] [benchmark...]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    filters = argv + i;
+    filter_count = argc - i;
+    char cwd[PATH_MAX];
+    const char *tmp = getenv("TMPDIR");
+    snprintf(data_dir, sizeof(data_dir), "%s/seashell-bench.XXXXXX", tmp ? tmp : "/tmp");
+    if (!getcwd(cwd, sizeof(cwd)) || !mkdtemp(data_dir)) {
+        perror("seashell-bench");
+        return 1;
+    }
+    init_job_control(false);
+    report_out = fdopen(dup(STDOUT_FILENO), "w");
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+
+    if (!report_json)
+        fprintf(report_out, "%-14s %6s %11s %11s %11s %11s %11s %11s %9s\n", "benchmark", "ops", "ops/s",
+                "mean us", "p50 us", "p90 us", "p99 us", "max us", "MB/s");
+    for (size_t k = 0; k < sizeof(benchmarks) / sizeof(benchmarks[0]); ++k)
+        if (selected(benchmarks[k].name, true))
+            benchmarks[k].run();
+
+    // the data directory holds only files
+    if (chdir(cwd) == -1)
+        perror(cwd);
+    DIR *dir = opendir(data_dir);
+    for (struct dirent *e; dir && (e = readdir(dir));) {
+        char path[2 * PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", data_dir, e->d_name);
+        if (e->d_name[0] != '.' || (e->d_name[1] && strcmp(e->d_name, "..") != 0))
+            unlink(path);
+    }
+    if (dir)
+        closedir(dir);
+    rmdir(data_dir);
+    return 0;
+}
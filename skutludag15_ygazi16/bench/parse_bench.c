@@ -0,0 +1,82 @@
+/*
+ * Parse benchmark: parse_command() on generated multi-megabyte command lines.
+ *
+ * Each line mixes plain words, quoted words with spaces, escapes, pipes,
+ * redirections and && / ; lists. The line is restored from a pristine copy
+ * before every run (parse_command tokenizes in place); that copy is not timed.
+ *
+ *   gcc -O2 -pthread -o parse_bench bench/parse_bench.c
+ *   ./parse_bench [MB per line] [runs]
+ */
+#define SEASHELL_NO_MAIN
+#include "../seashell.c"
+
+long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/**
+ * Generate a command line of about size bytes
+ * @param  style  0: plain words, 1: mixed quoting and operators
+ */
+char *generate_line(size_t size, int style) {
+    static const char *plain[] = {"src/module/file_0001.c", "-O2", "build/output.o", "--verbose",
+                                  "include/header.h", "x", "lib/libfoo.so.1.2.3"};
+    static const char *mixed[] = {"\"quoted word with spaces\"", "'single quoted'", "esc\\ aped",
+                                  "|", "grep", "-v", ">out.txt", "2>err.log", "&&", "echo", ";",
+                                  "ls", "a\"b c\"d", "<in.txt"};
+    char *line = malloc(size + 64);
+    size_t len = 0;
+    unsigned seed = 1;
+    len += sprintf(line, "cmd");
+    while (len < size) {
+        seed = seed * 1103515245 + 12345;
+        const char *word = style ? mixed[(seed >> 16) % 14] : plain[(seed >> 16) % 7];
+        if (style && (word[0] == '|' || word[0] == '&' || word[0] == ';'))
+            len += sprintf(line + len, " %s cmd", word); // keep the grammar valid
+        else
+            len += sprintf(line + len, " %s", word);
+    }
+    return line;
+}
+
+int main(int argc, char **argv) {
+    size_t mb = argc > 1 ? atoi(argv[1]) : 4;
+    int runs = argc > 2 ? atoi(argv[2]) : 10;
+    const char *styles[] = {"plain", "mixed"};
+
+    for (int style = 0; style < 2; ++style) {
+        char *pristine = generate_line(mb << 20, style);
+        size_t len = strlen(pristine);
+        char *buf = malloc(len + 1);
+        long best = -1, total = 0;
+        int commands = 0, words = 0;
+
+        for (int r = 0; r < runs; ++r) {
+            memcpy(buf, pristine, len + 1);
+            struct command_t *command = arena_zalloc(&line_arena, sizeof(struct command_t));
+            long t = now_ns();
+            parse_command(buf, command);
+            t = now_ns() - t;
+            total += t;
+            if (best < 0 || t < best)
+                best = t;
+
+            commands = words = 0;
+            for (struct command_t *l = command; l; l = l->next_list)
+                for (struct command_t *c = l; c; c = c->next) {
+                    commands++;
+                    words += c->arg_count + 1;
+                }
+            arena_reset(&line_arena);
+        }
+        printf("%-6s %6.1f MB line: %8d commands %9d words  best %7.2f ms (%7.1f MB/s)  mean %7.2f ms\n",
+               styles[style], len / 1048576.0, commands, words, best / 1e6,
+               len / 1048576.0 / (best / 1e9), total / 1e6 / runs);
+        free(buf);
+        free(pristine);
+    }
+    return 0;
+}
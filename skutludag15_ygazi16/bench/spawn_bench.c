@@ -0,0 +1,83 @@
+/*
+ * Micro-benchmark: external command launch latency.
+ *
+ * Compares the old launch path (fork() of the whole shell + execv of
+ * "/bin/<name>") with spawn_command() (cached $PATH lookup + posix_spawn).
+ * A ballast allocation simulates a shell that has grown large, which is what
+ * makes fork()'s page table copy expensive.
+ *
+ *   gcc -O2 -pthread -o spawn_bench bench/spawn_bench.c
+ *   ./spawn_bench [iterations] [ballast MB] [command]
+ */
+#define SEASHELL_NO_MAIN
+#include "../seashell.c"
+
+long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int compare_long(const void *a, const void *b) {
+    long x = *(const long *) a, y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+void report(const char *label, long *samples, int n) {
+    long total = 0;
+    for (int i = 0; i < n; ++i)
+        total += samples[i];
+    qsort(samples, n, sizeof(long), compare_long);
+    printf("%-12s mean %8.1f us  p50 %8.1f us  p99 %8.1f us  %8.0f launches/s\n", label,
+           total / 1000.0 / n, samples[n / 2] / 1000.0, samples[n * 99 / 100] / 1000.0,
+           n * 1e9 / total);
+}
+
+/**
+ * The launch path seashell used before spawn_command()
+ */
+void legacy_launch(struct command_t *command) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        char **argv = command_argv(command);
+        char path[20] = "/bin/";
+        strncat(path, command->name, sizeof(path) - 6);
+        execv(path, argv);
+        exit(0);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char **argv) {
+    int n = argc > 1 ? atoi(argv[1]) : 2000;
+    size_t ballast_mb = argc > 2 ? atoi(argv[2]) : 256;
+    char *name = argc > 3 ? argv[3] : "true";
+
+    char *ballast = malloc(ballast_mb << 20);
+    memset(ballast, 1, ballast_mb << 20); // fault it in so fork has to copy page tables
+
+    struct command_t command;
+    memset(&command, 0, sizeof(command));
+    command.name = name;
+
+    long *samples = malloc(sizeof(long) * n);
+    printf("%d launches of '%s', %zu MB resident ballast\n", n, name, ballast_mb);
+
+    for (int i = 0; i < n; ++i) {
+        long t = now_ns();
+        legacy_launch(&command);
+        samples[i] = now_ns() - t;
+    }
+    report("fork+execv", samples, n);
+
+    for (int i = 0; i < n; ++i) {
+        long t = now_ns();
+        launch_job(&command);
+        samples[i] = now_ns() - t;
+    }
+    report("posix_spawn", samples, n);
+
+    free(samples);
+    free(ballast);
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <limits.h>
 #include <unistd.h>
 #include <sys/wait.h>
@@ -12,6 +13,36 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <spawn.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio_ext.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <glob.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <dlfcn.h>
+#include <locale.h>
+#include <langinfo.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <linux/perf_event.h>
+#include <stdatomic.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "seashell_plugin.h"
 const char *sysname = "seashell";
 
 #define ANSI_COLOR_RED     "\x1b[31m"
@@ -21,20 +52,48 @@ const char *sysname = "seashell";
 
 #define SIZE 516
 
+extern char **environ;
+
+int last_status = 0; // exit status of the last foreground command
+
 enum return_codes {
     SUCCESS = 0,
     EXIT = 1,
     UNKNOWN = 2,
 };
 
+enum redirect_kind {
+    REDIRECT_IN = 0, // <
+    REDIRECT_OUT = 1, // >
+    REDIRECT_APPEND = 2, // >>
+    REDIRECT_ERR = 3, // 2>
+    REDIRECT_ALL = 4, // &>
+    REDIRECT_HERE = 5, // <<<
+    REDIRECT_COUNT,
+};
+
+enum token_type {
+    TOKEN_END,
+    TOKEN_WORD,
+    TOKEN_PIPE, // |
+    TOKEN_AND, // &&
+    TOKEN_OR, // ||
+    TOKEN_SEMI, // ; or newline
+    TOKEN_AMP, // &
+    TOKEN_REDIRECT, // < <<< > >> 2> &>
+    TOKEN_ERROR,
+};
+
 struct command_t {
     char *name;
     bool background;
-    bool auto_complete;
     int arg_count;
     char **args;
-    char *redirects[3]; // in/out redirection
+    char **argv; // name, args..., NULL; what exec wants (args == argv + 1)
+    char *redirects[REDIRECT_COUNT]; // in/out redirection
     struct command_t *next; // for piping
+    struct command_t *next_list; // next pipeline after ; & && ||
+    int list_op; // token separating this pipeline from next_list
 };
 
 struct Queue {
@@ -77,7 +136,6 @@ void enqueue(struct Queue* queue, char *item)
                   % queue->capacity;
     queue->array[queue->rear] = item;
     queue->size = queue->size + 1;
-    printf("%s enqueued to queue\n", item);
 }
 
 char* dequeue(struct Queue* queue)
@@ -105,6 +163,14 @@ char* rear(struct Queue* queue)
     return queue->array[queue->rear];
 }
 
+// i-th item from the front
+char* queue_at(struct Queue* queue, int i)
+{
+    if (i < 0 || i >= queue->size)
+        return "*";
+    return queue->array[(queue->front + i) % queue->capacity];
+}
+
 /**
  * Prints a command struct
  * @param struct command_t *
@@ -113,9 +179,8 @@ void print_command(struct command_t *command) {
     int i = 0;
     printf("Command: <%s>\n", command->name);
     printf("\tIs Background: %s\n", command->background ? "yes" : "no");
-    printf("\tNeeds Auto-complete: %s\n", command->auto_complete ? "yes" : "no");
     printf("\tRedirects:\n");
-    for (i = 0; i < 3; i++)
+    for (i = 0; i < REDIRECT_COUNT; i++)
         printf("\t\t%d: %s\n", i, command->redirects[i] ? command->redirects[i] : "N/A");
     printf("\tArguments (%d):\n", command->arg_count);
     for (i = 0; i < command->arg_count; ++i)
@@ -124,811 +189,8647 @@ void print_command(struct command_t *command) {
         printf("\tPiped to:\n");
         print_command(command->next);
     }
+    if (command->next_list) {
+        printf("\tThen (%s):\n", command->list_op == TOKEN_AND ? "&&"
+                                  : command->list_op == TOKEN_OR ? "||" : command->list_op == TOKEN_AMP ? "&" : ";");
+        print_command(command->next_list);
+    }
 
 
 }
 
-/**
- * Release allocated memory of a command
- * @param  command [description]
- * @return         [description]
+/*
+ * Tracing. While `trace start` is on, the shell records timestamped
+ * events: the prompt waiting for a line, parse_command, builtins, the
+ * launch of each pipeline and the posix_spawn or fork of every stage,
+ * waiting for the job, stages exiting, and the bytes moved by forwarding
+ * threads and in-kernel copies. Each thread writes to a ring of its own,
+ * so recording takes no lock and no atomic read-modify-write: the writer
+ * fills a slot, then publishes it by storing the new head with release
+ * order. A reader copies the ring and drops whatever the writer may have
+ * overwritten meanwhile. Rings of threads that exit are taken over by new
+ * ones. When tracing is off an event costs one predictable branch.
+ * `trace dump` writes Chrome trace JSON (chrome://tracing, Perfetto), and
+ * `trace dump -b` a compact binary log:
+ *
+ *   "SSTRACE1", u32 event size, u32 number of kinds, the kind names each
+ *   ending in NUL, then struct trace_event records in time order
+ *
+ * SEASHELL_TRACE=file starts tracing at startup and dumps JSON to file on exit.
  */
-int free_command(struct command_t *command) {
-    if (command->arg_count) {
-        for (int i = 0; i < command->arg_count; ++i)
-            free(command->args[i]);
-        free(command->args);
-    }
-    for (int i = 0; i < 3; ++i)
-        if (command->redirects[i])
-            free(command->redirects[i]);
-    if (command->next) {
-        free_command(command->next);
-        command->next = NULL;
-    }
-    free(command->name);
-    free(command);
-    return 0;
+#define TRACE_RING_EVENTS (1 << 15) // per thread, a power of two
+
+enum trace_kind {
+    TRACE_PROMPT, TRACE_PARSE, TRACE_BUILTIN, TRACE_LAUNCH, TRACE_SPAWN, TRACE_FORK,
+    TRACE_WAIT, TRACE_EXIT, TRACE_FORWARD, TRACE_COPY, TRACE_KINDS
+};
+
+const char *trace_kind_names[TRACE_KINDS] = {
+    "prompt", "parse", "builtin", "launch", "spawn", "fork", "wait", "exit", "forward", "copy"
+};
+
+struct trace_event {
+    uint64_t time; // ns, CLOCK_MONOTONIC
+    int64_t value; // pid, status, bytes, depending on the kind
+    uint32_t tid;
+    uint16_t kind; // enum trace_kind
+    char phase; // 'B'egin, 'E'nd or 'i'nstant, as in the Chrome format
+    char detail[17]; // a command name and the like, cut short
+};
+
+struct trace_ring {
+    struct trace_ring *next; // all rings, pushed at the front
+    _Atomic int owner; // 0 when its thread has exited
+    uint32_t tid;
+    _Atomic uint64_t head; // events written so far
+    struct trace_event events[TRACE_RING_EVENTS];
+};
+
+struct {
+    _Atomic bool enabled;
+    _Atomic(struct trace_ring *) rings;
+    uint64_t started; // events before it are not dumped
+    pthread_key_t key; // releases a thread's ring when it exits
+    pthread_once_t once;
+} trace_state = {.once = PTHREAD_ONCE_INIT};
+
+__thread struct trace_ring *trace_ring_local;
+
+// record an event if tracing is on
+#define TRACE(kind, phase, detail, value) \
+    do { \
+        if (__builtin_expect(atomic_load_explicit(&trace_state.enabled, memory_order_relaxed), 0)) \
+            trace_record(kind, phase, detail, value); \
+    } while (0)
+
+uint64_t trace_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000u + t.tv_nsec;
 }
 
-/**
- * Show the command prompt
- * @return [description]
- */
-int show_prompt() {
-    char cwd[1024], hostname[1024];
-    gethostname(hostname, sizeof(hostname));
-    getcwd(cwd, sizeof(cwd));
-    printf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
-    return 0;
+void trace_release(void *ring) {
+    atomic_store(&((struct trace_ring *) ring)->owner, 0);
+}
+
+void trace_key_create() {
+    pthread_key_create(&trace_state.key, trace_release);
 }
 
 /**
- * Parse a command string into a command struct
- * @param  buf     [description]
- * @param  command [description]
- * @return         0
+ * The calling thread's ring: one left by a thread that exited, or a new one
  */
-int parse_command(char *buf, struct command_t *command) {
-    const char *splitters = " \t"; // split at whitespace
-    int index, len;
-    len = strlen(buf);
-    while (len > 0 && strchr(splitters, buf[0]) != NULL) // trim left whitespace
-    {
-        buf++;
-        len--;
-    }
-    while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
-        buf[--len] = 0; // trim right whitespace
-
-    if (len > 0 && buf[len - 1] == '?') // auto-complete
-        command->auto_complete = true;
-    if (len > 0 && buf[len - 1] == '&') // background
-        command->background = true;
-
-    char *pch = strtok(buf, splitters);
-    command->name = (char *) malloc(strlen(pch) + 1);
-    if (pch == NULL)
-        command->name[0] = 0;
-    else
-        strcpy(command->name, pch);
+struct trace_ring *trace_ring() {
+    if (trace_ring_local)
+        return trace_ring_local;
+    pthread_once(&trace_state.once, trace_key_create);
+    struct trace_ring *ring = atomic_load(&trace_state.rings);
+    for (; ring; ring = ring->next) {
+        int free_ring = 0;
+        if (atomic_compare_exchange_strong(&ring->owner, &free_ring, 1))
+            break;
+    }
+    if (!ring) {
+        ring = calloc(1, sizeof(struct trace_ring));
+        ring->owner = 1;
+        ring->next = atomic_load(&trace_state.rings);
+        while (!atomic_compare_exchange_weak(&trace_state.rings, &ring->next, ring))
+            ;
+    }
+    ring->tid = gettid();
+    trace_ring_local = ring;
+    pthread_setspecific(trace_state.key, ring);
+    return ring;
+}
 
-    command->args = (char **) malloc(sizeof(char *));
+void trace_record(enum trace_kind kind, char phase, const char *detail, int64_t value) {
+    struct trace_ring *ring = trace_ring();
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct trace_event *e = &ring->events[head & (TRACE_RING_EVENTS - 1)];
+    atomic_thread_fence(memory_order_release); // keep the slot writes after the last head store
+    e->time = trace_now();
+    e->value = value;
+    e->tid = ring->tid;
+    e->kind = kind;
+    e->phase = phase;
+    strncpy(e->detail, detail ? detail : "", sizeof(e->detail) - 1);
+    e->detail[sizeof(e->detail) - 1] = 0;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
 
-    int redirect_index;
-    int arg_index = 0;
-    char temp_buf[1024], *arg;
-    while (1) {
-        // tokenize input on splitters
-        pch = strtok(NULL, splitters);
-        if (!pch) break;
-        arg = temp_buf;
-        strcpy(arg, pch);
-        len = strlen(arg);
-
-        if (len == 0) continue; // empty arg, go for next
-        while (len > 0 && strchr(splitters, arg[0]) != NULL) // trim left whitespace
-        {
-            arg++;
-            len--;
-        }
-        while (len > 0 && strchr(splitters, arg[len - 1]) != NULL) arg[--len] = 0; // trim right whitespace
-        if (len == 0) continue; // empty arg, go for next
-
-        // piping to another command
-        if (strcmp(arg, "|") == 0) {
-            struct command_t *c = malloc(sizeof(struct command_t));
-            int l = strlen(pch);
-            pch[l] = splitters[0]; // restore strtok termination
-            index = 1;
-            while (pch[index] == ' ' || pch[index] == '\t') index++; // skip whitespaces
-
-            parse_command(pch + index, c);
-            pch[l] = 0; // put back strtok termination
-            command->next = c;
-            continue;
-        }
-
-        // background process
-        if (strcmp(arg, "&") == 0)
-            continue; // handled before
-
-        // handle input redirection
-        redirect_index = -1;
-        if (arg[0] == '<')
-            redirect_index = 0;
-        if (arg[0] == '>') {
-            if (len > 1 && arg[1] == '>') {
-                redirect_index = 2;
-                arg++;
-                len--;
-            } else redirect_index = 1;
-        }
-        if (redirect_index != -1) {
-            command->redirects[redirect_index] = malloc(len);
-            strcpy(command->redirects[redirect_index], arg + 1);
-            continue;
-        }
-
-        // normal arguments
-        if (len > 2 && ((arg[0] == '"' && arg[len - 1] == '"')
-                        || (arg[0] == '\'' && arg[len - 1] == '\''))) // quote wrapped arg
-        {
-            arg[--len] = 0;
-            arg++;
-        }
-        command->args = (char **) realloc(command->args, sizeof(char *) * (arg_index + 1));
-        command->args[arg_index] = (char *) malloc(len + 1);
-        strcpy(command->args[arg_index++], arg);
-    }
-    command->arg_count = arg_index;
-    return 0;
+void trace_start() {
+    trace_state.started = trace_now();
+    atomic_store(&trace_state.enabled, true);
 }
 
-void prompt_backspace() {
-    putchar(8); // go back 1
-    putchar(' '); // write empty over
-    putchar(8); // go back 1 again
+int compare_trace_events(const void *a, const void *b) {
+    const struct trace_event *x = a, *y = b;
+    return x->time < y->time ? -1 : x->time > y->time;
 }
 
 /**
- * Prompt a command from the user
- * @param  buf      [description]
- * @param  buf_size [description]
- * @return          [description]
+ * Everything recorded since tracing started, in time order
+ * @return  a malloc'ed array of *count events
  */
-int prompt(struct command_t *command) {
-    int index = 0;
-    char c;
-    char buf[4096];
-    static char oldbuf[4096];
-
-    // tcgetattr gets the parameters of the current terminal
-    // STDIN_FILENO will tell tcgetattr that it should write the settings
-    // of stdin to oldt
-    static struct termios backup_termios, new_termios;
-    tcgetattr(STDIN_FILENO, &backup_termios);
-    new_termios = backup_termios;
-    // ICANON normally takes care that one line at a time will be processed
-    // that means it will return if it sees a "\n" or an EOF or an EOL
-    new_termios.c_lflag &= ~(ICANON | ECHO); // Also disable automatic echo. We manually echo each char.
-    // Those new settings will be set to STDIN
-    // TCSANOW tells tcsetattr to change attributes immediately.
-    tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
-
-
-    //FIXME: backspace is applied before printing chars
-    show_prompt();
-    int multicode_state = 0;
-    buf[0] = 0;
-    while (1) {
-        c = getchar();
-        // printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
-
-        if (c == 9) // handle tab
-        {
-            buf[index++] = '?'; // autocomplete
-            break;
+struct trace_event *trace_collect(size_t *count) {
+    size_t n = 0, capacity = 0;
+    struct trace_event *all = NULL;
+    for (struct trace_ring *ring = atomic_load(&trace_state.rings); ring; ring = ring->next) {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+        if (n + (head - first) > capacity) {
+            capacity = (n + (head - first)) * 2;
+            all = realloc(all, sizeof(struct trace_event) * capacity);
         }
+        size_t from = n;
+        for (uint64_t i = first; i < head; ++i)
+            all[n++] = ring->events[i & (TRACE_RING_EVENTS - 1)];
+        // slots the writer got to while they were copied may be torn,
+        // including the one for event now that it may be filling
+        atomic_thread_fence(memory_order_acquire);
+        uint64_t now = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        uint64_t overwritten = now + 1 > TRACE_RING_EVENTS ? now + 1 - TRACE_RING_EVENTS : 0;
+        size_t skip = overwritten > first ? overwritten - first : 0;
+        skip = skip < n - from ? skip : n - from;
+        memmove(all + from, all + from + skip, sizeof(struct trace_event) * (n - from - skip));
+        n -= skip;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < n; ++i)
+        if (all[i].time >= trace_state.started)
+            all[kept++] = all[i];
+    qsort(all, kept, sizeof(struct trace_event), compare_trace_events);
+    *count = kept;
+    return all;
+}
 
-        if (c == 127) // handle backspace
-        {
-            if (index > 0) {
-                prompt_backspace();
-                index--;
+/**
+ * Write the trace as Chrome trace JSON, or in the binary format
+ * @return  0, or -1 if writing failed
+ */
+int trace_dump(FILE *f, bool binary) {
+    size_t count;
+    struct trace_event *events = trace_collect(&count);
+    if (binary) {
+        uint32_t header[2] = {sizeof(struct trace_event), TRACE_KINDS};
+        fwrite("SSTRACE1", 1, 8, f);
+        fwrite(header, sizeof(header), 1, f);
+        for (int k = 0; k < TRACE_KINDS; ++k)
+            fwrite(trace_kind_names[k], 1, strlen(trace_kind_names[k]) + 1, f);
+        fwrite(events, sizeof(struct trace_event), count, f);
+    } else {
+        fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+        for (size_t i = 0; i < count; ++i) {
+            struct trace_event *e = &events[i];
+            fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"seashell\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%u",
+                    i ? "," : "", trace_kind_names[e->kind], e->phase, e->time / 1e3, getpid(), e->tid);
+            if (e->phase == 'i')
+                fprintf(f, ",\"s\":\"t\"");
+            fprintf(f, ",\"args\":{\"detail\":\"");
+            for (const char *p = e->detail; *p; ++p) {
+                if (*p == '"' || *p == '\\')
+                    fprintf(f, "\\%c", *p);
+                else if ((unsigned char) *p < 0x20)
+                    fprintf(f, "\\u%04x", *p);
+                else
+                    fputc(*p, f);
             }
-            continue;
-        }
-        if (c == 27 && multicode_state == 0) // handle multi-code keys
-        {
-            multicode_state = 1;
-            continue;
-        }
-        if (c == 91 && multicode_state == 1) {
-            multicode_state = 2;
-            continue;
+            fprintf(f, "\",\"value\":%lld}}", (long long) e->value);
         }
-        if (c == 65 && multicode_state == 2) // up arrow
-        {
-            int i;
-            while (index > 0) {
-                prompt_backspace();
-                index--;
-            }
-            for (i = 0; oldbuf[i]; ++i) {
-                putchar(oldbuf[i]);
-                buf[i] = oldbuf[i];
-            }
-            index = i;
-            continue;
-        } else
-            multicode_state = 0;
-
-        putchar(c); // echo the character
-        buf[index++] = c;
-        if (index >= sizeof(buf) - 1) break;
-        if (c == '\n') // enter key
-            break;
-        if (c == 4) // Ctrl+D
-            return EXIT;
+        fprintf(f, "\n]}\n");
     }
-    if (index > 0 && buf[index - 1] == '\n') // trim newline from the end
-        index--;
-    buf[index++] = 0; // null terminate string
-
-    strcpy(oldbuf, buf);
+    free(events);
+    return fflush(f) == 0 && !ferror(f) ? 0 : -1;
+}
 
-    parse_command(buf, command);
+void trace_dump_at_exit() {
+    FILE *f = fopen(getenv("SEASHELL_TRACE"), "w");
+    if (f) {
+        trace_dump(f, false);
+        fclose(f);
+    }
+}
 
-    // print_command(command); // DEBUG: uncomment for debugging
+/**
+ * Start tracing if SEASHELL_TRACE names a file to dump it to on exit
+ */
+void trace_init() {
+    const char *env = getenv("SEASHELL_TRACE");
+    if (env && *env) {
+        trace_start();
+        atexit(trace_dump_at_exit);
+    }
+}
 
-    // restore the old settings
-    tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+/**
+ * trace start | trace stop | trace dump [-b] [file] | trace
+ */
+int builtin_trace(struct command_t *command) {
+    const char *op = command->arg_count > 0 ? command->args[0] : "";
+    last_status = 0;
+    if (strcmp(op, "start") == 0 && command->arg_count == 1) {
+        trace_start();
+    } else if (strcmp(op, "stop") == 0 && command->arg_count == 1) {
+        atomic_store(&trace_state.enabled, false);
+    } else if (strcmp(op, "dump") == 0 && (command->arg_count <= 2
+                                          || (command->arg_count == 3 && strcmp(command->args[1], "-b") == 0))) {
+        bool binary = command->arg_count > 1 && strcmp(command->args[1], "-b") == 0;
+        const char *path = command->arg_count > 1 + binary ? command->args[1 + binary] : NULL;
+        FILE *f = path ? fopen(path, "w") : stdout;
+        if (!f || trace_dump(f, binary) == -1) {
+            printf("-%s: %s: %s: %s\n", sysname, command->name, path ? path : "stdout", strerror(errno));
+            last_status = 1;
+        }
+        if (f && f != stdout)
+            fclose(f);
+    } else if (command->arg_count == 0) {
+        size_t rings = 0, count;
+        for (struct trace_ring *ring = atomic_load(&trace_state.rings); ring; ring = ring->next)
+            rings++;
+        free(trace_collect(&count));
+        printf("tracing is %s, %zu events from %zu threads\n", atomic_load(&trace_state.enabled) ? "on" : "off",
+               count, rings);
+    } else {
+        printf("usage: trace start|stop\n"
+               "       trace dump [-b] [file]\n");
+        last_status = 2;
+    }
     return SUCCESS;
 }
 
-int process_command(struct command_t *command);
-
-int main() {
-    while (1) {
-        struct command_t *command = malloc(sizeof(struct command_t));
-        memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
+/*
+ * Bump allocator for everything parse_command builds. One arena holds a
+ * whole command line (the line copy, every command_t and the argument
+ * vectors) and is reset in one go once the line has been processed.
+ */
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_KEEP_MAX (4 * 1024 * 1024) // larger blocks are given back on reset
 
-        int code;
-        code = prompt(command);
-        if (code == EXIT) break;
+struct arena_block {
+    struct arena_block *prev;
+    size_t size, used;
+    char data[];
+};
 
-        code = process_command(command);
-        if (code == EXIT) break;
+struct arena {
+    struct arena_block *head;
+};
 
-        free_command(command);
+struct arena line_arena; // owns the command tree of the current line
+
+void *arena_alloc(struct arena *arena, size_t size) {
+    size = (size + 15) & ~(size_t) 15;
+    struct arena_block *b = arena->head;
+    if (!b || b->used + size > b->size) {
+        size_t block_size = b ? b->size * 2 : ARENA_BLOCK_SIZE;
+        while (block_size < size)
+            block_size *= 2;
+        struct arena_block *nb = malloc(sizeof(struct arena_block) + block_size);
+        nb->prev = b;
+        nb->size = block_size;
+        nb->used = 0;
+        arena->head = b = nb;
     }
-
-    printf("\n");
-    return 0;
+    void *p = b->data + b->used;
+    b->used += size;
+    return p;
 }
 
-void red () {
-  printf("\033[1;31m");
-}
-void blue () {
-  printf("\033[0;34m");
-}
-void green () {
-  printf("\033[0;32m");
-}
-void reset () {
-  printf("\033[0m");
+void *arena_zalloc(struct arena *arena, size_t size) {
+    return memset(arena_alloc(arena, size), 0, size);
 }
 
-void checkHostName(int hostname)
-{
-    if (hostname == -1)
-    {
-        perror("gethostname");
-        exit(1);
-    }
+char *arena_strndup(struct arena *arena, const char *s, size_t len) {
+    char *p = arena_alloc(arena, len + 1);
+    memcpy(p, s, len);
+    p[len] = 0;
+    return p;
 }
-  
-// Returns host information corresponding to host name
-void checkHostEntry(struct hostent * hostentry)
-{
-    if (hostentry == NULL)
-    {
-        perror("gethostbyname");
-        exit(1);
+
+/**
+ * Drop everything allocated from the arena, keeping the newest (largest)
+ * block for the next line unless it grew unreasonably big
+ */
+void arena_reset(struct arena *arena) {
+    struct arena_block *b = arena->head;
+    if (!b)
+        return;
+    while (b->prev) {
+        struct arena_block *prev = b->prev->prev;
+        free(b->prev);
+        b->prev = prev;
     }
-}
-  
-// Converts space-delimited IPv4 addresses
-// to dotted-decimal format
-void checkIPbuffer(char *IPbuffer)
-{
-    if (NULL == IPbuffer)
-    {
-        perror("inet_ntoa");
-        exit(1);
+    if (b->size > ARENA_KEEP_MAX) {
+        free(b);
+        arena->head = NULL;
+        return;
     }
+    b->used = 0;
 }
 
-int process_command(struct command_t *command) {
+/*
+ * Lexer. The command line is scanned once, left to right. Words are
+ * unquoted in place: they stay inside the caller's buffer and are only
+ * shifted when quotes or backslashes have to be removed, so a plain word
+ * costs nothing but the NUL written after it. Runs of ordinary bytes are
+ * skipped 16 at a time with SSE2.
+ */
+const char *token_names[] = {"newline", "word", "|", "&&", "||", ";", "&", "redirection", "error"};
 
-    int r;
-    if (strcmp(command->name, "") == 0) return SUCCESS;
+// bytes that end a word or change how it is read
+const unsigned char lex_special[256] = {
+    [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\r'] = 1, ['"'] = 1, ['\''] = 1, ['\\'] = 1,
+    ['|'] = 1, ['&'] = 1, [';'] = 1, ['<'] = 1, ['>'] = 1,
+};
 
-    if (strcmp(command->name, "exit") == 0)
-        return EXIT;
+struct lexer {
+    char *p, *end;
+    char *word; // TOKEN_WORD: the unquoted, NUL terminated word
+    int redirect; // TOKEN_REDIRECT: index into command->redirects
+    char *held_at; // a word's NUL overwrote the byte here...
+    char held; // ...which was this
+};
 
-    if (strcmp(command->name, "cd") == 0) {
-        if (command->arg_count > 0) {
-            r = chdir(command->args[0]);
-            if (r == -1)
-                printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
-            return SUCCESS;
-        }
+/**
+ * Find the first byte in [p, end) that lex_special marks
+ */
+char *lex_find_special(char *p, char *end) {
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'), nl = _mm_set1_epi8('\n'),
+            cr = _mm_set1_epi8('\r'), dq = _mm_set1_epi8('"'), sq = _mm_set1_epi8('\''),
+            bs = _mm_set1_epi8('\\'), bar = _mm_set1_epi8('|'), amp = _mm_set1_epi8('&'),
+            semi = _mm_set1_epi8(';'), lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>');
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        __m128i m = _mm_or_si128(
+                _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, tab)),
+                             _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr))),
+                _mm_or_si128(
+                        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, dq), _mm_cmpeq_epi8(v, sq)),
+                                     _mm_or_si128(_mm_cmpeq_epi8(v, bs), _mm_cmpeq_epi8(v, bar))),
+                        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, semi)),
+                                     _mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)))));
+        int mask = _mm_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
     }
+#endif
+    while (p < end && !lex_special[(unsigned char) *p])
+        p++;
+    return p;
+}
 
-    if (strcmp(command->name, "shortdir") == 0) {
-
-        FILE *fptr = NULL;
-        FILE *fptrTemp = NULL;
-        remove("/home/abrakadabra/Desktop/LastTerm/COMP304/Project1/filesTemporary.txt");
-        fptrTemp = fopen("/home/abrakadabra/Desktop/LastTerm/COMP304/Project1/filesTemporary.txt", "a+");
-
-        if (strcmp(command->args[0], "set") == 0) {
-
-        	fptr = fopen("/home/abrakadabra/Desktop/LastTerm/COMP304/Project1/files.txt", "a+");
-        	char name[10];
-            char location[100];
-            while (fscanf(fptr, "%s %s", name, location) != EOF) {
-                if (strcmp(name, command->args[1]) == 0) {
-
-
-                } else {
+/**
+ * Byte at p, as it was before a word terminator was written over it
+ */
+char lex_peek(struct lexer *lx, char *p) {
+    if (p >= lx->end)
+        return 0;
+    return p == lx->held_at ? lx->held : *p;
+}
 
-                    fprintf(fptrTemp, "%s %s\n", name, location);
+/**
+ * Read a word starting at lx->p, removing quotes and backslashes in place
+ */
+int lex_word(struct lexer *lx) {
+    char *p = lx->p, *w = p, *end = lx->end;
+    lx->word = w;
+    while (p < end) {
+        char *q = lex_find_special(p, end);
+        if (w != p)
+            memmove(w, p, q - p); // only once quotes made the word shorter
+        w += q - p;
+        p = q;
+        if (p == end)
+            break;
 
+        char c = *p;
+        if (c == '\\') {
+            if (p + 1 < end)
+                *w++ = p[1];
+            p += 2;
+        } else if (c == '\'') {
+            q = memchr(p + 1, '\'', end - p - 1);
+            if (!q) {
+                printf("-%s: unexpected EOF while looking for matching `''\n", sysname);
+                return TOKEN_ERROR;
+            }
+            memmove(w, p + 1, q - p - 1);
+            w += q - p - 1;
+            p = q + 1;
+        } else if (c == '"') {
+            for (p++;; p++) {
+                if (p == end) {
+                    printf("-%s: unexpected EOF while looking for matching `\"'\n", sysname);
+                    return TOKEN_ERROR;
                 }
+                if (*p == '"')
+                    break;
+                if (*p == '\\' && p + 1 < end && strchr("\"\\$`\n", p[1]))
+                    p++;
+                *w++ = *p;
             }
-            remove("/home/abrakadabra/Desktop/LastTerm/COMP304/Project1/files.txt");
-            fclose(fptr);
-            fclose(fptrTemp);
-            fptr = fopen("/home/abrakadabra/Desktop/LastTerm/COMP304/Project1/files.txt", "a+");
-            fptrTemp = fopen("/home/abrakadabra/Desktop/LastTerm/COMP304/Project1/filesTemporary.txt", "a+");
-
-            while (fscanf(fptrTemp, "%s %s", name, location) != EOF) {
+            p++;
+        } else {
+            break; // whitespace or an operator
+        }
+    }
+    lx->p = p > end ? end : p;
+    if (w == lx->p && w < end) { // the terminator itself gets the NUL
+        lx->held_at = w;
+        lx->held = *w;
+    }
+    *w = 0;
+    return TOKEN_WORD;
+}
 
-                fprintf(fptr, "%s %s\n", name, location);
+/**
+ * Read the next token
+ * @return  enum token_type
+ */
+int lex_next(struct lexer *lx) {
+    for (;;) {
+        char c = lex_peek(lx, lx->p);
+        if (lx->p >= lx->end || c == '#') // comments run to the end of the line
+            return TOKEN_END;
+        char c1 = lex_peek(lx, lx->p + 1);
+        switch (c) {
+        case ' ': case '\t': case '\r':
+            lx->p++;
+            continue;
+        case '\n': case ';':
+            lx->p++;
+            return TOKEN_SEMI;
+        case '|':
+            lx->p += c1 == '|' ? 2 : 1;
+            return c1 == '|' ? TOKEN_OR : TOKEN_PIPE;
+        case '&':
+            if (c1 == '>') {
+                lx->p += 2;
+                lx->redirect = REDIRECT_ALL;
+                return TOKEN_REDIRECT;
             }
-            char *dir = getcwd(NULL, 0);
-            fprintf(fptr, "%s %s\n", command->args[1], dir);
-
-           
-            fclose(fptrTemp);
-            fptrTemp = NULL;
-
-        } else if (strcmp(command->args[0], "del") == 0) {
-
-        	fptr = fopen("/home/abrakadabra/Desktop/LastTerm/COMP304/Project1/files.txt", "a+");
-            char name[10];
-            char location[100];
-            while (fscanf(fptr, "%s %s", name, location) != EOF) {
-                if (strcmp(name, command->args[1]) == 0) {
-
-
-                } else {
-
-                    fprintf(fptrTemp, "%s %s\n", name, location);
-
-                }
+            lx->p += c1 == '&' ? 2 : 1;
+            return c1 == '&' ? TOKEN_AND : TOKEN_AMP;
+        case '<':
+            if (c1 == '<' && lex_peek(lx, lx->p + 2) == '<') {
+                lx->p += 3;
+                lx->redirect = REDIRECT_HERE;
+                return TOKEN_REDIRECT;
             }
-            remove("/home/abrakadabra/Desktop/LastTerm/COMP304/Project1/files.txt");
-            fclose(fptr);
-            fclose(fptrTemp);
-            fptr = fopen("/home/abrakadabra/Desktop/LastTerm/COMP304/Project1/files.txt", "a+");
-            fptrTemp = fopen("/home/abrakadabra/Desktop/LastTerm/COMP304/Project1/filesTemporary.txt", "a+");
-
-            while (fscanf(fptrTemp, "%s %s", name, location) != EOF) {
-
-                fprintf(fptr, "%s %s\n", name, location);
+            lx->p++;
+            lx->redirect = REDIRECT_IN;
+            return TOKEN_REDIRECT;
+        case '>':
+            lx->p += c1 == '>' ? 2 : 1;
+            lx->redirect = c1 == '>' ? REDIRECT_APPEND : REDIRECT_OUT;
+            return TOKEN_REDIRECT;
+        case '2':
+            if (c1 == '>') { // only a lone, unquoted 2 touching the >
+                char c2 = lex_peek(lx, lx->p + 2);
+                if (c2 != '>') {
+                    lx->p += 2;
+                    lx->redirect = REDIRECT_ERR;
+                    return TOKEN_REDIRECT;
+                }
             }
+            return lex_word(lx);
+        default:
+            return lex_word(lx);
+        }
+    }
+}
 
-            fclose(fptrTemp);
-            fptrTemp = NULL;
-
-        } else if (strcmp(command->args[0], "clear") == 0) {
-
-            remove("/home/abrakadabra/Desktop/LastTerm/COMP304/Project1/files.txt");
-            fptr = fopen("/home/abrakadabra/Desktop/LastTerm/COMP304/Project1/files.txt", "a+");
-
-        } else if (strcmp(command->args[0], "list") == 0) {
+/**
+ * Close the command being built: copy its arguments into an exactly sized
+ * argv in line_arena
+ */
+void finish_command(struct command_t *command, char **scratch, int count) {
+    command->argv = arena_alloc(&line_arena, sizeof(char *) * (count + 2));
+    command->argv[0] = command->name;
+    if (count)
+        memcpy(command->argv + 1, scratch, sizeof(char *) * count);
+    command->argv[count + 1] = NULL;
+    command->args = command->argv + 1;
+    command->arg_count = count;
+}
 
-        	fptr = fopen("/home/abrakadabra/Desktop/LastTerm/COMP304/Project1/files.txt", "a+");
-            char name[10];
-            char location[100];
-            while (fscanf(fptr, "%s %s", name, location) != EOF) {
+/**
+ * Parse a command string into a command struct. buf is tokenized in place
+ * and must outlive the command: names, arguments and redirect targets point
+ * into it, only the command_t nodes and argv arrays come from line_arena.
+ * Pipeline stages are chained through next, `;`, `&`, `&&` and `||`
+ * separated pipelines through next_list (on the first stage).
+ * @param  buf     [description]
+ * @param  command [description]
+ * @return         SUCCESS, or UNKNOWN on a syntax error (command is left empty)
+ */
+int parse_command(char *buf, struct command_t *command) {
+    static char **scratch = NULL; // arguments of the command being built
+    static int scratch_size = 0;
+    int len = strlen(buf);
+    TRACE(TRACE_PARSE, 'B', NULL, len);
+    memset(command, 0, sizeof(struct command_t));
 
-                printf("Name-Directory: %s %s\n", name, location);
+    struct lexer lx = {.p = buf, .end = buf + len};
+    struct command_t *head = command, *cur = command, *prev_head = NULL;
+    int count = 0, token;
+    bool empty = true; // no word or redirect in cur yet
 
+    while (1) {
+        token = lex_next(&lx);
+        if (token == TOKEN_ERROR)
+            break;
+        if (token == TOKEN_WORD) {
+            empty = false;
+            if (!cur->name) {
+                cur->name = lx.word;
+                continue;
             }
-
-
-        } else if (strcmp(command->args[0], "jump") == 0) {
-
-        	fptr = fopen("/home/abrakadabra/Desktop/LastTerm/COMP304/Project1/files.txt", "a+");
-            char name[10];
-            char location[100];
-
-            while (fscanf(fptr, "%s %s", name, location) != EOF) {
-                if (strcmp(name, command->args[1]) == 0) {
-
-                    r = chdir(location);
-                    if (r == -1)  printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
-
-                }
+            if (count == scratch_size) {
+                scratch_size = scratch_size ? scratch_size * 2 : 64;
+                scratch = realloc(scratch, sizeof(char *) * scratch_size);
+            }
+            scratch[count++] = lx.word;
+            continue;
+        }
+        if (token == TOKEN_REDIRECT) {
+            int index = lx.redirect;
+            token = lex_next(&lx);
+            if (token != TOKEN_WORD) {
+                if (token != TOKEN_ERROR)
+                    printf("-%s: syntax error near unexpected token `%s'\n", sysname, token_names[token]);
+                token = TOKEN_ERROR;
+                break;
             }
+            cur->redirects[index] = lx.word;
+            // the later of > and >>, or of < and <<<, wins
+            if (index == REDIRECT_OUT || index == REDIRECT_APPEND)
+                cur->redirects[index == REDIRECT_OUT ? REDIRECT_APPEND : REDIRECT_OUT] = NULL;
+            if (index == REDIRECT_IN || index == REDIRECT_HERE)
+                cur->redirects[index == REDIRECT_IN ? REDIRECT_HERE : REDIRECT_IN] = NULL;
+            empty = false;
+            continue;
         }
 
-        fclose(fptr);
-        fptr = NULL;
-        return SUCCESS;
+        // an operator or the end closes the current command
+        if (empty) {
+            // only a trailing ; or & (or an empty line) may leave nothing behind
+            if (token == TOKEN_END && cur == head && (!prev_head || prev_head->list_op == TOKEN_SEMI
+                                                      || prev_head->list_op == TOKEN_AMP)) {
+                if (prev_head)
+                    prev_head->next_list = NULL;
+                break;
+            }
+            printf("-%s: syntax error near unexpected token `%s'\n", sysname, token_names[token]);
+            token = TOKEN_ERROR;
+            break;
+        }
+        if (!cur->name)
+            cur->name = ""; // redirections only
+        finish_command(cur, scratch, count);
+        count = 0;
+        empty = true;
+        if (token == TOKEN_END)
+            break;
 
+        struct command_t *c = arena_zalloc(&line_arena, sizeof(struct command_t));
+        if (token == TOKEN_PIPE) {
+            cur->next = c;
+        } else {
+            if (token == TOKEN_AMP)
+                for (struct command_t *s = head; s; s = s->next)
+                    s->background = true;
+            head->list_op = token;
+            head->next_list = c;
+            prev_head = head;
+            head = c;
+        }
+        cur = c;
     }
-    if(strcmp(command->name, "myNetwork") == 0){
-
-   		char hostbuffer[256];
-    	char *IPbuffer;
-    	struct hostent *host_entry;
-    	int hostname;
-  
-    // To retrieve hostname
-    	hostname = gethostname(hostbuffer, sizeof(hostbuffer));
-    	checkHostName(hostname);
-  
-    // To retrieve host information
- 	   	host_entry = gethostbyname(hostbuffer);
-    	checkHostEntry(host_entry);
-  
-    // To convert an Internet network
-    // address into ASCII string
- 	   	IPbuffer = inet_ntoa(*((struct in_addr*) host_entry->h_addr_list[0]));
-  
-    	printf("Hostname: %s\n", hostbuffer);
-	    printf("Host IP: %s\n", IPbuffer);
-  
-
 
+    if (token == TOKEN_ERROR) {
+        memset(command, 0, sizeof(struct command_t));
+        command->name = "";
+        finish_command(command, scratch, 0);
+        last_status = 2;
+        TRACE(TRACE_PARSE, 'E', NULL, UNKNOWN);
+        return UNKNOWN;
     }
-    if(strcmp(command->name, "goodMorning") == 0){
-
-
-    	char *time = command->args[0];
-		char *path = command->args[1];
-		char *token;
-		
+    if (!command->name) { // empty line
+        command->name = "";
+        finish_command(command, scratch, 0);
+    }
+    TRACE(TRACE_PARSE, 'E', command->name, SUCCESS);
+    return SUCCESS;
+}
 
-		const char s[2] = ".";
-		token = strtok(time,s);
-		char *hour = token;
-		token = strtok(NULL,s); 
-		char *minute = token;
-		FILE *fptr = NULL;
-		remove("morning.txt");
-        fptr = fopen("morning.txt", "a+");
-        fprintf(fptr, "%s %s * * * env DISPLAY=:0.0 audacious /home/abrakadabra/deneme %s\n", minute, hour,path);
-        fclose(fptr);
-        fptr = NULL;
-        
-        pid_t pid = fork();
-    	if (pid == 0) {
-        /// This shows how to do exec with environ (but is not available on MacOs)
-        // extern char** environ; // environment variables
-        // execvpe(command->name, command->args, environ); // exec+args+path+environ
+// job control, defined further down
+extern bool interactive;
+extern int sigchld_fd;
+extern int job_count;
+void init_job_control(bool use_terminal);
+void reap_jobs();
+void notify_jobs(bool report);
+
+// history, defined further down
+void history_init();
+int history_count();
+const char *history_at(int i);
+void history_add(const char *line);
+const char *history_search(const char *query, uint64_t before, uint64_t *found);
+
+// builtins, defined further down
+int builtin_flags(const char *name);
+
+// completion and output, defined further down
+int write_all(int fd, const char *buf, size_t len);
+bool complete(char *buf, size_t size, int *index);
+
+/*
+ * Prompt. SEASHELL_PROMPT lists the segments to show, with % escapes:
+ *   %u user   %h host   %w working directory   %n shell name
+ *   %s last exit status, if not 0   %d duration of the last command, if slow
+ *   %j number of jobs, if any   %b git branch, in a work tree   %% a %
+ * User and host are looked up once and the directory only when it changes.
+ * The branch is looked up by a thread, away from the input path, since that
+ * means a stat() for every directory up to the work tree, which can be slow
+ * on network file systems. A prompt waits for it only so long; if it comes
+ * later, the prompt is drawn again.
+ */
+#define PROMPT_FORMAT "%u@%h:%w%b%s%d%j %n$ "
+#define PROMPT_BUDGET_NS 20000000L // how long a prompt waits for the branch
+#define PROMPT_SLOW_NS 2000000000L // shortest duration shown
+
+struct prompt_cache {
+    char user[256], host[256];
+    char cwd[PATH_MAX]; // "" until first needed
+    struct timespec started;
+    long duration_ns;
+    // branch lookups; the rest is for the worker thread and under the lock
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    pthread_t thread;
+    bool running, late;
+    char asked_dir[PATH_MAX], branch_dir[PATH_MAX], branch[256];
+    unsigned long asked, answered;
+    int wake[2]; // has a byte to read when a late branch came in
+};
 
-        /// This shows how to do exec with auto-path resolve
-        // add a NULL argument to the end of args, and the name to the beginning
-        // as required by exec
+struct prompt_cache prompt_cache = {.lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER,
+                                    .done = PTHREAD_COND_INITIALIZER, .wake = {-1, -1}};
 
-        // increase args size by 2
-        	execlp("crontab", "crontab", "morning.txt",NULL); // exec+args+path
-        	exit(0);
-        /// TODO: do your own exec  path resolving using execv()
-    	} else {
+/**
+ * The cwd changed (to this, if known)
+ */
+void prompt_set_cwd(const char *cwd) {
+    if (cwd)
+        snprintf(prompt_cache.cwd, sizeof(prompt_cache.cwd), "%s", cwd);
+    else if (!getcwd(prompt_cache.cwd, sizeof(prompt_cache.cwd)))
+        strcpy(prompt_cache.cwd, "?");
+}
 
-    		sleep(1);
-        	wait(0); 
-       // wait for child process to finish
-        	return SUCCESS;
-    	}    	
-    }
-    if(strcmp(command->name, "highlight") == 0){
+void prompt_command_started() {
+    clock_gettime(CLOCK_MONOTONIC, &prompt_cache.started);
+}
 
-        char read_el[SIZE];
-        FILE *fp=fopen(command->args[2], "r");
-        char *token;
-        char *f1 = fgets(read_el,SIZE,fp);
+void prompt_command_finished() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    prompt_cache.duration_ns = (now.tv_sec - prompt_cache.started.tv_sec) * 1000000000L
+                               + (now.tv_nsec - prompt_cache.started.tv_nsec);
+}
 
-        if(fp == NULL){
-            printf("File Opening Error!!");
+/**
+ * Read a small file into a string, without the trailing newline
+ */
+bool prompt_read_line(const char *path, char *out, size_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    ssize_t n = read(fd, out, size - 1);
+    close(fd);
+    if (n <= 0)
+        return false;
+    out[n] = 0;
+    out[strcspn(out, "\r\n")] = 0;
+    return true;
+}
 
+/**
+ * The branch checked out in the git work tree dir is in: its name, a short
+ * commit id if detached, "" outside of a work tree
+ */
+void vcs_branch(const char *dir, char *out, size_t size) {
+    char d[PATH_MAX], head[256], path[sizeof(d) + sizeof(head) + 16];
+    struct stat st;
+    snprintf(d, sizeof(d), "%s", dir);
+    out[0] = 0;
+    while (d[0]) {
+        snprintf(path, sizeof(path), "%s/.git", strcmp(d, "/") == 0 ? "" : d);
+        if (stat(path, &st) == 0) {
+            if (S_ISREG(st.st_mode)) { // a linked work tree: "gitdir: <dir>"
+                if (!prompt_read_line(path, head, sizeof(head)) || strncmp(head, "gitdir: ", 8) != 0)
+                    return;
+                if (head[8] == '/')
+                    snprintf(path, sizeof(path), "%s", head + 8);
+                else
+                    snprintf(path, sizeof(path), "%s/%s", d, head + 8);
+            }
+            strncat(path, "/HEAD", sizeof(path) - strlen(path) - 1);
+            if (!prompt_read_line(path, head, sizeof(head)))
+                return;
+            if (strncmp(head, "ref: refs/heads/", 16) == 0)
+                snprintf(out, size, "%s", head + 16);
+            else if (strncmp(head, "ref: ", 5) == 0)
+                snprintf(out, size, "%s", head + 5);
+            else
+                snprintf(out, size, "%.7s", head);
+            return;
         }
-        const char s[4] = " ,.";
-        while (f1 != NULL){
-        	
-        	token = strtok(read_el,s); 
+        char *slash = strrchr(d, '/');
+        if (!slash || strcmp(d, "/") == 0)
+            break;
+        slash[slash == d] = 0; // keep "/" itself
+    }
+}
 
-        	while(token != NULL){
+void *prompt_worker(void *arg) {
+    struct prompt_cache *p = arg;
+    char dir[PATH_MAX], branch[256];
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        while (p->answered == p->asked)
+            pthread_cond_wait(&p->work, &p->lock);
+        unsigned long asked = p->asked; // only the latest question matters
+        strcpy(dir, p->asked_dir);
+        pthread_mutex_unlock(&p->lock);
+        vcs_branch(dir, branch, sizeof(branch));
+        pthread_mutex_lock(&p->lock);
+        strcpy(p->branch_dir, dir);
+        strcpy(p->branch, branch);
+        p->answered = asked;
+        pthread_cond_broadcast(&p->done);
+        if (p->late && p->answered == p->asked) {
+            p->late = false;
+            write(p->wake[1], "", 1);
+        }
+    }
+    return NULL;
+}
 
-        		if(strcmp(token,command->args[0]) == 0){
+/**
+ * The branch for the cwd, looked up again if ask is set: the answer if it
+ * comes within the budget, else the last one for this directory
+ */
+void prompt_branch(bool ask, char *out, size_t size) {
+    struct prompt_cache *p = &prompt_cache;
+    pthread_mutex_lock(&p->lock);
+    if (ask && !p->running && pipe2(p->wake, O_CLOEXEC | O_NONBLOCK) == 0) {
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old); // signals are for the main thread
+        p->running = pthread_create(&p->thread, NULL, prompt_worker, p) == 0;
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (p->running) {
+            pthread_detach(p->thread);
+        } else {
+            close(p->wake[0]);
+            close(p->wake[1]);
+            p->wake[0] = p->wake[1] = -1;
+        }
+    }
+    if (ask && p->running) {
+        strcpy(p->asked_dir, p->cwd);
+        p->asked++;
+        pthread_cond_signal(&p->work);
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += PROMPT_BUDGET_NS;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (p->answered != p->asked && pthread_cond_timedwait(&p->done, &p->lock, &deadline) == 0)
+            ;
+        p->late = p->answered != p->asked;
+    }
+    snprintf(out, size, "%s", strcmp(p->branch_dir, p->cwd) == 0 ? p->branch : "");
+    pthread_mutex_unlock(&p->lock);
+}
 
-        			if(strstr(command->args[1],"r") != NULL){
-             
-                		red();
-                		printf("%s ", token);
-                		reset();
+/**
+ * Descriptor that becomes readable when the prompt should be drawn again
+ */
+int prompt_wake_fd() {
+    char drain[64];
+    if (prompt_cache.wake[0] != -1)
+        while (read(prompt_cache.wake[0], drain, sizeof(drain)) > 0)
+            ;
+    return prompt_cache.wake[0];
+}
 
-                	}else if(strstr(command->args[1],"g") != NULL){
+/**
+ * Format the command prompt
+ * @param  ask  look the branch up again, rather than using the last answer
+ * @return      its length
+ */
+int show_prompt(char *buf, size_t size, bool ask) {
+    struct prompt_cache *p = &prompt_cache;
+    const char *format = getenv("SEASHELL_PROMPT");
+    size_t n = 0;
+    if (!p->host[0]) {
+        const char *user = getenv("USER");
+        snprintf(p->user, sizeof(p->user), "%s", user ? user : "?");
+        gethostname(p->host, sizeof(p->host));
+    }
+    if (!p->cwd[0])
+        prompt_set_cwd(NULL);
+    for (const char *f = format ? format : PROMPT_FORMAT; *f && n + 1 < size; ++f) {
+        char segment[300] = "";
+        const char *text = segment;
+        if (*f != '%' || !f[1]) {
+            buf[n++] = *f;
+            continue;
+        }
+        switch (*++f) {
+            case 'u': text = p->user; break;
+            case 'h': text = p->host; break;
+            case 'w': text = p->cwd; break;
+            case 'n': text = sysname; break;
+            case 's':
+                if (last_status)
+                    snprintf(segment, sizeof(segment), " [%d]", last_status);
+                break;
+            case 'd':
+                if (p->duration_ns >= PROMPT_SLOW_NS)
+                    snprintf(segment, sizeof(segment), " %ld.%lds", p->duration_ns / 1000000000L,
+                             p->duration_ns / 100000000L % 10);
+                break;
+            case 'j':
+                if (job_count)
+                    snprintf(segment, sizeof(segment), " %d job%s", job_count, job_count > 1 ? "s" : "");
+                break;
+            case 'b': {
+                char branch[256];
+                prompt_branch(ask, branch, sizeof(branch));
+                if (branch[0])
+                    snprintf(segment, sizeof(segment), " (%s)", branch);
+                break;
+            }
+            default: snprintf(segment, sizeof(segment), "%c", *f); break;
+        }
+        size_t length = strlen(text) < size - 1 - n ? strlen(text) : size - 1 - n;
+        memcpy(buf + n, text, length);
+        n += length;
+    }
+    buf[n] = 0;
+    return n;
+}
 
-                		green();
-                		printf("%s ", token);
-                		reset();
+/*
+ * Line editor. The terminal is switched to raw mode when the prompt needs
+ * it and stays there from line to line; the modes it had are put back only
+ * before running something that may read the terminal, at exit and on
+ * fatal signals. Input is read in chunks as it arrives and every key in a
+ * chunk is handled before anything is written: the screen updates are
+ * collected and sent with one write() when the editor is about to wait for
+ * more input. Typing or deleting at the end of the line sends just those
+ * bytes; anything else redraws the line, which may wrap over several rows,
+ * from its first row.
+ */
+#define EDITOR_INPUT 4096
+
+struct line_editor {
+    char *buf; // the line; the parsed command points into it
+    size_t length, capacity, cursor;
+    size_t width; // of the whole line on screen
+    size_t columns; // of the terminal, 0 until asked again
+    char *out; // screen updates not written yet
+    size_t out_length, out_capacity;
+    char prompt[2048];
+    size_t prompt_width;
+    size_t row; // of the cursor, counted from the first row of the prompt
+    char *kill; // text last cut, for Ctrl-Y
+    size_t kill_length;
+    char *draft; // the line being typed, while browsing the history
+    int history_position; // history_count() when not browsing
+};
 
-                	}else if(strstr(command->args[1],"b") != NULL){
+struct line_editor editor;
+unsigned char editor_input[EDITOR_INPUT];
+size_t editor_input_start, editor_input_end;
+struct termios editor_cooked; // the modes to go back to
+bool raw_mode = false;
 
-	            		blue();
-	            		printf("%s ", token);
-                		reset();
+void terminal_restore() {
+    if (!raw_mode)
+        return;
+    write(STDOUT_FILENO, "\033[?2004l", 8); // bracketed paste off
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &editor_cooked);
+    raw_mode = false;
+}
 
-                	}else{
+void terminal_signal(int sig) {
+    if (raw_mode)
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &editor_cooked);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
 
-                    	printf("%s ", token);
-                	}
+/**
+ * Put the terminal in raw mode, unless it already is
+ */
+void terminal_raw() {
+    static bool handlers = false;
+    if (raw_mode)
+        return;
+    if (!handlers) {
+        int sigs[] = {SIGHUP, SIGTERM, SIGSEGV, SIGBUS, SIGABRT};
+        for (size_t i = 0; i < sizeof(sigs) / sizeof(sigs[0]); ++i)
+            signal(sigs[i], terminal_signal);
+        atexit(terminal_restore);
+        handlers = true;
+    }
+    if (tcgetattr(STDIN_FILENO, &editor_cooked) == -1)
+        return;
+    struct termios raw = editor_cooked;
+    // no line buffering, echo, signal keys, flow control or CR translation;
+    // output processing stays, so what commands print still looks right
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_iflag &= ~(IXON | ICRNL | INLCR | ISTRIP);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+    write(STDOUT_FILENO, "\033[?2004h", 8); // bracketed paste on
+    raw_mode = true;
+}
 
+/**
+ * Can the terminal stay raw while this runs? Only for builtins that never
+ * read it
+ */
+bool prompt_keeps_terminal(struct command_t *command) {
+    if (command->next || command->next_list || command->background)
+        return false;
+    return command->name[0] == 0 || (builtin_flags(command->name) & SEASHELL_BUILTIN_NO_TTY);
+}
 
-        		}else{
+void editor_emit(struct line_editor *e, const char *s, size_t n) {
+    if (e->out_length + n > e->out_capacity) {
+        e->out_capacity = (e->out_length + n) * 2;
+        e->out = realloc(e->out, e->out_capacity);
+    }
+    memcpy(e->out + e->out_length, s, n);
+    e->out_length += n;
+}
 
-        			printf("%s ", token);
-        		}
+void editor_printf(struct line_editor *e, const char *format, ...) {
+    char s[64];
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(s, sizeof(s), format, ap);
+    va_end(ap);
+    editor_emit(e, s, n);
+}
 
+void editor_flush(struct line_editor *e) {
+    fflush(stdout);
+    if (e->out_length)
+        write_all(STDOUT_FILENO, e->out, e->out_length);
+    e->out_length = 0;
+}
 
-        		token = strtok(NULL,s); 
+void editor_prompt(struct line_editor *e, bool ask);
+void editor_refresh(struct line_editor *e);
 
-        	}
-        	f1 = fgets(read_el,SIZE,fp);
+/**
+ * Read one key, reaping background jobs while waiting for input; pending
+ * screen updates are written first
+ * @return  the byte, or EOF
+ */
+int prompt_getchar() {
+    if (editor_input_start < editor_input_end)
+        return editor_input[editor_input_start++];
+    editor_flush(&editor);
+    struct pollfd fds[3] = {{STDIN_FILENO, POLLIN, 0}, {sigchld_fd, POLLIN, 0}, {prompt_wake_fd(), POLLIN, 0}};
+    while (poll(fds, 3, -1) == -1 || !(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+        if (fds[1].revents & POLLIN)
+            reap_jobs(); // status is printed before the next prompt
+        if (fds[2].revents & POLLIN) { // the branch came in after all
+            prompt_wake_fd();
+            editor_prompt(&editor, false);
+            editor_refresh(&editor);
+            editor_flush(&editor);
         }
-
-        fclose(fp);
-        fp = NULL;
-        return SUCCESS;
+        fds[0].revents = fds[1].revents = fds[2].revents = 0;
     }
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, editor_input, sizeof(editor_input))) == -1 && errno == EINTR)
+        ;
+    if (n <= 0)
+        return EOF;
+    editor_input_start = 1;
+    editor_input_end = n;
+    editor.columns = 0; // the window may have been resized meanwhile
+    return editor_input[0];
+}
 
-    if(strcmp(command->name, "kdiff") == 0){
+/**
+ * Columns taken by text on screen: escape sequences take none, control
+ * bytes are shown as ^X, UTF-8 continuation bytes add nothing
+ */
+size_t editor_width(const char *s, size_t n) {
+    size_t width = 0;
+    for (size_t i = 0; i < n; ++i) {
+        unsigned char c = s[i];
+        if (c == 27 && i + 1 < n && s[i + 1] == '[') {
+            for (i += 2; i < n && !(s[i] >= 0x40 && s[i] <= 0x7e); ++i)
+                ;
+        } else if (c < 32 || c == 127)
+            width += 2;
+        else if ((c & 0xc0) != 0x80)
+            width++;
+    }
+    return width;
+}
+
+void editor_prompt(struct line_editor *e, bool ask) {
+    show_prompt(e->prompt, sizeof(e->prompt), ask);
+    e->prompt_width = editor_width(e->prompt, strlen(e->prompt));
+}
+
+size_t editor_columns() {
+    struct winsize ws;
+    if (!editor.columns)
+        editor.columns = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+    return editor.columns;
+}
+
+/**
+ * Redraw the prompt and the line and put the cursor where it belongs
+ */
+void editor_refresh(struct line_editor *e) {
+    size_t columns = editor_columns();
+    if (e->row)
+        editor_printf(e, "\033[%zuA", e->row);
+    editor_emit(e, "\r", 1);
+    editor_emit(e, e->prompt, strlen(e->prompt));
+    size_t start = 0;
+    for (size_t i = 0; i < e->length; ++i) {
+        unsigned char c = e->buf[i];
+        if (c >= 32 && c != 127)
+            continue;
+        editor_emit(e, e->buf + start, i - start);
+        char caret[2] = {'^', c == 127 ? '?' : c + 64};
+        editor_emit(e, caret, 2);
+        start = i + 1;
+    }
+    editor_emit(e, e->buf + start, e->length - start);
+    editor_emit(e, "\033[J", 3);
+    e->width = editor_width(e->buf, e->length);
+    size_t end = e->prompt_width + e->width;
+    size_t at = e->prompt_width + editor_width(e->buf, e->cursor);
+    if (end % columns == 0) // the terminal waits for the next byte to wrap
+        editor_emit(e, "\r\n", 2);
+    if (end / columns > at / columns)
+        editor_printf(e, "\033[%zuA", end / columns - at / columns);
+    editor_emit(e, "\r", 1);
+    if (at % columns)
+        editor_printf(e, "\033[%zuC", at % columns);
+    e->row = at / columns;
+}
+
+void editor_reserve(struct line_editor *e, size_t n) {
+    if (e->length + n + 1 > e->capacity) {
+        e->capacity = (e->length + n + 1) * 2;
+        e->buf = realloc(e->buf, e->capacity);
+    }
+}
+
+/**
+ * Insert text at the cursor
+ */
+void editor_insert(struct line_editor *e, const char *s, size_t n) {
+    editor_reserve(e, n);
+    memmove(e->buf + e->cursor + n, e->buf + e->cursor, e->length - e->cursor);
+    memcpy(e->buf + e->cursor, s, n);
+    e->length += n;
+    e->cursor += n;
+    e->buf[e->length] = 0;
+    size_t width = editor_width(s, n), end = e->prompt_width + e->width + width, columns = editor_columns();
+    if (e->cursor == e->length && width == n) { // plain typing
+        editor_emit(e, s, n);
+        if (end % columns == 0) // the terminal waits for the next byte to wrap
+            editor_emit(e, "\r\n", 2);
+        e->width += width;
+        e->row = end / columns;
+    } else
+        editor_refresh(e);
+}
+
+/**
+ * Remove [from, to), keeping it for Ctrl-Y if kill is set
+ */
+void editor_delete(struct line_editor *e, size_t from, size_t to, bool kill) {
+    if (from >= to)
+        return;
+    if (kill) {
+        free(e->kill);
+        e->kill = strndup(e->buf + from, to - from);
+        e->kill_length = to - from;
+    }
+    size_t columns = editor_columns(), end = e->prompt_width + e->width;
+    bool at_end = to == e->length && e->cursor == e->length && end % columns != 0
+                  && editor_width(e->buf + from, to - from) == 1 && (end - 1) % columns != 0;
+    memmove(e->buf + from, e->buf + to, e->length - to);
+    e->length -= to - from;
+    e->buf[e->length] = 0;
+    e->cursor = from;
+    if (at_end) { // backspace at the end of a row
+        editor_emit(e, "\b \b", 3);
+        e->width--;
+    } else
+        editor_refresh(e);
+}
+
+void editor_set(struct line_editor *e, const char *text) {
+    e->length = e->cursor = 0;
+    editor_reserve(e, strlen(text));
+    strcpy(e->buf, text);
+    e->length = e->cursor = strlen(text);
+    editor_refresh(e);
+}
+
+bool editor_word_byte(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_'
+           || (unsigned char) c >= 128;
+}
+
+size_t editor_word_left(const struct line_editor *e) {
+    size_t i = e->cursor;
+    while (i > 0 && !editor_word_byte(e->buf[i - 1]))
+        i--;
+    while (i > 0 && editor_word_byte(e->buf[i - 1]))
+        i--;
+    return i;
+}
+
+size_t editor_word_right(const struct line_editor *e) {
+    size_t i = e->cursor;
+    while (i < e->length && !editor_word_byte(e->buf[i]))
+        i++;
+    while (i < e->length && editor_word_byte(e->buf[i]))
+        i++;
+    return i;
+}
+
+// start of the UTF-8 character before i, or of the one at i
+size_t editor_char_left(const struct line_editor *e, size_t i) {
+    while (i > 0 && ((unsigned char) e->buf[--i] & 0xc0) == 0x80)
+        ;
+    return i;
+}
+
+size_t editor_char_right(const struct line_editor *e, size_t i) {
+    while (i < e->length && ((unsigned char) e->buf[++i] & 0xc0) == 0x80)
+        ;
+    return i < e->length ? i : e->length;
+}
+
+void editor_move(struct line_editor *e, size_t to) {
+    if (to == e->cursor)
+        return;
+    e->cursor = to;
+    editor_refresh(e);
+}
+
+/**
+ * Go through the history, keeping what was being typed to come back to
+ */
+void editor_history(struct line_editor *e, int step) {
+    int target = e->history_position + step;
+    if (target < 0 || target > history_count())
+        return;
+    if (e->history_position == history_count()) {
+        free(e->draft);
+        e->draft = strndup(e->buf, e->length);
+    }
+    e->history_position = target;
+    editor_set(e, target == history_count() ? (e->draft ? e->draft : "") : history_at(target));
+}
+
+/**
+ * Bracketed paste: take everything up to the end marker as typed text,
+ * control keys and all
+ */
+void editor_paste(struct line_editor *e) {
+    const char *end = "\033[201~";
+    char *text = NULL;
+    size_t length = 0, capacity = 0, matched = 0;
+    int c;
+    while (end[matched] && (c = prompt_getchar()) != EOF) {
+        if (c == end[matched]) {
+            matched++;
+            continue;
+        }
+        if (length + matched + 1 > capacity) {
+            capacity = (length + matched + 1) * 2 + 4096;
+            text = realloc(text, capacity);
+        }
+        memcpy(text + length, end, matched); // a false start of the marker
+        length += matched;
+        matched = c == end[0];
+        if (!matched)
+            text[length++] = c == '\r' ? '\n' : c;
+    }
+    if (length)
+        editor_insert(e, text, length);
+    free(text);
+}
+
+/**
+ * Ctrl-R: look up what is typed in the history, newest first; Ctrl-R again
+ * goes to older matches. The match found replaces the line unless the
+ * search is cancelled with Ctrl-G.
+ * @return  the key that ended the search, to be handled as usual
+ */
+int prompt_search(struct line_editor *e) {
+    char query[256] = "";
+    size_t length = 0;
+    uint64_t found = UINT64_MAX;
+    const char *match = NULL;
+    bool failed = false;
+    int c;
+    if (e->row)
+        editor_printf(e, "\033[%zuA", e->row);
+    e->row = 0;
+    while (1) {
+        char line[1024];
+        int n = snprintf(line, sizeof(line), "(%sreverse-i-search)`%s': %s", failed ? "failed " : "", query,
+                         match ? match : "");
+        size_t columns = editor_columns();
+        n = n < (int) sizeof(line) ? n : (int) sizeof(line) - 1;
+        while (n > 0 && editor_width(line, n) >= columns) // one row only
+            n--;
+        editor_emit(e, "\r", 1);
+        editor_emit(e, line, n);
+        editor_emit(e, "\033[J", 3);
+        c = prompt_getchar();
+        uint64_t before = match ? found + 1 : UINT64_MAX; // the current match may still do
+        if (c == 18)
+            before = match ? found : UINT64_MAX;
+        else if ((c == 127 || c == 8) && length > 0) {
+            query[--length] = 0;
+            before = UINT64_MAX;
+        } else if (c >= 32 && c < 127 && length < sizeof(query) - 1) {
+            query[length++] = c;
+            query[length] = 0;
+        } else if (c != 127 && c != 8)
+            break;
+        uint64_t at;
+        const char *m = length ? history_search(query, before, &at) : NULL;
+        failed = length && !m;
+        if (m) {
+            match = m;
+            found = at;
+        } else if (!length)
+            match = NULL;
+    }
+    if (c != 7 && c != 3 && match) { // Ctrl-G keeps the line as it was
+        editor_set(e, match);
+        e->history_position = history_count();
+    } else
+        editor_refresh(e);
+    return c == 7 ? 0 : c;
+}
+
+/**
+ * The rest of an escape sequence: arrows, Home/End/Delete, Alt+key and
+ * the start of a paste
+ */
+void editor_escape(struct line_editor *e) {
+    int c = prompt_getchar();
+    char params[16];
+    size_t n = 0;
+    if (c == '[' || c == 'O') {
+        int final;
+        while ((final = prompt_getchar()) != EOF && !(final >= 0x40 && final <= 0x7e))
+            if (n < sizeof(params) - 1)
+                params[n++] = final;
+        params[n] = 0;
+        bool ctrl = strstr(params, ";5") != NULL;
+        switch (final) {
+            case 'A': editor_history(e, -1); break;
+            case 'B': editor_history(e, 1); break;
+            case 'C': editor_move(e, ctrl ? editor_word_right(e) : editor_char_right(e, e->cursor)); break;
+            case 'D': editor_move(e, ctrl ? editor_word_left(e) : editor_char_left(e, e->cursor)); break;
+            case 'H': editor_move(e, 0); break;
+            case 'F': editor_move(e, e->length); break;
+            case '~':
+                if (strcmp(params, "200") == 0)
+                    editor_paste(e);
+                else if (strcmp(params, "1") == 0 || strcmp(params, "7") == 0)
+                    editor_move(e, 0);
+                else if (strcmp(params, "4") == 0 || strcmp(params, "8") == 0)
+                    editor_move(e, e->length);
+                else if (strcmp(params, "3") == 0)
+                    editor_delete(e, e->cursor, editor_char_right(e, e->cursor), false);
+                break;
+        }
+        return;
+    }
+    switch (c) { // Alt+key
+        case 'b': editor_move(e, editor_word_left(e)); break;
+        case 'f': editor_move(e, editor_word_right(e)); break;
+        case 'd': editor_delete(e, e->cursor, editor_word_right(e), true); break;
+        case 127: case 8: editor_delete(e, editor_word_left(e), e->cursor, true); break;
+    }
+}
+
+/**
+ * Tab: complete the word before the cursor
+ */
+void editor_complete(struct line_editor *e) {
+    char *tail = strndup(e->buf + e->cursor, e->length - e->cursor);
+    size_t tail_length = e->length - e->cursor;
+    editor_reserve(e, PATH_MAX * 2);
+    // the list of candidates goes below the whole line
+    size_t columns = editor_columns(), end = e->prompt_width + e->width;
+    if (end / columns > e->row)
+        editor_printf(e, "\033[%zuB", end / columns - e->row);
+    editor_flush(e);
+    e->row = end / columns;
+    e->buf[e->cursor] = 0;
+    int index = e->cursor;
+    if (complete(e->buf, e->capacity - tail_length, &index))
+        e->row = 0; // a fresh prompt under the list
+    fflush(stdout);
+    memcpy(e->buf + index, tail, tail_length);
+    e->cursor = index;
+    e->length = index + tail_length;
+    e->buf[e->length] = 0;
+    free(tail);
+    editor_refresh(e);
+}
+
+/**
+ * Prompt a command from the user
+ * @param  command  filled in from the line; it points into the line buffer
+ *                  until the next call
+ * @return          SUCCESS, or EXIT on Ctrl-D or end of input
+ */
+int prompt(struct command_t *command) {
+    struct line_editor *e = &editor;
+    int c;
+
+    terminal_raw();
+    notify_jobs(true);
+    fflush(stdout);
+    editor_prompt(e, true);
+    e->length = e->cursor = e->row = 0;
+    editor_reserve(e, 0);
+    e->buf[0] = 0;
+    e->history_position = history_count();
+    free(e->draft);
+    e->draft = NULL;
+    editor_refresh(e);
+
+    while (1) {
+        c = prompt_getchar();
+        if (c == 18) // Ctrl+R, which hands back the key that ended it
+            c = prompt_search(e);
+        if (c == '\r' || c == '\n') // enter key
+            break;
+        if (c == EOF || (c == 4 && e->length == 0)) { // Ctrl+D
+            editor_flush(e);
+            return EXIT;
+        }
+        switch (c) {
+            case 0: break;
+            case 1: editor_move(e, 0); break; // Ctrl+A
+            case 2: editor_move(e, editor_char_left(e, e->cursor)); break; // Ctrl+B
+            case 3: // Ctrl+C: drop the line
+                editor_move(e, e->length);
+                editor_emit(e, "^C\r\n", 4);
+                e->length = e->cursor = e->row = 0;
+                e->buf[0] = 0;
+                e->history_position = history_count();
+                last_status = 130;
+                editor_refresh(e);
+                break;
+            case 4: editor_delete(e, e->cursor, editor_char_right(e, e->cursor), false); break; // Ctrl+D
+            case 5: editor_move(e, e->length); break; // Ctrl+E
+            case 6: editor_move(e, editor_char_right(e, e->cursor)); break; // Ctrl+F
+            case 9: editor_complete(e); break; // Tab
+            case 11: editor_delete(e, e->cursor, e->length, true); break; // Ctrl+K
+            case 12: // Ctrl+L
+                editor_emit(e, "\033[H\033[2J", 7);
+                e->row = 0;
+                editor_refresh(e);
+                break;
+            case 14: editor_history(e, 1); break; // Ctrl+N
+            case 16: editor_history(e, -1); break; // Ctrl+P
+            case 21: editor_delete(e, 0, e->cursor, true); break; // Ctrl+U
+            case 23: { // Ctrl+W: back to the previous blank
+                size_t i = e->cursor;
+                while (i > 0 && (e->buf[i - 1] == ' ' || e->buf[i - 1] == '\t'))
+                    i--;
+                while (i > 0 && e->buf[i - 1] != ' ' && e->buf[i - 1] != '\t')
+                    i--;
+                editor_delete(e, i, e->cursor, true);
+                break;
+            }
+            case 25: // Ctrl+Y
+                if (e->kill)
+                    editor_insert(e, e->kill, e->kill_length);
+                break;
+            case 27: editor_escape(e); break;
+            case 8: case 127: editor_delete(e, editor_char_left(e, e->cursor), e->cursor, false); break;
+            default:
+                if (c >= 32) {
+                    char ch = c;
+                    editor_insert(e, &ch, 1);
+                }
+        }
+    }
+    editor_move(e, e->length);
+    editor_emit(e, "\r\n", 2);
+    editor_flush(e);
+
+    history_add(e->buf); // before parsing, which splits the line up
+
+    parse_command(e->buf, command);
+
+    // print_command(command); // DEBUG: uncomment for debugging
+
+    return SUCCESS;
+}
+
+int process_command(struct command_t *command);
+
+/*
+ * Batch mode: `seashell script`, `seashell -c 'commands'` or a stdin that is
+ * not a terminal. Input is read in large blocks and each line is parsed in
+ * place inside the block; there is no prompt, no echo and no termios.
+ */
+#define BATCH_BLOCK (1 << 20)
+
+/**
+ * Run every line read from fd
+ * @param  fd  script to read; for stdin the file offset is kept in step
+ *             with the lines run so far, so commands reading stdin see the
+ *             rest of a seekable script, not what the shell buffered
+ * @return     EXIT if the script ran exit, SUCCESS at end of input
+ */
+int run_batch(int fd) {
+    size_t size = BATCH_BLOCK, start = 0, len = 0;
+    char *buf = malloc(size + 1);
+    bool eof = false, shared = fd == STDIN_FILENO && lseek(fd, 0, SEEK_CUR) != -1;
+    int code = SUCCESS;
+
+    while (code != EXIT) {
+        char *nl = memchr(buf + start, '\n', len - start);
+        if (!nl && !eof) {
+            // keep the partial line, grow for very long lines, read another block
+            memmove(buf, buf + start, len - start);
+            len -= start;
+            start = 0;
+            if (len == size) {
+                size *= 2;
+                buf = realloc(buf, size + 1);
+            }
+            ssize_t n = read(fd, buf + len, size - len);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                eof = true;
+            else
+                len += n;
+            continue;
+        }
+        if (!nl) {
+            if (start == len)
+                break;
+            nl = buf + len; // last line has no newline
+        }
+        *nl = 0;
+        char *line = buf + start;
+        start = nl - buf + (nl < buf + len);
+
+        off_t unread = len - start, offset = 0;
+        if (shared) // hand the unread part back to the file for this command
+            offset = lseek(fd, -unread, SEEK_CUR);
+
+        struct command_t *command = arena_zalloc(&line_arena, sizeof(struct command_t));
+        if (parse_command(line, command) == SUCCESS)
+            code = process_command(command);
+        arena_reset(&line_arena);
+        notify_jobs(false);
+
+        if (shared) {
+            if (lseek(fd, 0, SEEK_CUR) == offset)
+                lseek(fd, unread, SEEK_CUR); // nobody read from it, our buffer is still right
+            else
+                start = len = 0; // a command consumed input, continue from where it stopped
+        }
+    }
+    free(buf);
+    return code;
+}
+
+#ifndef SEASHELL_NO_MAIN
+int main(int argc, char **argv) {
+    trace_init();
+    if (argc > 1) { // seashell -c 'commands' | seashell script
+        init_job_control(false);
+        if (strcmp(argv[1], "-c") == 0) {
+            if (argc < 3) {
+                printf("-%s: -c: option requires an argument\n", sysname);
+                return 2;
+            }
+            struct command_t *command = arena_zalloc(&line_arena, sizeof(struct command_t));
+            if (parse_command(argv[2], command) == SUCCESS)
+                process_command(command);
+            fflush(stdout);
+            return last_status;
+        }
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            printf("-%s: %s: %s\n", sysname, argv[1], strerror(errno));
+            return 127;
+        }
+        run_batch(fd);
+        close(fd);
+        fflush(stdout);
+        return last_status;
+    }
+    if (!isatty(STDIN_FILENO)) { // commands piped or redirected in
+        init_job_control(false);
+        run_batch(STDIN_FILENO);
+        fflush(stdout);
+        return last_status;
+    }
+
+    init_job_control(true);
+    history_init();
+    while (1) {
+        struct command_t *command = arena_zalloc(&line_arena, sizeof(struct command_t));
+
+        int code;
+        TRACE(TRACE_PROMPT, 'B', NULL, 0);
+        code = prompt(command);
+        TRACE(TRACE_PROMPT, 'E', command->name, code);
+        if (code == EXIT) break;
+        if (!prompt_keeps_terminal(command))
+            terminal_restore();
+
+        prompt_command_started();
+        code = process_command(command);
+        prompt_command_finished();
+        if (code == EXIT) break;
+
+        arena_reset(&line_arena); // releases the whole command tree
+    }
+
+    printf("\n");
+    return last_status;
+}
+#endif
+
+void red () {
+  printf("\033[1;31m");
+}
+void blue () {
+  printf("\033[0;34m");
+}
+void green () {
+  printf("\033[0;32m");
+}
+void reset () {
+  printf("\033[0m");
+}
+
+/**
+ * FNV-1a hash of the first len bytes of s
+ */
+unsigned hash_string(const char *s, size_t len) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char) s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * PATH lookup table. Every file found in the $PATH directories is indexed
+ * once by name, so resolving a command is a single hash probe instead of a
+ * stat() per directory. The table is rebuilt when $PATH changes, when one of
+ * the directories changes (mtime), on a lookup miss and on `hash -r`.
+ */
+#define PATH_CACHE_RECHECK_NS 1000000000L // re-stat PATH directories at most once a second
+
+struct path_entry {
+    char *name;
+    unsigned hash;
+    int dir;   // index into path_cache.dirs
+    int hits;
+    int state; // 0: not checked yet, 1: executable, -1: not executable
+};
+
+struct path_dir {
+    char *path;
+    struct timespec mtime;
+};
+
+struct {
+    char *env; // $PATH the table was built from
+    struct path_dir *dirs;
+    int dir_count;
+    struct path_entry *slots;
+    unsigned capacity, count;
+    struct timespec checked;
+    bool valid;
+} path_cache;
+
+unsigned long path_cache_generation; // counts rebuilds
+
+long timespec_diff_ns(struct timespec a, struct timespec b) {
+    return (a.tv_sec - b.tv_sec) * 1000000000L + (a.tv_nsec - b.tv_nsec);
+}
+
+void path_cache_clear() {
+    for (unsigned i = 0; i < path_cache.capacity; ++i)
+        free(path_cache.slots[i].name);
+    free(path_cache.slots);
+    for (int i = 0; i < path_cache.dir_count; ++i)
+        free(path_cache.dirs[i].path);
+    free(path_cache.dirs);
+    free(path_cache.env);
+    memset(&path_cache, 0, sizeof(path_cache));
+}
+
+/**
+ * Find the slot of a name in the table, or the empty slot it would go to
+ */
+struct path_entry *path_cache_slot(const char *name, unsigned hash) {
+    unsigned mask = path_cache.capacity - 1;
+    for (unsigned i = hash & mask;; i = (i + 1) & mask) {
+        struct path_entry *e = &path_cache.slots[i];
+        if (!e->name || (e->hash == hash && strcmp(e->name, name) == 0))
+            return e;
+    }
+}
+
+void path_cache_insert(const char *name, int dir) {
+    if ((path_cache.count + 1) * 2 > path_cache.capacity) {
+        struct path_entry *old = path_cache.slots;
+        unsigned old_capacity = path_cache.capacity;
+        path_cache.capacity = old_capacity ? old_capacity * 2 : 1024;
+        path_cache.slots = calloc(path_cache.capacity, sizeof(struct path_entry));
+        for (unsigned i = 0; i < old_capacity; ++i)
+            if (old[i].name)
+                *path_cache_slot(old[i].name, old[i].hash) = old[i];
+        free(old);
+    }
+    unsigned hash = hash_string(name, strlen(name));
+    struct path_entry *e = path_cache_slot(name, hash);
+    if (e->name)
+        return; // earlier directories in $PATH win
+    e->name = strdup(name);
+    e->hash = hash;
+    e->dir = dir;
+    path_cache.count++;
+}
+
+void path_cache_build() {
+    const char *env = getenv("PATH");
+    if (!env)
+        env = "/usr/local/bin:/usr/bin:/bin";
+    path_cache_clear();
+    path_cache.env = strdup(env);
+
+    char *list = strdup(env), *save = NULL;
+    for (char *dir = strtok_r(list, ":", &save); dir; dir = strtok_r(NULL, ":", &save)) {
+        path_cache.dirs = realloc(path_cache.dirs, sizeof(struct path_dir) * (path_cache.dir_count + 1));
+        struct path_dir *d = &path_cache.dirs[path_cache.dir_count++];
+        d->path = strdup(dir);
+        memset(&d->mtime, 0, sizeof(d->mtime));
+        struct stat st;
+        if (stat(dir, &st) == 0)
+            d->mtime = st.st_mtim;
+
+        DIR *dp = opendir(dir);
+        if (!dp)
+            continue;
+        struct dirent *de;
+        while ((de = readdir(dp)) != NULL) {
+            if (de->d_name[0] == '.' || de->d_type == DT_DIR)
+                continue;
+            path_cache_insert(de->d_name, path_cache.dir_count - 1);
+        }
+        closedir(dp);
+    }
+    free(list);
+    if (!path_cache.slots)
+        path_cache_insert("", -1); // keep the table allocated for empty $PATH
+    clock_gettime(CLOCK_MONOTONIC, &path_cache.checked);
+    path_cache.valid = true;
+    path_cache_generation++;
+}
+
+/**
+ * Check whether the table still reflects $PATH and its directories
+ * @param  force  re-stat the directories even if they were checked recently
+ * @return        true if the table has to be rebuilt
+ */
+bool path_cache_stale(bool force) {
+    if (!path_cache.valid)
+        return true;
+    const char *env = getenv("PATH");
+    if (!env)
+        env = "/usr/local/bin:/usr/bin:/bin";
+    if (strcmp(env, path_cache.env) != 0)
+        return true;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!force && timespec_diff_ns(now, path_cache.checked) < PATH_CACHE_RECHECK_NS)
+        return false;
+    path_cache.checked = now;
+    for (int i = 0; i < path_cache.dir_count; ++i) {
+        struct stat st;
+        struct timespec mtime = {0, 0};
+        if (stat(path_cache.dirs[i].path, &st) == 0)
+            mtime = st.st_mtim;
+        if (timespec_diff_ns(mtime, path_cache.dirs[i].mtime) != 0)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Resolve a command name to an executable path
+ * @param  name  command name, used as is if it contains a '/'
+ * @param  buf   buffer for the resolved path
+ * @param  size  size of buf
+ * @return       buf, or NULL if the command was not found
+ */
+char *resolve_command(const char *name, char *buf, size_t size) {
+    if (strchr(name, '/')) {
+        if (access(name, X_OK) != 0)
+            return NULL;
+        snprintf(buf, size, "%s", name);
+        return buf;
+    }
+    if (name[0] == 0)
+        return NULL;
+
+    if (path_cache_stale(false))
+        path_cache_build();
+    unsigned hash = hash_string(name, strlen(name));
+    struct path_entry *e = path_cache_slot(name, hash);
+    if (!e->name && path_cache_stale(true)) { // maybe installed since the last check
+        path_cache_build();
+        e = path_cache_slot(name, hash);
+    }
+    if (!e->name)
+        return NULL;
+
+    if (e->state == 0) {
+        snprintf(buf, size, "%s/%s", path_cache.dirs[e->dir].path, name);
+        e->state = access(buf, X_OK) == 0 ? 1 : -1;
+    }
+    if (e->state < 0) {
+        // shadowed by a non-executable file, look further down the $PATH
+        for (int i = e->dir + 1; i < path_cache.dir_count; ++i) {
+            snprintf(buf, size, "%s/%s", path_cache.dirs[i].path, name);
+            if (access(buf, X_OK) == 0) {
+                e->dir = i;
+                e->state = 1;
+                break;
+            }
+        }
+        if (e->state < 0)
+            return NULL;
+    }
+    e->hits++;
+    snprintf(buf, size, "%s/%s", path_cache.dirs[e->dir].path, name);
+    return buf;
+}
+
+/**
+ * hash builtin: list remembered commands, or forget them all with -r
+ */
+int builtin_hash(struct command_t *command) {
+    char path[PATH_MAX];
+    if (command->arg_count > 0 && strcmp(command->args[0], "-r") == 0) {
+        path_cache_clear();
+        return SUCCESS;
+    }
+    for (int i = 0; i < command->arg_count; ++i)
+        if (!resolve_command(command->args[i], path, sizeof(path)))
+            printf("-%s: hash: %s: not found\n", sysname, command->args[i]);
+    if (command->arg_count > 0)
+        return SUCCESS;
+
+    printf("hits\tcommand\n");
+    for (unsigned i = 0; i < path_cache.capacity; ++i) {
+        struct path_entry *e = &path_cache.slots[i];
+        if (e->name && e->hits > 0)
+            printf("%4d\t%s/%s\n", e->hits, path_cache.dirs[e->dir].path, e->name);
+    }
+    return SUCCESS;
+}
+
+/**
+ * Decode a wait status into a shell exit status
+ */
+int exit_status(int status) {
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return 0;
+}
+
+/**
+ * write() the whole buffer, retrying on short writes
+ * @return  0, or -1 on error
+ */
+int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Build a NULL terminated argv (name first) for exec
+ */
+char **command_argv(struct command_t *command) {
+    char **argv = malloc(sizeof(char *) * (command->arg_count + 2));
+    argv[0] = command->name;
+    for (int i = 0; i < command->arg_count; ++i)
+        argv[i + 1] = command->args[i];
+    argv[command->arg_count + 1] = NULL;
+    return argv;
+}
+
+/**
+ * Does the command have any redirections?
+ */
+bool redirect_any(struct command_t *command) {
+    for (int i = 0; i < REDIRECT_COUNT; ++i)
+        if (command->redirects[i])
+            return true;
+    return false;
+}
+
+/*
+ * Job control. Every command line that starts processes becomes a job in
+ * the job table. When the shell runs on a terminal each job gets its own
+ * process group, which is handed the terminal while it runs in the
+ * foreground. SIGCHLD is blocked and read from a signalfd, so finished
+ * background jobs are reaped from the prompt loop instead of a handler.
+ */
+#define MAX_JOBS 256
+
+struct job {
+    int id; // 0 for a free slot
+    unsigned seq; // launch/stop order, the highest one is the current job
+    pid_t pgid;
+    int count; // number of stages
+    pid_t *pids; // 0 for stages that are not processes
+    int *status;
+    bool *done;
+    int live, stopped;
+    struct forward_stage *forwards; // in-shell stages, joined when the job completes
+    bool background, notified;
+    char *text;
+};
+
+struct job jobs[MAX_JOBS];
+int job_count = 0; // slots in use
+unsigned job_seq = 0;
+bool interactive = false;
+pid_t shell_pgid = 0;
+struct termios shell_tmodes;
+int sigchld_fd = -1;
+
+/**
+ * Set up signals, the process group and the terminal for job control
+ * @param  use_terminal  interactive session: take over the terminal
+ */
+void init_job_control(bool use_terminal) {
+    signal(SIGPIPE, SIG_IGN); // in-shell pipeline stages get EPIPE instead
+    interactive = use_terminal;
+    if (interactive) {
+        // wait until we are in the foreground before taking over the terminal
+        while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp()))
+            kill(-shell_pgid, SIGTTIN);
+        signal(SIGINT, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+        setpgid(0, 0); // fails harmlessly if we already lead a session
+        shell_pgid = getpgrp();
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        tcgetattr(STDIN_FILENO, &shell_tmodes);
+        setvbuf(stdin, NULL, _IONBF, 0); // nothing hidden in stdio, so poll() on fd 0 is exact
+    }
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+/**
+ * Signals the shell ignores or blocks, which children must get back as default
+ */
+void job_signal_set(sigset_t *set) {
+    sigemptyset(set);
+    int sigs[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGPIPE, SIGCHLD};
+    for (size_t i = 0; i < sizeof(sigs) / sizeof(sigs[0]); ++i)
+        sigaddset(set, sigs[i]);
+}
+
+/**
+ * Child side of job setup for forked (builtin) stages
+ */
+void job_child_setup(pid_t pgid) {
+    if (interactive)
+        setpgid(0, pgid);
+    sigset_t set;
+    job_signal_set(&set);
+    for (int sig = 1; sig < NSIG; ++sig)
+        if (sigismember(&set, sig))
+            signal(sig, SIG_DFL);
+    sigemptyset(&set);
+    sigprocmask(SIG_SETMASK, &set, NULL);
+}
+
+/**
+ * Start an external command without copying the shell's address space:
+ * posix_spawn uses vfork/CLONE_VM under the hood, so the cost does not grow
+ * with the size of the shell.
+ * @param  command  command to run
+ * @param  in_fd    fd to use as the child's stdin
+ * @param  out_fd   fd to use as the child's stdout
+ * @param  err_fd   fd to use as the child's stderr
+ * @param  pgid     process group to join, 0 to start a new one
+ * @param  pid      set to the pid of the child
+ * @return          0, or an errno value (ENOENT if the command is not found)
+ */
+int spawn_command(struct command_t *command, int in_fd, int out_fd, int err_fd, pid_t pgid, pid_t *pid) {
+    char path[PATH_MAX];
+    if (!resolve_command(command->name, path, sizeof(path)))
+        return ENOENT;
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    job_signal_set(&mask);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    if (interactive) {
+        posix_spawnattr_setpgroup(&attr, pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd != STDIN_FILENO)
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    if (out_fd != STDOUT_FILENO)
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    if (err_fd != STDERR_FILENO)
+        posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+
+    fflush(stdout); // don't let buffered shell output land after the child's
+    char **argv = command->argv ? command->argv : command_argv(command);
+    int r = posix_spawn(pid, path, &actions, &attr, argv, environ);
+    if (r == ENOENT && !strchr(command->name, '/')) {
+        // cached entry was removed behind our back, rebuild and retry once
+        path_cache.valid = false;
+        if (resolve_command(command->name, path, sizeof(path)))
+            r = posix_spawn(pid, path, &actions, &attr, argv, environ);
+    }
+    if (argv != command->argv)
+        free(argv);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    return r;
+}
+
+/*
+ * Builtins. The shell's own builtins are one table, indexed by a perfect
+ * hash: BUILTIN_SEED was picked (offline, by trying seeds in order) so
+ * that no two names land in the same slot, and a lookup is a hash, a slot
+ * and one strcmp. The slot is taken from the top bits of the hash, the low
+ * ones only depend on the low bits of each byte. Adding a builtin may need
+ * a new seed; if the one here stops being perfect the next seeds are tried
+ * when the slots are filled. Builtins from plugins live in an open
+ * addressing table of their own, which is probed when the perfect hash
+ * misses. Builtins that stand in for external commands (see Coreutils)
+ * have an accepts() hook and leave what they don't handle to the program.
+ */
+#define BUILTIN_BITS 5
+#define BUILTIN_SLOTS (1 << BUILTIN_BITS) // a few times the number of builtins
+#define BUILTIN_SEED 0x8f06u
+#define BUILTIN_NO_TTY SEASHELL_BUILTIN_NO_TTY // never reads the terminal
+
+struct builtin {
+    const char *name;
+    int (*handler)(struct command_t *command);
+    int flags;
+    int (*run)(int argc, char **argv); // a plugin builtin, instead of handler
+    // NULL to run every command by that name, else false to run the program
+    bool (*accepts)(struct command_t *command, bool *reads_stdin);
+};
+
+// builtins, defined further down
+int builtin_exit(struct command_t *command);
+int builtin_cd(struct command_t *command);
+int builtin_hash(struct command_t *command);
+int builtin_jobs(struct command_t *command);
+int builtin_shortdir(struct command_t *command);
+int builtin_mynetwork(struct command_t *command);
+int builtin_goodmorning(struct command_t *command);
+int builtin_highlight(struct command_t *command);
+int builtin_kdiff(struct command_t *command);
+int builtin_plugin(struct command_t *command);
+int builtin_cat(struct command_t *command);
+int builtin_wc(struct command_t *command);
+int builtin_head(struct command_t *command);
+int builtin_ls(struct command_t *command);
+int builtin_grep(struct command_t *command);
+bool cat_accepts(struct command_t *command, bool *reads_stdin);
+bool wc_accepts(struct command_t *command, bool *reads_stdin);
+bool head_accepts(struct command_t *command, bool *reads_stdin);
+bool ls_accepts(struct command_t *command, bool *reads_stdin);
+bool grep_accepts(struct command_t *command, bool *reads_stdin);
+int builtin_time(struct command_t *command);
+int builtin_profile(struct command_t *command);
+int builtin_stats(struct command_t *command);
+int builtin_trace(struct command_t *command);
+
+const struct builtin builtins[] = {
+    {"exit", builtin_exit, BUILTIN_NO_TTY},
+    {"cd", builtin_cd, BUILTIN_NO_TTY},
+    {"hash", builtin_hash, BUILTIN_NO_TTY},
+    {"jobs", builtin_jobs, BUILTIN_NO_TTY},
+    {"fg", builtin_jobs, 0},
+    {"bg", builtin_jobs, BUILTIN_NO_TTY},
+    {"wait", builtin_jobs, 0},
+    {"shortdir", builtin_shortdir, BUILTIN_NO_TTY},
+    {"myNetwork", builtin_mynetwork, BUILTIN_NO_TTY},
+    {"goodMorning", builtin_goodmorning, 0},
+    {"highlight", builtin_highlight, 0},
+    {"kdiff", builtin_kdiff, 0},
+    {"plugin", builtin_plugin, BUILTIN_NO_TTY},
+    {"cat", builtin_cat, 0, NULL, cat_accepts},
+    {"wc", builtin_wc, 0, NULL, wc_accepts},
+    {"head", builtin_head, 0, NULL, head_accepts},
+    {"ls", builtin_ls, 0, NULL, ls_accepts},
+    {"grep", builtin_grep, 0, NULL, grep_accepts},
+    {"time", builtin_time, 0}, // the command it runs might read the terminal
+    {"profile", builtin_profile, 0},
+    {"stats", builtin_stats, BUILTIN_NO_TTY},
+    {"trace", builtin_trace, BUILTIN_NO_TTY},
+};
+
+#define BUILTIN_COUNT (sizeof(builtins) / sizeof(builtins[0]))
+
+unsigned char builtin_slots[BUILTIN_SLOTS]; // index into builtins + 1
+unsigned builtin_seed;
+
+struct {
+    struct builtin *entries;
+    size_t count, capacity;
+    struct builtin **slots; // open addressing over entries
+    size_t slot_count;
+    unsigned long generation; // counts plugins loaded
+    bool autoloaded;
+} plugins;
+
+unsigned builtin_hash_name(const char *name, unsigned seed) {
+    unsigned h = seed;
+    for (; *name; ++name) {
+        h ^= (unsigned char) *name;
+        h *= 16777619u;
+    }
+    return h >> (32 - BUILTIN_BITS);
+}
+
+void builtin_index() {
+    for (unsigned seed = BUILTIN_SEED;; ++seed) {
+        size_t i;
+        memset(builtin_slots, 0, sizeof(builtin_slots));
+        for (i = 0; i < BUILTIN_COUNT; ++i) {
+            unsigned slot = builtin_hash_name(builtins[i].name, seed);
+            if (builtin_slots[slot])
+                break;
+            builtin_slots[slot] = i + 1;
+        }
+        if (i == BUILTIN_COUNT) {
+            builtin_seed = seed;
+            return;
+        }
+    }
+}
+
+struct builtin **plugin_slot(const char *name) {
+    size_t mask = plugins.slot_count - 1;
+    for (size_t k = hash_string(name, strlen(name)) & mask;; k = (k + 1) & mask)
+        if (!plugins.slots[k] || strcmp(plugins.slots[k]->name, name) == 0)
+            return &plugins.slots[k];
+}
+
+const struct builtin *builtin_find(const char *name);
+
+/**
+ * Load a plugin and add its builtins
+ * @return  the number added, or -1 after printing why
+ */
+int plugin_load(const char *path) {
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        printf("-%s: plugin: %s\n", sysname, dlerror());
+        return -1;
+    }
+    const struct seashell_plugin *(*init)(void) = (const struct seashell_plugin *(*)(void)) dlsym(handle, "seashell_plugin_init");
+    const struct seashell_plugin *plugin = init ? init() : NULL;
+    if (!plugin || plugin->version != SEASHELL_PLUGIN_VERSION) {
+        printf("-%s: plugin: %s: not a version %d seashell plugin\n", sysname, path, SEASHELL_PLUGIN_VERSION);
+        dlclose(handle);
+        return -1;
+    }
+    int added = 0;
+    for (int i = 0; i < plugin->count; ++i) {
+        const struct seashell_builtin *b = &plugin->builtins[i];
+        if (builtin_find(b->name)) {
+            printf("-%s: plugin: %s: %s is already a builtin\n", sysname, path, b->name);
+            continue;
+        }
+        if (plugins.count == plugins.capacity) {
+            plugins.capacity = plugins.capacity ? plugins.capacity * 2 : 16;
+            plugins.entries = realloc(plugins.entries, sizeof(struct builtin) * plugins.capacity);
+        }
+        plugins.entries[plugins.count++] = (struct builtin) {strdup(b->name), NULL, b->flags, b->run};
+        // entries may have moved: index them all again
+        if (plugins.count * 2 > plugins.slot_count)
+            plugins.slot_count = plugins.slot_count ? plugins.slot_count * 2 : 32;
+        free(plugins.slots);
+        plugins.slots = calloc(plugins.slot_count, sizeof(struct builtin *));
+        for (size_t k = 0; k < plugins.count; ++k)
+            *plugin_slot(plugins.entries[k].name) = &plugins.entries[k];
+        added++;
+    }
+    plugins.generation++;
+    return added; // the handle stays open for as long as the shell runs
+}
+
+/**
+ * Load the plugins listed in $SEASHELL_PLUGINS, once
+ */
+void plugin_autoload() {
+    const char *env = getenv("SEASHELL_PLUGINS");
+    plugins.autoloaded = true;
+    if (!env)
+        return;
+    char *list = strdup(env), *save = NULL;
+    for (char *path = strtok_r(list, ":", &save); path; path = strtok_r(NULL, ":", &save))
+        plugin_load(path);
+    free(list);
+}
+
+/**
+ * Look up a builtin by name
+ * @return  the builtin, or NULL if there is none by that name
+ */
+const struct builtin *builtin_find(const char *name) {
+    if (!builtin_seed)
+        builtin_index();
+    unsigned char slot = builtin_slots[builtin_hash_name(name, builtin_seed)];
+    if (slot && strcmp(builtins[slot - 1].name, name) == 0)
+        return &builtins[slot - 1];
+    if (!plugins.autoloaded)
+        plugin_autoload();
+    if (!plugins.count)
+        return NULL;
+    return *plugin_slot(name);
+}
+
+bool is_builtin(const char *name) {
+    return builtin_find(name) != NULL;
+}
+
+/**
+ * The builtin to run a command with: NULL for an external command, and for
+ * one a builtin stands in for but leaves to the program this time
+ * @param  reads_stdin  set if the builtin would read its stdin, may be NULL
+ */
+const struct builtin *builtin_for(struct command_t *command, bool *reads_stdin) {
+    const struct builtin *b = builtin_find(command->name);
+    bool reads = false;
+    if (b && b->accepts && !b->accepts(command, &reads))
+        return NULL;
+    if (reads_stdin)
+        *reads_stdin = reads;
+    return b;
+}
+
+int builtin_flags(const char *name) {
+    const struct builtin *b = builtin_find(name);
+    return b ? b->flags : 0;
+}
+
+/**
+ * Name of the i-th builtin, counting plugins after the shell's own
+ * @return  the name, or NULL past the last one
+ */
+const char *builtin_name(size_t i) {
+    if (i < BUILTIN_COUNT)
+        return builtins[i].name;
+    if (!plugins.autoloaded)
+        plugin_autoload();
+    return i - BUILTIN_COUNT < plugins.count ? plugins.entries[i - BUILTIN_COUNT].name : NULL;
+}
+
+/**
+ * Run a builtin in the shell process
+ */
+int builtin_run(const struct builtin *b, struct command_t *command) {
+    if (b->handler == builtin_trace) // would leave a lone E first and a lone B last
+        return b->handler(command);
+    if (b->handler) {
+        TRACE(TRACE_BUILTIN, 'B', b->name, 0);
+        int code = b->handler(command);
+        TRACE(TRACE_BUILTIN, 'E', b->name, last_status);
+        return code;
+    }
+    TRACE(TRACE_BUILTIN, 'B', b->name, 0);
+    char **argv = command->argv ? command->argv : command_argv(command);
+    fflush(stdout);
+    last_status = b->run(command->arg_count + 1, argv) & 0xff;
+    fflush(stdout);
+    TRACE(TRACE_BUILTIN, 'E', b->name, last_status);
+    if (argv != command->argv)
+        free(argv);
+    return SUCCESS;
+}
+
+/**
+ * plugin load file.so... | plugin list
+ */
+int builtin_plugin(struct command_t *command) {
+    const char *op = command->arg_count > 0 ? command->args[0] : "";
+    last_status = 0;
+    if (strcmp(op, "load") == 0 && command->arg_count > 1) {
+        for (int i = 1; i < command->arg_count; ++i)
+            if (plugin_load(command->args[i]) == -1)
+                last_status = 1;
+    } else if (strcmp(op, "list") == 0 && command->arg_count == 1) {
+        if (!plugins.autoloaded)
+            plugin_autoload();
+        for (size_t i = 0; i < plugins.count; ++i)
+            printf("%s\n", plugins.entries[i].name);
+    } else {
+        printf("usage: plugin load file.so...\n"
+               "       plugin list\n");
+        last_status = 2;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Pipelines. Every stage of a `a | b | c` chain is started before any of
+ * them is waited for, connected through O_CLOEXEC pipes whose buffers are
+ * enlarged so that producers rarely block. External commands are spawned
+ * with the pipe ends as stdin/stdout, builtins run in a forked child so they
+ * read and write the pipe fds directly, and stages that only forward data
+ * (`cat` without files, `tee FILE`) run as threads inside the shell moving
+ * the data with splice()/tee() so it never enters user space. Those threads
+ * are only used for foreground stages that don't read the terminal.
+ */
+#define PIPELINE_PIPE_SIZE (1 << 20)
+#define PIPELINE_CHUNK (1 << 20)
+
+struct forward_stage {
+    int in, out;
+    int file; // tee target, -1 for plain cat
+    char *path; // of the tee target, for errors
+    int status; // exit status, once the thread is done
+    pthread_t thread;
+};
+
+/**
+ * Check whether a stage only copies its input to its output (and maybe one file)
+ * @return  1 for cat, 2 for tee, 0 otherwise
+ */
+int forward_stage_kind(struct command_t *command) {
+    if (redirect_any(command))
+        return 0;
+    if (strcmp(command->name, "cat") == 0 && (command->arg_count == 0
+            || (command->arg_count == 1 && strcmp(command->args[0], "-") == 0)))
+        return 1;
+    if (strcmp(command->name, "tee") == 0 && command->arg_count == 1
+            && command->args[0][0] != '-')
+        return 2;
+    return 0;
+}
+
+/**
+ * Copy in to out (and file) through a user-space buffer, for fds splice can't handle
+ * @return  0, 1 with errno set if writing file failed (out still got
+ *          everything), or -1 if reading or writing out failed
+ */
+int forward_copy(int in, int out, int file) {
+    char *buf = malloc(PIPELINE_CHUNK);
+    ssize_t n;
+    int r = 0, file_error = 0;
+    while ((n = read(in, buf, PIPELINE_CHUNK)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (file >= 0 && write_all(file, buf, n) < 0) {
+            file = -1;
+            r = 1;
+            file_error = errno;
+        }
+        if (write_all(out, buf, n) < 0)
+            break;
+    }
+    free(buf);
+    errno = file_error;
+    return n == 0 ? r : -1;
+}
+
+/**
+ * Stop writing a tee stage's file after an error, like tee: the output
+ * still gets everything
+ */
+void forward_file_failed(struct forward_stage *stage, int error) {
+    printf("-%s: tee: %s: %s\n", sysname, stage->path, strerror(error));
+    fflush(stdout);
+    close(stage->file);
+    stage->file = -1;
+    stage->status = 1;
+}
+
+void *forward_stage_run(void *arg) {
+    struct forward_stage *stage = arg;
+    ssize_t n;
+    int64_t moved = 0; // for the trace
+    const char *name = stage->path ? "tee" : "cat";
+    TRACE(TRACE_FORWARD, 'B', name, 0);
+    for (;;) {
+        if (stage->file >= 0) {
+            // duplicate the pipe contents to the output, then move them into the file
+            n = tee(stage->in, stage->out, PIPELINE_CHUNK, 0);
+            if (n > 0) {
+                ssize_t left = n;
+                moved += n;
+                ssize_t m = 1;
+                while (left > 0 && (m = splice(stage->in, NULL, stage->file, NULL, left, SPLICE_F_MOVE)) > 0)
+                    left -= m;
+                if (left > 0 && !(m < 0 && (errno == EINVAL || errno == EINTR))) // EINVAL: no splicing to it
+                    forward_file_failed(stage, m == 0 ? ENOSPC : errno);
+                // the rest has been copied to the output already; write it to the file, or drop it
+                char buf[4096];
+                while (left > 0) {
+                    m = read(stage->in, buf, left < (ssize_t) sizeof(buf) ? left : (ssize_t) sizeof(buf));
+                    if (m <= 0 && (m == 0 || errno != EINTR))
+                        break;
+                    if (m > 0 && stage->file >= 0 && write_all(stage->file, buf, m) < 0)
+                        forward_file_failed(stage, errno);
+                    left -= m > 0 ? m : 0;
+                }
+                continue;
+            }
+        } else {
+            n = splice(stage->in, NULL, stage->out, NULL, PIPELINE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+            moved += n > 0 ? n : 0;
+            if (n > 0)
+                continue;
+        }
+        if (n == 0)
+            break;
+        if (errno == EINTR)
+            continue;
+        int r = -1;
+        if (errno == EINVAL) // one side is not a pipe (terminal, socket, ...)
+            r = forward_copy(stage->in, stage->out, stage->file);
+        if (r == 1)
+            forward_file_failed(stage, errno);
+        else if (r == -1)
+            stage->status = errno == EPIPE ? 128 + SIGPIPE : 1; // as if the signal had killed it
+        break;
+    }
+    if (stage->in != STDIN_FILENO)
+        close(stage->in);
+    if (stage->out != STDOUT_FILENO)
+        close(stage->out);
+    if (stage->file >= 0)
+        close(stage->file);
+    TRACE(TRACE_FORWARD, 'E', name, moved);
+    return NULL;
+}
+
+/**
+ * Join the stages of a command line into the text shown by `jobs`
+ */
+char *job_text(struct command_t *command) {
+    size_t len = 1;
+    for (struct command_t *c = command; c; c = c->next) {
+        len += strlen(c->name) + 4;
+        for (int i = 0; i < c->arg_count; ++i)
+            len += strlen(c->args[i]) + 1;
+    }
+    char *text = malloc(len), *p = text;
+    for (struct command_t *c = command; c; c = c->next) {
+        p += sprintf(p, "%s%s", c == command ? "" : " | ", c->name);
+        for (int i = 0; i < c->arg_count; ++i)
+            p += sprintf(p, " %s", c->args[i]);
+    }
+    return text;
+}
+
+struct job *job_alloc(int count) {
+    int id = 1;
+    for (int i = 0; i < MAX_JOBS; ++i) // one past the highest id in use, like bash
+        if (jobs[i].id >= id)
+            id = jobs[i].id + 1;
+    for (int i = 0; i < MAX_JOBS; ++i) {
+        if (jobs[i].id)
+            continue;
+        struct job *job = &jobs[i];
+        memset(job, 0, sizeof(*job));
+        job->id = id;
+        job->seq = ++job_seq;
+        job->count = count;
+        job->pids = calloc(count, sizeof(pid_t));
+        job->status = calloc(count, sizeof(int));
+        job->done = calloc(count, sizeof(bool));
+        job->forwards = calloc(count, sizeof(struct forward_stage));
+        job_count++;
+        return job;
+    }
+    return NULL;
+}
+
+/**
+ * Wait for a finished job's in-shell stages and record their exit statuses
+ */
+void job_join_forwards(struct job *job) {
+    for (int i = 0; i < job->count; ++i) {
+        struct forward_stage *forward = &job->forwards[i];
+        if (!forward->in)
+            continue;
+        pthread_join(forward->thread, NULL);
+        job->status[i] = W_EXITCODE(forward->status, 0);
+        forward->in = 0;
+        free(forward->path);
+        forward->path = NULL;
+    }
+}
+
+void job_free(struct job *job) {
+    job_join_forwards(job);
+    free(job->pids);
+    free(job->status);
+    free(job->done);
+    free(job->forwards);
+    free(job->text);
+    memset(job, 0, sizeof(*job));
+    job_count--;
+}
+
+// profiling, defined further down
+void profile_child(struct job *job, const struct rusage *usage);
+
+/**
+ * Record a status change reported by wait4
+ * @param  usage  what the process used, if it exited
+ * @return        false if pid does not belong to any job
+ */
+bool job_update(pid_t pid, int status, const struct rusage *usage) {
+    for (int i = 0; i < MAX_JOBS; ++i) {
+        struct job *job = &jobs[i];
+        if (!job->id)
+            continue;
+        for (int k = 0; k < job->count; ++k) {
+            if (job->pids[k] != pid || job->done[k])
+                continue;
+            if (WIFSTOPPED(status)) {
+                job->stopped++;
+                job->seq = ++job_seq;
+                job->notified = false;
+            } else if (WIFCONTINUED(status)) {
+                if (job->stopped > 0)
+                    job->stopped--;
+            } else {
+                job->status[k] = status;
+                job->done[k] = true;
+                profile_child(job, usage);
+                TRACE(TRACE_EXIT, 'i', job->text, pid);
+                job->live--;
+                job->notified = false;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Reap every child that changed state, without blocking
+ */
+void reap_jobs() {
+    struct signalfd_siginfo info;
+    while (sigchld_fd >= 0 && read(sigchld_fd, &info, sizeof(info)) == sizeof(info))
+        ; // drain, the wait4 loop below collects everything
+    int status;
+    pid_t pid;
+    struct rusage usage;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0)
+        job_update(pid, status, &usage);
+}
+
+const char *job_state(struct job *job) {
+    if (job->live == 0)
+        return "Done";
+    return job->stopped > 0 ? "Stopped" : "Running";
+}
+
+struct job *current_job() {
+    struct job *best = NULL;
+    for (int i = 0; i < MAX_JOBS; ++i)
+        if (jobs[i].id && (!best || jobs[i].seq > best->seq))
+            best = &jobs[i];
+    return best;
+}
+
+void print_job(struct job *job) {
+    printf("[%d]%c  %-8s %s\n", job->id, job == current_job() ? '+' : ' ', job_state(job), job->text);
+}
+
+/**
+ * Report background jobs that finished or stopped since the last prompt,
+ * and drop finished ones from the table
+ * @param  report  print them (scripts drop them silently)
+ */
+void notify_jobs(bool report) {
+    if (job_count == 0)
+        return; // every child belongs to a job, nothing can be waiting
+    reap_jobs();
+    for (int i = 0; i < MAX_JOBS; ++i) {
+        struct job *job = &jobs[i];
+        if (!job->id || job->notified)
+            continue;
+        if (report && (job->live == 0 || job->stopped > 0))
+            print_job(job);
+        job->notified = true;
+        if (job->live == 0)
+            job_free(job);
+    }
+}
+
+/**
+ * Block until every process of the job has exited or the job stopped
+ */
+void wait_for_job(struct job *job) {
+    TRACE(TRACE_WAIT, 'B', job->text, job->live);
+    while (job->live > 0 && job->stopped == 0) {
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(-1, &status, WUNTRACED, &usage);
+        if (pid == -1) {
+            if (errno == EINTR)
+                continue;
+            break; // ECHILD: nothing left to wait for
+        }
+        job_update(pid, status, &usage);
+    }
+    TRACE(TRACE_WAIT, 'E', job->text, job->live);
+}
+
+/**
+ * Run a job in the foreground: give it the terminal, wait for it, take the
+ * terminal back and set last_status. The job is freed unless it stopped.
+ * @param  resume  send SIGCONT first (fg)
+ */
+void foreground_job(struct job *job, bool resume) {
+    job->background = false;
+    terminal_restore(); // the job gets the terminal as the shell found it
+    if (interactive && job->pgid)
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    if (resume) {
+        job->stopped = 0;
+        if (job->pgid)
+            kill(-job->pgid, SIGCONT);
+        else
+            for (int i = 0; i < job->count; ++i)
+                if (job->pids[i] && !job->done[i])
+                    kill(job->pids[i], SIGCONT);
+    }
+    wait_for_job(job);
+    if (interactive) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        if (job->stopped > 0)
+            tcgetattr(STDIN_FILENO, &shell_tmodes); // keep the job's terminal modes for fg
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    }
+
+    if (job->stopped > 0) {
+        job->background = true;
+        job->notified = true;
+        printf("\n");
+        print_job(job);
+        last_status = 128 + SIGTSTP;
+        return;
+    }
+    job_join_forwards(job);
+    last_status = exit_status(job->status[job->count - 1]);
+    job_free(job);
+}
+
+/*
+ * Redirections. `< file`, `<<< word`, `> file`, `>> file`, `2> file` and
+ * `&> file` (stdout and stderr, before > and 2> are applied) are opened by
+ * the shell before the command starts. External commands get them through
+ * posix_spawn file actions, forked builtin stages dup2() them, and builtins
+ * the shell runs itself get them swapped in for stdin, stdout and stderr
+ * and back. A here-string is a memfd holding the word and a newline. When
+ * all that is left for cat to do is copy regular files into a regular
+ * file, the shell does it inside the kernel with copy_file_range() (or
+ * sendfile()), and the data never passes through a user-space buffer.
+ */
+#define REDIRECT_COPY_CHUNK (1L << 30)
+
+/**
+ * Open a command's redirections
+ * @param  fds  set to the fds for stdin, stdout and stderr, -1 where not redirected
+ * @return      0, or -1 after printing why (nothing is left open then)
+ */
+int redirect_open(struct command_t *command, int fds[3]) {
+    char **r = command->redirects;
+    const int write_flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+    fds[0] = fds[1] = fds[2] = -1;
+    const char *failed = NULL;
+    if (r[REDIRECT_HERE]) {
+        fds[0] = memfd_create("here-string", MFD_CLOEXEC);
+        if (fds[0] != -1 && (write_all(fds[0], r[REDIRECT_HERE], strlen(r[REDIRECT_HERE])) == -1
+                             || write_all(fds[0], "\n", 1) == -1 || lseek(fds[0], 0, SEEK_SET) == -1)) {
+            close(fds[0]);
+            fds[0] = -1;
+        }
+        if (fds[0] == -1)
+            failed = "<<<";
+    } else if (r[REDIRECT_IN] && (fds[0] = open(r[REDIRECT_IN], O_RDONLY | O_CLOEXEC)) == -1)
+        failed = r[REDIRECT_IN];
+    if (!failed && r[REDIRECT_ALL]) {
+        if ((fds[1] = open(r[REDIRECT_ALL], write_flags | O_TRUNC, 0666)) == -1
+            || (fds[2] = fcntl(fds[1], F_DUPFD_CLOEXEC, 0)) == -1)
+            failed = r[REDIRECT_ALL];
+    }
+    const char *out = r[REDIRECT_OUT] ? r[REDIRECT_OUT] : r[REDIRECT_APPEND];
+    if (!failed && out) {
+        if (fds[1] != -1)
+            close(fds[1]);
+        if ((fds[1] = open(out, write_flags | (r[REDIRECT_OUT] ? O_TRUNC : O_APPEND), 0666)) == -1)
+            failed = out;
+    }
+    if (!failed && r[REDIRECT_ERR]) {
+        if (fds[2] != -1)
+            close(fds[2]);
+        if ((fds[2] = open(r[REDIRECT_ERR], write_flags | O_TRUNC, 0666)) == -1)
+            failed = r[REDIRECT_ERR];
+    }
+    if (!failed)
+        return 0;
+    printf("-%s: %s: %s\n", sysname, failed, strerror(errno));
+    fflush(stdout);
+    for (int i = 0; i < 3; ++i)
+        if (fds[i] != -1)
+            close(fds[i]);
+    return -1;
+}
+
+/**
+ * Swap opened redirections in for the shell's own stdin, stdout and stderr
+ * @param  saved  set to copies of the fds they replace, for redirect_pop
+ */
+void redirect_push(int fds[3], int saved[3]) {
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < 3; ++i) {
+        saved[i] = -1;
+        if (fds[i] == -1)
+            continue;
+        saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+    if (fds[0] != -1)
+        __fpurge(stdin);
+}
+
+void redirect_pop(int saved[3]) {
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < 3; ++i) {
+        if (saved[i] == -1)
+            continue;
+        dup2(saved[i], i);
+        close(saved[i]);
+    }
+    if (saved[0] != -1)
+        __fpurge(stdin);
+}
+
+/**
+ * Copy everything from in to the end of out: copy_file_range, else
+ * sendfile, else through a buffer
+ * @return  0, or -1 on error
+ */
+int redirect_copy(int in, int out) {
+    ssize_t n;
+    int64_t copied = 0; // for the trace
+    TRACE(TRACE_COPY, 'B', "copy_file_range", in);
+    while ((n = copy_file_range(in, NULL, out, NULL, REDIRECT_COPY_CHUNK, 0)) > 0)
+        copied += n;
+    if (n != 0 && (errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP || errno == ENOSYS || errno == EBADF)) {
+        while ((n = sendfile(out, in, NULL, REDIRECT_COPY_CHUNK)) > 0)
+            copied += n;
+        if (n != 0 && (errno == EINVAL || errno == ENOSYS))
+            n = forward_copy(in, out, -1);
+    }
+    TRACE(TRACE_COPY, 'E', "copy_file_range", copied);
+    return n == 0 ? 0 : -1;
+}
+
+/**
+ * `cat file... > out`, `cat < file >> out`: copied by the shell when the
+ * inputs and the output are regular files, the output none of the inputs
+ * @return  true if it was done here (last_status is set), false to run cat
+ */
+bool redirect_cat(struct command_t *command) {
+    char **r = command->redirects;
+    const char *out_path = r[REDIRECT_OUT] ? r[REDIRECT_OUT] : r[REDIRECT_APPEND];
+    int inputs = command->arg_count ? command->arg_count : 1;
+    char **paths = command->arg_count ? command->args : &r[REDIRECT_IN];
+    if (strcmp(command->name, "cat") != 0 || !out_path || r[REDIRECT_ALL] || r[REDIRECT_HERE]
+        || (command->arg_count > 0) == (r[REDIRECT_IN] != NULL))
+        return false;
+    struct stat st, out_st;
+    bool exists = stat(out_path, &out_st) == 0;
+    if (exists && !S_ISREG(out_st.st_mode))
+        return false;
+    for (int i = 0; i < inputs; ++i)
+        if (paths[i][0] == '-' || stat(paths[i], &st) == -1 || !S_ISREG(st.st_mode)
+            || (exists && st.st_dev == out_st.st_dev && st.st_ino == out_st.st_ino))
+            return false; // options, errors and odd files are for cat itself
+
+    int fds[3];
+    if (redirect_open(command, fds) == -1) {
+        last_status = 1;
+        return true;
+    }
+    if (fds[0] != -1)
+        close(fds[0]);
+    if (fds[2] != -1)
+        close(fds[2]);
+    // O_APPEND rules out copy_file_range, and no one else writes the file meanwhile
+    if (r[REDIRECT_APPEND]) {
+        fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) & ~O_APPEND);
+        lseek(fds[1], 0, SEEK_END);
+    }
+    last_status = 0;
+    for (int i = 0; i < inputs; ++i) {
+        int in = open(paths[i], O_RDONLY | O_CLOEXEC);
+        if (in == -1 || redirect_copy(in, fds[1]) == -1) {
+            printf("-%s: cat: %s: %s\n", sysname, paths[i], strerror(errno));
+            last_status = 1;
+        }
+        if (in != -1)
+            close(in);
+    }
+    close(fds[1]);
+    return true;
+}
+
+/**
+ * Run a builtin in the shell with its redirections in place
+ */
+int redirect_builtin(struct command_t *command) {
+    int fds[3], saved[3];
+    char *redirects[REDIRECT_COUNT];
+    if (redirect_open(command, fds) == -1) {
+        last_status = 1;
+        return SUCCESS;
+    }
+    redirect_push(fds, saved);
+    memcpy(redirects, command->redirects, sizeof(redirects));
+    memset(command->redirects, 0, sizeof(redirects));
+    int r = process_command(command);
+    memcpy(command->redirects, redirects, sizeof(redirects));
+    redirect_pop(saved);
+    return r;
+}
+
+/**
+ * Run a chain of commands linked through command->next as one job. A single
+ * command is just a pipeline of one stage.
+ * @param  command  first stage of the pipeline
+ * @return          SUCCESS, last_status is set from the last stage
+ */
+int launch_job(struct command_t *command) {
+    int n = 0;
+    for (struct command_t *c = command; c; c = c->next)
+        n++;
+    bool background = command->background;
+
+    struct job *job = job_alloc(n);
+    if (!job) {
+        printf("-%s: too many jobs\n", sysname);
+        last_status = 1;
+        return UNKNOWN;
+    }
+    job->text = job_text(command);
+    job->background = background;
+
+    int *fds = malloc(sizeof(int) * 2 * n);
+    for (int i = 0; i < n - 1; ++i) {
+        if (pipe2(&fds[2 * i], O_CLOEXEC) == -1) {
+            printf("-%s: pipe: %s\n", sysname, strerror(errno));
+            for (int j = 0; j < 2 * i; ++j)
+                close(fds[j]);
+            free(fds);
+            job_free(job);
+            last_status = 1;
+            return UNKNOWN;
+        }
+        fcntl(fds[2 * i + 1], F_SETPIPE_SZ, PIPELINE_PIPE_SIZE); // best effort, capped by pipe-max-size
+    }
+
+    fflush(stdout);
+    TRACE(TRACE_LAUNCH, 'B', command->name, n);
+    int i = 0;
+    for (struct command_t *c = command; c; c = c->next, ++i) {
+        int pipe_in = i == 0 ? STDIN_FILENO : fds[2 * (i - 1)];
+        int pipe_out = i == n - 1 ? STDOUT_FILENO : fds[2 * i + 1];
+        int in = pipe_in, out = pipe_out, err = STDERR_FILENO, redirected[3] = {-1, -1, -1};
+        int kind = !background && i > 0 ? forward_stage_kind(c) : 0;
+        struct forward_stage *forward = &job->forwards[i];
+        const struct builtin *b;
+
+        if (kind) {
+            forward->in = in;
+            forward->out = out;
+            forward->file = -1;
+            if (kind == 2) {
+                forward->path = strdup(c->args[0]);
+                forward->file = open(c->args[0], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+                if (forward->file == -1) {
+                    printf("-%s: tee: %s: %s\n", sysname, c->args[0], strerror(errno));
+                    forward->status = 1;
+                }
+            }
+            job->done[i] = true; // started once every process is running
+            continue;
+        }
+
+        bool opened = redirect_open(c, redirected) == 0; // redirections take over from the pipes
+        in = redirected[0] != -1 ? redirected[0] : in;
+        out = redirected[1] != -1 ? redirected[1] : out;
+        err = redirected[2] != -1 ? redirected[2] : err;
+
+        if (!opened) {
+            job->pids[i] = 0;
+            job->status[i] = 1 << 8;
+        } else if ((b = builtin_for(c, NULL))) {
+            TRACE(TRACE_FORK, 'B', c->name, i);
+            job->pids[i] = fork();
+            if (job->pids[i] == 0) {
+                job_child_setup(job->pgid);
+                dup2(in, STDIN_FILENO);
+                dup2(out, STDOUT_FILENO);
+                dup2(err, STDERR_FILENO);
+                __fpurge(stdin); // drop input the shell had buffered, read the pipe instead
+                for (int j = 0; j < 2 * (n - 1); ++j)
+                    close(fds[j]);
+                c->next = NULL;
+                c->background = false;
+                memset(c->redirects, 0, sizeof(c->redirects)); // in place already
+                builtin_run(b, c);
+                fflush(stdout);
+                _exit(last_status);
+            }
+            TRACE(TRACE_FORK, 'E', c->name, job->pids[i]);
+            if (job->pids[i] == -1) {
+                printf("-%s: %s: %s\n", sysname, c->name, strerror(errno));
+                job->pids[i] = 0;
+            }
+        } else {
+            TRACE(TRACE_SPAWN, 'B', c->name, i);
+            int r = spawn_command(c, in, out, err, job->pgid, &job->pids[i]);
+            TRACE(TRACE_SPAWN, 'E', c->name, r ? -r : job->pids[i]);
+            if (r != 0) {
+                if (r == ENOENT)
+                    printf("-%s: %s: command not found\n", sysname, c->name);
+                else
+                    printf("-%s: %s: %s\n", sysname, c->name, strerror(r));
+                fflush(stdout);
+                job->pids[i] = 0;
+                job->status[i] = (r == ENOENT ? 127 : 126) << 8;
+            }
+        }
+        if (job->pids[i]) {
+            if (!job->pgid)
+                job->pgid = interactive ? job->pids[i] : 0;
+            if (interactive)
+                setpgid(job->pids[i], job->pgid); // also from here, whoever runs first wins
+            job->live++;
+        } else {
+            job->done[i] = true;
+        }
+        // the shell keeps only the ends handed to its own forwarding threads
+        if (pipe_in != STDIN_FILENO)
+            close(pipe_in);
+        if (pipe_out != STDOUT_FILENO)
+            close(pipe_out);
+        for (int k = 0; k < 3; ++k)
+            if (redirected[k] != -1)
+                close(redirected[k]);
+    }
+
+    for (i = 0; i < n; ++i) {
+        struct forward_stage *forward = &job->forwards[i];
+        if (forward->in)
+            pthread_create(&forward->thread, NULL, forward_stage_run, forward);
+    }
+    free(fds);
+    TRACE(TRACE_LAUNCH, 'E', command->name, n);
+
+    if (background) {
+        job->notified = true;
+        if (interactive)
+            printf("[%d] %d\n", job->id, job->pids[0] ? job->pids[0] : job->pgid);
+        last_status = 0;
+        return SUCCESS;
+    }
+    foreground_job(job, false);
+    return SUCCESS;
+}
+
+/**
+ * Find the job a `%n` / pid / empty argument of fg, bg or wait refers to
+ */
+struct job *find_job(const char *spec) {
+    if (!spec)
+        return current_job();
+    int n = atoi(spec[0] == '%' ? spec + 1 : spec);
+    for (int i = 0; i < MAX_JOBS; ++i) {
+        if (!jobs[i].id)
+            continue;
+        if (spec[0] == '%' && jobs[i].id == n)
+            return &jobs[i];
+        for (int k = 0; spec[0] != '%' && k < jobs[i].count; ++k)
+            if (jobs[i].pids[k] == n)
+                return &jobs[i];
+    }
+    return NULL;
+}
+
+/**
+ * jobs, fg, bg and wait builtins
+ */
+int builtin_jobs(struct command_t *command) {
+    char *spec = command->arg_count > 0 ? command->args[0] : NULL;
+    reap_jobs();
+
+    if (strcmp(command->name, "jobs") == 0) {
+        for (int i = 0; i < MAX_JOBS; ++i)
+            if (jobs[i].id) {
+                print_job(&jobs[i]);
+                jobs[i].notified = true;
+            }
+        for (int i = 0; i < MAX_JOBS; ++i)
+            if (jobs[i].id && jobs[i].live == 0)
+                job_free(&jobs[i]);
+        return SUCCESS;
+    }
+
+    if (strcmp(command->name, "wait") == 0) {
+        last_status = 0;
+        if (spec && !find_job(spec)) {
+            printf("-%s: %s: %s: no such job\n", sysname, command->name, spec);
+            last_status = 127;
+            return SUCCESS;
+        }
+        for (int i = 0; i < MAX_JOBS; ++i) {
+            struct job *job = &jobs[i];
+            if (!job->id || (spec && job != find_job(spec)) || job->stopped > 0)
+                continue;
+            wait_for_job(job);
+            if (job->live == 0) {
+                job_join_forwards(job);
+                last_status = exit_status(job->status[job->count - 1]);
+                job->notified = true;
+                job_free(job);
+            }
+        }
+        return SUCCESS;
+    }
+
+    struct job *job = find_job(spec);
+    if (!job) {
+        printf("-%s: %s: %s: no such job\n", sysname, command->name, spec ? spec : "current");
+        last_status = 1;
+        return SUCCESS;
+    }
+    printf("%s\n", job->text);
+    if (strcmp(command->name, "fg") == 0) {
+        foreground_job(job, true);
+        return SUCCESS;
+    }
+    // bg
+    job->stopped = 0;
+    job->background = true;
+    job->seq = ++job_seq;
+    if (job->pgid)
+        kill(-job->pgid, SIGCONT);
+    else
+        for (int i = 0; i < job->count; ++i)
+            if (job->pids[i] && !job->done[i])
+                kill(job->pids[i], SIGCONT);
+    last_status = 0;
+    return SUCCESS;
+}
+
+/*
+ * kdiff text mode. Both files are mapped, every line is hashed once and
+ * equal lines are given the same integer id, so the diff itself only ever
+ * compares ints. Large inputs are first cut at lines that occur exactly once
+ * in both files (patience diff anchors); the pieces in between go through
+ * Myers' linear space O(ND) algorithm. Output is a unified diff.
+ */
+#define DIFF_CONTEXT 3
+#define DIFF_PATIENCE_MIN 4096 // ranges with at least this many lines look for anchors first
+#define DIFF_EXACT_MAX 65536 // ranges up to this size always get a minimal diff
+
+/**
+ * 64 bit xxHash (XXH64) of len bytes
+ */
+uint64_t hash64(const void *data, size_t len, uint64_t seed) {
+    const uint64_t p1 = 11400714785074694791ULL, p2 = 14029467366897019727ULL,
+            p3 = 1609587929392839161ULL, p4 = 9650029242287828579ULL, p5 = 2870177450012600261ULL;
+    const unsigned char *p = data, *end = p + len;
+    uint64_t h, k;
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+#define XXH_ROUND(acc, in) ((acc) += (in) * p2, (acc) = ROTL64(acc, 31), (acc) *= p1)
+    if (len >= 32) {
+        uint64_t v1 = seed + p1 + p2, v2 = seed + p2, v3 = seed, v4 = seed - p1;
+        do {
+            memcpy(&k, p, 8); XXH_ROUND(v1, k);
+            memcpy(&k, p + 8, 8); XXH_ROUND(v2, k);
+            memcpy(&k, p + 16, 8); XXH_ROUND(v3, k);
+            memcpy(&k, p + 24, 8); XXH_ROUND(v4, k);
+            p += 32;
+        } while (p + 32 <= end);
+        h = ROTL64(v1, 1) + ROTL64(v2, 7) + ROTL64(v3, 12) + ROTL64(v4, 18);
+        uint64_t v[4] = {v1, v2, v3, v4};
+        for (int i = 0; i < 4; ++i) {
+            k = 0;
+            XXH_ROUND(k, v[i]);
+            h ^= k;
+            h = h * p1 + p4;
+        }
+    } else {
+        h = seed + p5;
+    }
+    h += len;
+    for (; p + 8 <= end; p += 8) {
+        memcpy(&k, p, 8);
+        uint64_t r = 0;
+        XXH_ROUND(r, k);
+        h ^= r;
+        h = ROTL64(h, 27) * p1 + p4;
+    }
+    if (p + 4 <= end) {
+        uint32_t w;
+        memcpy(&w, p, 4);
+        h ^= (uint64_t) w * p1;
+        h = ROTL64(h, 23) * p2 + p3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        h ^= *p * p5;
+        h = ROTL64(h, 11) * p1;
+    }
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= p3;
+    h ^= h >> 32;
+#undef XXH_ROUND
+#undef ROTL64
+    return h;
+}
+
+/**
+ * Map a whole file read-only
+ * @return  0, or -1 with errno set; an empty file maps to data == NULL
+ */
+int map_file(const char *path, const char **data, size_t *size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    *size = st.st_size;
+    *data = NULL;
+    if (*size > 0) {
+        void *p = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        *data = p;
+    }
+    close(fd);
+    return 0;
+}
+
+void unmap_file(const char *data, size_t size) {
+    if (data)
+        munmap((void *) data, size);
+}
+
+struct text_file {
+    const char *path;
+    const char *data;
+    size_t size;
+    size_t count; // lines
+    size_t *starts; // count + 1 offsets, starts[count] == size
+    int *ids; // equal lines share an id
+    char *changed;
+};
+
+/**
+ * Map a file and find its lines
+ */
+int text_file_open(struct text_file *f, const char *path) {
+    memset(f, 0, sizeof(*f));
+    f->path = path;
+    if (map_file(path, &f->data, &f->size) == -1)
+        return -1;
+    if (f->data)
+        madvise((void *) f->data, f->size, MADV_SEQUENTIAL);
+
+    size_t cap = 1024;
+    f->starts = malloc(sizeof(size_t) * cap);
+    const char *p = f->data, *end = f->data + f->size;
+    while (p < end) {
+        if (f->count + 1 >= cap) {
+            cap *= 2;
+            f->starts = realloc(f->starts, sizeof(size_t) * cap);
+        }
+        f->starts[f->count++] = p - f->data;
+        const char *nl = memchr(p, '\n', end - p);
+        p = nl ? nl + 1 : end;
+    }
+    f->starts[f->count] = f->size;
+    f->ids = malloc(sizeof(int) * (f->count + 1));
+    f->changed = calloc(f->count + 1, 1);
+    return 0;
+}
+
+void text_file_close(struct text_file *f) {
+    unmap_file(f->data, f->size);
+    free(f->starts);
+    free(f->ids);
+    free(f->changed);
+}
+
+/**
+ * Give every distinct line of both files a small integer id
+ * @return  number of distinct lines
+ */
+int assign_line_ids(struct text_file *a, struct text_file *b) {
+    size_t total = a->count + b->count, capacity = 1024;
+    while (capacity < total * 2)
+        capacity *= 2;
+    struct slot {
+        uint64_t hash;
+        int id; // -1: empty
+        int file;
+        size_t line; // representative, for collision checks
+    } *slots = malloc(sizeof(struct slot) * capacity);
+    for (size_t i = 0; i < capacity; ++i)
+        slots[i].id = -1;
+
+    struct text_file *files[2] = {a, b};
+    int next_id = 0;
+    for (int fi = 0; fi < 2; ++fi) {
+        struct text_file *f = files[fi];
+        for (size_t l = 0; l < f->count; ++l) {
+            const char *line = f->data + f->starts[l];
+            size_t len = f->starts[l + 1] - f->starts[l];
+            uint64_t h = hash64(line, len, 0);
+            size_t i = h & (capacity - 1);
+            for (;; i = (i + 1) & (capacity - 1)) {
+                struct slot *s = &slots[i];
+                if (s->id == -1) {
+                    s->hash = h;
+                    s->id = next_id++;
+                    s->file = fi;
+                    s->line = l;
+                    break;
+                }
+                if (s->hash != h)
+                    continue;
+                struct text_file *g = files[s->file];
+                if (g->starts[s->line + 1] - g->starts[s->line] == len
+                        && memcmp(g->data + g->starts[s->line], line, len) == 0)
+                    break;
+            }
+            f->ids[l] = slots[i].id;
+        }
+    }
+    free(slots);
+    return next_id;
+}
+
+struct diff_context {
+    const int *a, *b;
+    char *ca, *cb; // changed flags
+    long *kvdf, *kvdb; // furthest reaching x per diagonal, forward and backward
+    int *count_a, *count_b; // per id occurrence counts, kept zeroed between uses
+    long *pos_b;
+    bool minimal;
+};
+
+/**
+ * Find where to split a[a0,a1) / b[b0,b1) on the middle snake of the
+ * shortest edit script (or of a good one, once max_cost is exceeded)
+ */
+void diff_split(struct diff_context *dc, long a0, long a1, long b0, long b1, long max_cost,
+                long *split_a, long *split_b) {
+    const int *a = dc->a, *b = dc->b;
+    long *kvdf = dc->kvdf, *kvdb = dc->kvdb;
+    long dmin = a0 - b1, dmax = a1 - b0;
+    long fmid = a0 - b0, bmid = a1 - b1;
+    long fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+    bool odd = (fmid - bmid) & 1;
+    kvdf[fmid] = a0;
+    kvdb[bmid] = a1;
+
+    for (long ec = 1;; ec++) {
+        long d, i1, i2;
+        if (fmin > dmin) kvdf[--fmin - 1] = -1; else ++fmin;
+        if (fmax < dmax) kvdf[++fmax + 1] = -1; else --fmax;
+        for (d = fmax; d >= fmin; d -= 2) {
+            i1 = kvdf[d - 1] >= kvdf[d + 1] ? kvdf[d - 1] + 1 : kvdf[d + 1];
+            i2 = i1 - d;
+            while (i1 < a1 && i2 < b1 && a[i1] == b[i2]) {
+                i1++;
+                i2++;
+            }
+            kvdf[d] = i1;
+            if (odd && bmin <= d && d <= bmax && kvdb[d] <= i1) {
+                *split_a = i1;
+                *split_b = i2;
+                return;
+            }
+        }
+
+        if (bmin > dmin) kvdb[--bmin - 1] = LONG_MAX; else ++bmin;
+        if (bmax < dmax) kvdb[++bmax + 1] = LONG_MAX; else --bmax;
+        for (d = bmax; d >= bmin; d -= 2) {
+            i1 = kvdb[d - 1] < kvdb[d + 1] ? kvdb[d - 1] : kvdb[d + 1] - 1;
+            i2 = i1 - d;
+            while (i1 > a0 && i2 > b0 && a[i1 - 1] == b[i2 - 1]) {
+                i1--;
+                i2--;
+            }
+            kvdb[d] = i1;
+            if (!odd && fmin <= d && d <= fmax && i1 <= kvdf[d]) {
+                *split_a = i1;
+                *split_b = i2;
+                return;
+            }
+        }
+
+        if (ec < max_cost)
+            continue;
+        // too expensive: split at the furthest point either direction reached
+        long fbest = -1, fx = a0, fy = b0, bbest = LONG_MAX, bx = a1, by = b1;
+        for (d = fmax; d >= fmin; d -= 2) {
+            i1 = kvdf[d] < a1 ? kvdf[d] : a1;
+            i2 = i1 - d;
+            if (i2 > b1) {
+                i1 = b1 + d;
+                i2 = b1;
+            }
+            if (i1 + i2 > fbest) {
+                fbest = i1 + i2;
+                fx = i1;
+                fy = i2;
+            }
+        }
+        for (d = bmax; d >= bmin; d -= 2) {
+            i1 = kvdb[d] > a0 ? kvdb[d] : a0;
+            i2 = i1 - d;
+            if (i2 < b0) {
+                i1 = b0 + d;
+                i2 = b0;
+            }
+            if (i1 + i2 < bbest) {
+                bbest = i1 + i2;
+                bx = i1;
+                by = i2;
+            }
+        }
+        if ((a1 + b1) - bbest < fbest - (a0 + b0)) {
+            *split_a = fx;
+            *split_b = fy;
+        } else {
+            *split_a = bx;
+            *split_b = by;
+        }
+        return;
+    }
+}
+
+void diff_range(struct diff_context *dc, long a0, long a1, long b0, long b1);
+
+/**
+ * Cut a large range at lines unique to both sides (longest increasing run
+ * of their positions, as in patience diff) and diff the pieces between them
+ * @return  false if there was nothing to anchor on
+ */
+bool diff_patience(struct diff_context *dc, long a0, long a1, long b0, long b1) {
+    const int *a = dc->a, *b = dc->b;
+    for (long i = a0; i < a1; ++i)
+        dc->count_a[a[i]]++;
+    for (long j = b0; j < b1; ++j) {
+        dc->count_b[b[j]]++;
+        dc->pos_b[b[j]] = j;
+    }
+
+    // candidates in a order; keep the longest run with increasing b positions
+    long n = 0, *cand_a = malloc(sizeof(long) * (a1 - a0)), *cand_b = malloc(sizeof(long) * (a1 - a0));
+    for (long i = a0; i < a1; ++i)
+        if (dc->count_a[a[i]] == 1 && dc->count_b[a[i]] == 1) {
+            cand_a[n] = i;
+            cand_b[n++] = dc->pos_b[a[i]];
+        }
+    for (long i = a0; i < a1; ++i)
+        dc->count_a[a[i]] = 0;
+    for (long j = b0; j < b1; ++j)
+        dc->count_b[b[j]] = 0;
+
+    long *tails = malloc(sizeof(long) * (n + 1)), *prev = malloc(sizeof(long) * (n + 1)), len = 0;
+    for (long k = 0; k < n; ++k) {
+        long lo = 0, hi = len;
+        while (lo < hi) {
+            long mid = (lo + hi) / 2;
+            if (cand_b[tails[mid]] < cand_b[k])
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        prev[k] = lo > 0 ? tails[lo - 1] : -1;
+        tails[lo] = k;
+        if (lo == len)
+            len++;
+    }
+    long *anchors = malloc(sizeof(long) * (len + 1));
+    for (long k = len ? tails[len - 1] : -1, i = len; k >= 0; k = prev[k])
+        anchors[--i] = k;
+
+    if (len > 0) {
+        long pa = a0, pb = b0;
+        for (long i = 0; i < len; ++i) {
+            long x = cand_a[anchors[i]], y = cand_b[anchors[i]];
+            diff_range(dc, pa, x, pb, y);
+            pa = x + 1;
+            pb = y + 1;
+        }
+        diff_range(dc, pa, a1, pb, b1);
+    }
+    free(anchors);
+    free(prev);
+    free(tails);
+    free(cand_b);
+    free(cand_a);
+    return len > 0;
+}
+
+/**
+ * Mark the lines of a[a0,a1) and b[b0,b1) that are not part of their
+ * longest common subsequence
+ */
+void diff_range(struct diff_context *dc, long a0, long a1, long b0, long b1) {
+    while (a0 < a1 && b0 < b1 && dc->a[a0] == dc->b[b0]) {
+        a0++;
+        b0++;
+    }
+    while (a0 < a1 && b0 < b1 && dc->a[a1 - 1] == dc->b[b1 - 1]) {
+        a1--;
+        b1--;
+    }
+    if (a0 == a1) {
+        memset(dc->cb + b0, 1, b1 - b0);
+        return;
+    }
+    if (b0 == b1) {
+        memset(dc->ca + a0, 1, a1 - a0);
+        return;
+    }
+
+    long size = (a1 - a0) + (b1 - b0);
+    if (size >= DIFF_PATIENCE_MIN && diff_patience(dc, a0, a1, b0, b1))
+        return;
+
+    long max_cost = LONG_MAX;
+    if (!dc->minimal && size > DIFF_EXACT_MAX) {
+        max_cost = 1;
+        while (max_cost * max_cost < size)
+            max_cost <<= 1;
+        if (max_cost < 256)
+            max_cost = 256;
+    }
+    long sa, sb;
+    diff_split(dc, a0, a1, b0, b1, max_cost, &sa, &sb);
+    if ((sa == a0 && sb == b0) || (sa == a1 && sb == b1)) { // no progress possible
+        memset(dc->ca + a0, 1, a1 - a0);
+        memset(dc->cb + b0, 1, b1 - b0);
+        return;
+    }
+    diff_range(dc, a0, sa, b0, sb);
+    diff_range(dc, sa, a1, sb, b1);
+}
+
+void print_diff_line(char prefix, struct text_file *f, size_t line) {
+    const char *s = f->data + f->starts[line];
+    size_t len = f->starts[line + 1] - f->starts[line];
+    putchar(prefix);
+    fwrite(s, 1, len, stdout);
+    if (len == 0 || s[len - 1] != '\n')
+        fputs("\n\\ No newline at end of file\n", stdout);
+}
+
+void print_hunk_range(size_t start, size_t len) {
+    if (len == 1)
+        printf("%zu", start + 1);
+    else
+        printf("%zu,%zu", len ? start + 1 : start, len);
+}
+
+/**
+ * Print the marked changes as unified diff hunks
+ * @return  number of changed lines (deleted plus inserted)
+ */
+size_t print_unified(struct text_file *a, struct text_file *b, int context) {
+    // change blocks: runs of changed lines between unchanged pairs
+    struct block { size_t a, alen, b, blen; } *blocks = NULL;
+    size_t nblocks = 0, cap = 0, changed = 0, i = 0, j = 0;
+    while (i < a->count || j < b->count) {
+        if (i < a->count && j < b->count && !a->changed[i] && !b->changed[j]) {
+            i++;
+            j++;
+            continue;
+        }
+        struct block blk = {i, 0, j, 0};
+        while (i < a->count && a->changed[i])
+            i++;
+        while (j < b->count && b->changed[j])
+            j++;
+        blk.alen = i - blk.a;
+        blk.blen = j - blk.b;
+        if (blk.alen == 0 && blk.blen == 0) { // cannot happen with a consistent marking
+            i++;
+            j++;
+            continue;
+        }
+        if (nblocks == cap) {
+            cap = cap ? cap * 2 : 64;
+            blocks = realloc(blocks, sizeof(struct block) * cap);
+        }
+        blocks[nblocks++] = blk;
+        changed += blk.alen + blk.blen;
+    }
+    if (nblocks == 0)
+        return 0;
+
+    printf("--- %s\n+++ %s\n", a->path, b->path);
+    for (size_t first = 0; first < nblocks;) {
+        // blocks closer than 2 * context lines share a hunk
+        size_t last = first;
+        while (last + 1 < nblocks && blocks[last + 1].a - (blocks[last].a + blocks[last].alen) <= 2 * (size_t) context)
+            last++;
+        size_t pre = blocks[first].a < (size_t) context ? blocks[first].a : context;
+        size_t a0 = blocks[first].a - pre, b0 = blocks[first].b - pre;
+        size_t a_end = blocks[last].a + blocks[last].alen, b_end = blocks[last].b + blocks[last].blen;
+        size_t post = a->count - a_end < (size_t) context ? a->count - a_end : context;
+        a_end += post;
+        b_end += post;
+
+        printf("@@ -");
+        print_hunk_range(a0, a_end - a0);
+        printf(" +");
+        print_hunk_range(b0, b_end - b0);
+        printf(" @@\n");
+        size_t x = a0, y = b0;
+        for (size_t k = first; k <= last; ++k) {
+            for (; x < blocks[k].a; x++, y++)
+                print_diff_line(' ', a, x);
+            for (; x < blocks[k].a + blocks[k].alen; x++)
+                print_diff_line('-', a, x);
+            for (; y < blocks[k].b + blocks[k].blen; y++)
+                print_diff_line('+', b, y);
+        }
+        for (; x < a_end; x++, y++)
+            print_diff_line(' ', a, x);
+        first = last + 1;
+    }
+    free(blocks);
+    return changed;
+}
+
+/**
+ * kdiff -a: unified diff of two text files
+ * @return  SUCCESS; last_status is 0 if identical, 1 if different, 2 on error
+ */
+int kdiff_text(const char *path1, const char *path2) {
+    struct text_file a, b;
+    if (text_file_open(&a, path1) == -1) {
+        printf("-%s: kdiff: %s: %s\n", sysname, path1, strerror(errno));
+        last_status = 2;
+        return SUCCESS;
+    }
+    if (text_file_open(&b, path2) == -1) {
+        printf("-%s: kdiff: %s: %s\n", sysname, path2, strerror(errno));
+        text_file_close(&a);
+        last_status = 2;
+        return SUCCESS;
+    }
+
+    int ids = assign_line_ids(&a, &b);
+    struct diff_context dc = {.a = a.ids, .b = b.ids, .ca = a.changed, .cb = b.changed};
+    long diagonals = a.count + b.count + 3;
+    dc.kvdf = malloc(sizeof(long) * diagonals * 2);
+    dc.kvdb = dc.kvdf + diagonals;
+    dc.kvdf += b.count + 1; // diagonal k = x - y ranges over [-len(b), len(a)]
+    dc.kvdb += b.count + 1;
+    dc.count_a = calloc(ids + 1, sizeof(int));
+    dc.count_b = calloc(ids + 1, sizeof(int));
+    dc.pos_b = malloc(sizeof(long) * (ids + 1));
+
+    diff_range(&dc, 0, a.count, 0, b.count);
+    size_t changed = print_unified(&a, &b, DIFF_CONTEXT);
+    if (changed == 0)
+        printf("The two files are identical\n");
+    else
+        printf("%zu different lines are found\n", changed);
+    last_status = changed ? 1 : 0;
+
+    free(dc.pos_b);
+    free(dc.count_b);
+    free(dc.count_a);
+    free(dc.kvdf - (b.count + 1));
+    text_file_close(&b);
+    text_file_close(&a);
+    return SUCCESS;
+}
+
+/*
+ * kdiff binary mode. Both files are mapped and the common prefix is cut
+ * into chunks that a pool of threads (one per core) takes from a shared
+ * counter; each chunk is compared 64 bytes at a time with SSE2. Differing
+ * bytes are counted, and optionally collected as coalesced ranges, or the
+ * scan stops at the first difference like cmp(1).
+ */
+#define KDIFF_CHUNK (16 << 20)
+
+struct byte_range {
+    size_t start, end; // [start, end)
+};
+
+struct range_list {
+    struct byte_range *ranges;
+    size_t count, capacity;
+};
+
+void range_list_add(struct range_list *list, size_t offset) {
+    if (list->count > 0 && list->ranges[list->count - 1].end == offset) {
+        list->ranges[list->count - 1].end++;
+        return;
+    }
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->ranges = realloc(list->ranges, sizeof(struct byte_range) * list->capacity);
+    }
+    list->ranges[list->count].start = offset;
+    list->ranges[list->count++].end = offset + 1;
+}
+
+struct binary_compare {
+    const unsigned char *a, *b;
+    size_t length; // bytes both files have
+    size_t chunks;
+    bool list; // collect ranges
+    bool first_only; // stop at the first difference
+    size_t next_chunk; // shared work counter
+    size_t first_diff; // lowest differing offset seen (first_only)
+    size_t *counts; // differing bytes per chunk
+    struct range_list *ranges; // per chunk
+};
+
+/**
+ * Compare one chunk
+ */
+void compare_chunk(struct binary_compare *bc, size_t chunk) {
+    size_t start = chunk * KDIFF_CHUNK;
+    size_t len = bc->length - start < KDIFF_CHUNK ? bc->length - start : KDIFF_CHUNK;
+    const unsigned char *a = bc->a + start, *b = bc->b + start;
+    bool positions = bc->list || bc->first_only;
+    size_t count = 0, i = 0;
+
+#ifdef __SSE2__
+    for (; i + 64 <= len; i += 64) {
+        uint64_t eq = 0;
+        for (int k = 0; k < 4; ++k) {
+            __m128i x = _mm_loadu_si128((const __m128i *) (a + i + 16 * k));
+            __m128i y = _mm_loadu_si128((const __m128i *) (b + i + 16 * k));
+            eq |= (uint64_t) (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) << (16 * k);
+        }
+        uint64_t ne = ~eq;
+        if (!ne)
+            continue;
+        count += __builtin_popcountll(ne);
+        if (!positions)
+            continue;
+        if (bc->first_only) {
+            size_t offset = start + i + __builtin_ctzll(ne);
+            size_t seen = __atomic_load_n(&bc->first_diff, __ATOMIC_RELAXED);
+            while (offset < seen && !__atomic_compare_exchange_n(&bc->first_diff, &seen, offset, false,
+                                                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                ;
+            break;
+        }
+        for (; ne; ne &= ne - 1)
+            range_list_add(&bc->ranges[chunk], start + i + __builtin_ctzll(ne));
+    }
+#endif
+    for (; i < len && !(bc->first_only && count); ++i) {
+        if (a[i] == b[i])
+            continue;
+        count++;
+        if (bc->first_only) {
+            size_t offset = start + i;
+            size_t seen = __atomic_load_n(&bc->first_diff, __ATOMIC_RELAXED);
+            while (offset < seen && !__atomic_compare_exchange_n(&bc->first_diff, &seen, offset, false,
+                                                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                ;
+        } else if (bc->list) {
+            range_list_add(&bc->ranges[chunk], start + i);
+        }
+    }
+    bc->counts[chunk] = count;
+}
+
+void *compare_worker(void *arg) {
+    struct binary_compare *bc = arg;
+    for (;;) {
+        size_t chunk = __atomic_fetch_add(&bc->next_chunk, 1, __ATOMIC_RELAXED);
+        if (chunk >= bc->chunks)
+            break;
+        // a difference was already found before this chunk, nothing here can be first
+        if (bc->first_only && __atomic_load_n(&bc->first_diff, __ATOMIC_RELAXED) < chunk * KDIFF_CHUNK)
+            break;
+        madvise((void *) (bc->a + chunk * KDIFF_CHUNK), 1, MADV_WILLNEED);
+        compare_chunk(bc, chunk);
+    }
+    return NULL;
+}
+
+int online_cpus() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int) n : 1;
+}
+
+/**
+ * kdiff -b [-l] [-s]: compare two files byte by byte
+ * @param  list        print the differing ranges
+ * @param  first_only  report only the first difference (cmp style)
+ * @return             SUCCESS; last_status is 0 if identical, 1 if different, 2 on error
+ */
+int kdiff_binary(const char *path1, const char *path2, bool list, bool first_only) {
+    const char *data1, *data2;
+    size_t size1, size2;
+    if (map_file(path1, &data1, &size1) == -1) {
+        printf("-%s: kdiff: %s: %s\n", sysname, path1, strerror(errno));
+        last_status = 2;
+        return SUCCESS;
+    }
+    if (map_file(path2, &data2, &size2) == -1) {
+        printf("-%s: kdiff: %s: %s\n", sysname, path2, strerror(errno));
+        unmap_file(data1, size1);
+        last_status = 2;
+        return SUCCESS;
+    }
+
+    struct binary_compare bc = {
+        .a = (const unsigned char *) data1, .b = (const unsigned char *) data2,
+        .length = size1 < size2 ? size1 : size2,
+        .list = list, .first_only = first_only, .first_diff = SIZE_MAX,
+    };
+    bc.chunks = (bc.length + KDIFF_CHUNK - 1) / KDIFF_CHUNK;
+    bc.counts = calloc(bc.chunks + 1, sizeof(size_t));
+    bc.ranges = calloc(bc.chunks + 1, sizeof(struct range_list));
+    if (bc.length > 0) {
+        madvise((void *) data1, size1, MADV_SEQUENTIAL);
+        madvise((void *) data2, size2, MADV_SEQUENTIAL);
+    }
+
+    int threads = online_cpus();
+    if ((size_t) threads > bc.chunks)
+        threads = bc.chunks;
+    pthread_t *workers = malloc(sizeof(pthread_t) * (threads + 1));
+    for (int i = 1; i < threads; ++i)
+        pthread_create(&workers[i], NULL, compare_worker, &bc);
+    if (threads > 0)
+        compare_worker(&bc); // the shell thread works too
+    for (int i = 1; i < threads; ++i)
+        pthread_join(workers[i], NULL);
+    free(workers);
+
+    size_t count = size1 > size2 ? size1 - size2 : size2 - size1; // bytes only one file has
+    for (size_t c = 0; c < bc.chunks; ++c)
+        count += bc.counts[c];
+
+    if (first_only) {
+        if (bc.first_diff != SIZE_MAX)
+            printf("%s %s differ: byte %zu\n", path1, path2, bc.first_diff + 1);
+        else if (size1 != size2)
+            printf("kdiff: EOF on %s after byte %zu\n", size1 < size2 ? path1 : path2, bc.length);
+        else
+            printf("The two files are identical.\n");
+    } else {
+        if (list) {
+            struct byte_range open = {0, 0};
+            for (size_t c = 0; c < bc.chunks; ++c)
+                for (size_t r = 0; r < bc.ranges[c].count; ++r) {
+                    struct byte_range range = bc.ranges[c].ranges[r];
+                    if (open.end == range.start && open.end > open.start) { // continues across chunks
+                        open.end = range.end;
+                        continue;
+                    }
+                    if (open.end > open.start)
+                        printf("0x%010zx-0x%010zx %zu bytes\n", open.start, open.end - 1, open.end - open.start);
+                    open = range;
+                }
+            if (open.end > open.start)
+                printf("0x%010zx-0x%010zx %zu bytes\n", open.start, open.end - 1, open.end - open.start);
+            if (size1 != size2) {
+                size_t longer = size1 > size2 ? size1 : size2;
+                printf("0x%010zx-0x%010zx %zu bytes only in %s\n", bc.length, longer - 1,
+                       longer - bc.length, size1 > size2 ? path1 : path2);
+            }
+        }
+        if (count == 0)
+            printf("The two files are identical.\n");
+        else
+            printf("The two files are different in %zu bytes\n", count);
+    }
+    last_status = count ? 1 : 0;
+
+    for (size_t c = 0; c < bc.chunks; ++c)
+        free(bc.ranges[c].ranges);
+    free(bc.ranges);
+    free(bc.counts);
+    unmap_file(data2, size2);
+    unmap_file(data1, size1);
+    return SUCCESS;
+}
+
+/*
+ * kdiff -r: recursive directory comparison. Both trees are walked together
+ * with getdents64() and fstatat()/openat() relative to the directory fds,
+ * entries are matched by name level by level. Files of different size
+ * differ without being read; same size and mtime count as equal with -m.
+ * The remaining pairs are hashed (XXH64) by a pool of threads, and the
+ * mismatches are then shown with the text or binary diff.
+ */
+#define TREE_SMALL_FILE (64 * 1024) // read() these, mmap() larger ones
+
+enum tree_result_kind {
+    TREE_ONLY_A,
+    TREE_ONLY_B,
+    TREE_TYPE_DIFFERS,
+    TREE_FILES, // regular files in both trees
+    TREE_LINKS, // symlinks in both trees
+};
+
+struct tree_result {
+    char *rel; // path relative to the roots
+    int kind;
+    size_t size_a, size_b;
+    bool same_mtime;
+    int differs; // -1: not known yet, 0, 1
+};
+
+struct tree_compare {
+    const char *dir_a, *dir_b;
+    int root_a, root_b;
+    bool trust_mtime;
+    bool failed; // an entry could not be read
+    struct tree_result *results;
+    size_t count, capacity;
+    size_t next; // shared work counter for the hash workers
+};
+
+struct tree_entry {
+    char *name;
+    unsigned char type;
+};
+
+int compare_tree_entries(const void *x, const void *y) {
+    return strcmp(((const struct tree_entry *) x)->name, ((const struct tree_entry *) y)->name);
+}
+
+/**
+ * List a directory with getdents64, sorted by name
+ */
+struct tree_entry *read_tree_dir(int fd, size_t *count) {
+    char buf[32768];
+    struct tree_entry *entries = NULL;
+    size_t capacity = 0;
+    *count = 0;
+    for (;;) {
+        ssize_t n = getdents64(fd, buf, sizeof(buf));
+        if (n <= 0)
+            break;
+        for (ssize_t off = 0; off < n;) {
+            struct dirent64 *d = (struct dirent64 *) (buf + off);
+            off += d->d_reclen;
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+                continue;
+            if (*count == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                entries = realloc(entries, sizeof(struct tree_entry) * capacity);
+            }
+            entries[*count].name = strdup(d->d_name);
+            entries[(*count)++].type = d->d_type;
+        }
+    }
+    qsort(entries, *count, sizeof(struct tree_entry), compare_tree_entries);
+    return entries;
+}
+
+struct tree_result *tree_add(struct tree_compare *tc, const char *rel, const char *name, int kind) {
+    if (tc->count == tc->capacity) {
+        tc->capacity = tc->capacity ? tc->capacity * 2 : 1024;
+        tc->results = realloc(tc->results, sizeof(struct tree_result) * tc->capacity);
+    }
+    struct tree_result *r = &tc->results[tc->count++];
+    memset(r, 0, sizeof(*r));
+    r->rel = malloc(strlen(rel) + strlen(name) + 2);
+    sprintf(r->rel, "%s%s%s", rel, rel[0] ? "/" : "", name);
+    r->kind = kind;
+    r->differs = kind == TREE_ONLY_A || kind == TREE_ONLY_B || kind == TREE_TYPE_DIFFERS ? 1 : -1;
+    return r;
+}
+
+/**
+ * Report an entry of one of the trees that could not be read
+ */
+void tree_error(struct tree_compare *tc, bool in_a, const char *rel, const char *name, int error) {
+    printf("-%s: kdiff: %s/%s%s%s: %s\n", sysname, in_a ? tc->dir_a : tc->dir_b, rel, rel[0] ? "/" : "", name,
+           strerror(error));
+    tc->failed = true;
+}
+
+void tree_walk(struct tree_compare *tc, int fd_a, int fd_b, const char *rel) {
+    size_t na, nb, i = 0, j = 0;
+    struct tree_entry *a = read_tree_dir(fd_a, &na), *b = read_tree_dir(fd_b, &nb);
+    while (i < na || j < nb) {
+        int cmp = i == na ? 1 : j == nb ? -1 : strcmp(a[i].name, b[j].name);
+        if (cmp < 0) {
+            tree_add(tc, rel, a[i++].name, TREE_ONLY_A);
+            continue;
+        }
+        if (cmp > 0) {
+            tree_add(tc, rel, b[j++].name, TREE_ONLY_B);
+            continue;
+        }
+
+        const char *name = a[i].name;
+        struct stat sa, sb;
+        if (fstatat(fd_a, name, &sa, AT_SYMLINK_NOFOLLOW) == -1) {
+            tree_error(tc, true, rel, name, errno);
+        } else if (fstatat(fd_b, name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+            tree_error(tc, false, rel, name, errno);
+        } else if ((sa.st_mode & S_IFMT) != (sb.st_mode & S_IFMT)) {
+            tree_add(tc, rel, name, TREE_TYPE_DIFFERS);
+        } else if (S_ISDIR(sa.st_mode)) {
+            int sub_a = openat(fd_a, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC), error_a = errno;
+            int sub_b = openat(fd_b, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC), error_b = errno;
+            if (sub_a >= 0 && sub_b >= 0) {
+                char *sub_rel = malloc(strlen(rel) + strlen(name) + 2);
+                sprintf(sub_rel, "%s%s%s", rel, rel[0] ? "/" : "", name);
+                tree_walk(tc, sub_a, sub_b, sub_rel);
+                free(sub_rel);
+            } else {
+                tree_error(tc, sub_a < 0, rel, name, sub_a < 0 ? error_a : error_b);
+            }
+            if (sub_a >= 0)
+                close(sub_a);
+            if (sub_b >= 0)
+                close(sub_b);
+        } else if (S_ISREG(sa.st_mode) || S_ISLNK(sa.st_mode)) {
+            struct tree_result *r = tree_add(tc, rel, name, S_ISREG(sa.st_mode) ? TREE_FILES : TREE_LINKS);
+            r->size_a = sa.st_size;
+            r->size_b = sb.st_size;
+            r->same_mtime = sa.st_mtim.tv_sec == sb.st_mtim.tv_sec && sa.st_mtim.tv_nsec == sb.st_mtim.tv_nsec;
+            if (r->size_a != r->size_b)
+                r->differs = 1;
+            else if (tc->trust_mtime && r->same_mtime)
+                r->differs = 0;
+        }
+        // devices, fifos and sockets of the same type are taken as equal
+        i++;
+        j++;
+    }
+    for (i = 0; i < na; ++i)
+        free(a[i].name);
+    for (j = 0; j < nb; ++j)
+        free(b[j].name);
+    free(a);
+    free(b);
+}
+
+/**
+ * XXH64 of a file's contents
+ * @return  0, or -1 if it could not be read
+ */
+int hash_file(int root, const char *rel, size_t size, char *buf, uint64_t *hash) {
+    int fd = openat(root, rel, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    int r = 0;
+    if (size <= TREE_SMALL_FILE) {
+        ssize_t n = pread(fd, buf, TREE_SMALL_FILE, 0);
+        if (n < 0)
+            r = -1;
+        else
+            *hash = hash64(buf, n, 0);
+    } else {
+        void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            r = -1;
+        } else {
+            madvise(p, size, MADV_SEQUENTIAL);
+            *hash = hash64(p, size, 0);
+            munmap(p, size);
+        }
+    }
+    close(fd);
+    return r;
+}
+
+void *tree_hash_worker(void *arg) {
+    struct tree_compare *tc = arg;
+    char *buf = malloc(TREE_SMALL_FILE);
+    for (;;) {
+        size_t i = __atomic_fetch_add(&tc->next, 1, __ATOMIC_RELAXED);
+        if (i >= tc->count)
+            break;
+        struct tree_result *r = &tc->results[i];
+        if (r->differs != -1)
+            continue;
+        if (r->kind == TREE_LINKS) {
+            char la[PATH_MAX], lb[PATH_MAX];
+            ssize_t n = readlinkat(tc->root_a, r->rel, la, sizeof(la));
+            ssize_t m = readlinkat(tc->root_b, r->rel, lb, sizeof(lb));
+            r->differs = n != m || n < 0 || memcmp(la, lb, n) != 0;
+            continue;
+        }
+        uint64_t ha, hb;
+        if (hash_file(tc->root_a, r->rel, r->size_a, buf, &ha) == -1
+                || hash_file(tc->root_b, r->rel, r->size_b, buf, &hb) == -1)
+            r->differs = 1;
+        else
+            r->differs = ha != hb;
+    }
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Guess whether a file is text: no NUL byte in its first 8000 bytes, like diff(1)
+ */
+bool looks_like_text(const char *path) {
+    char buf[8000];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    ssize_t n = read(fd, buf, sizeof(buf));
+    close(fd);
+    return n >= 0 && memchr(buf, 0, n) == NULL;
+}
+
+/**
+ * kdiff -r [-q] [-m] dirA dirB
+ * @param  brief        only name the files that differ (-q)
+ * @param  trust_mtime  same size and mtime means equal, without reading (-m)
+ * @return              SUCCESS; last_status is 0 if identical, 1 if different, 2 on error
+ */
+int kdiff_tree(const char *dir_a, const char *dir_b, bool brief, bool trust_mtime) {
+    struct tree_compare tc = {.dir_a = dir_a, .dir_b = dir_b, .trust_mtime = trust_mtime};
+    tc.root_a = open(dir_a, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int error = errno;
+    tc.root_b = open(dir_b, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (tc.root_a == -1 || tc.root_b == -1) {
+        printf("-%s: kdiff: %s: %s\n", sysname, tc.root_a == -1 ? dir_a : dir_b,
+               strerror(tc.root_a == -1 ? error : errno));
+        if (tc.root_a >= 0)
+            close(tc.root_a);
+        if (tc.root_b >= 0)
+            close(tc.root_b);
+        last_status = 2;
+        return SUCCESS;
+    }
+    tree_walk(&tc, tc.root_a, tc.root_b, "");
+
+    int threads = online_cpus();
+    pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+    for (int i = 1; i < threads; ++i)
+        pthread_create(&workers[i], NULL, tree_hash_worker, &tc);
+    tree_hash_worker(&tc);
+    for (int i = 1; i < threads; ++i)
+        pthread_join(workers[i], NULL);
+    free(workers);
+
+    size_t compared = 0, differ = 0, only_a = 0, only_b = 0;
+    for (size_t i = 0; i < tc.count; ++i) {
+        struct tree_result *r = &tc.results[i];
+        char *slash = strrchr(r->rel, '/');
+        switch (r->kind) {
+        case TREE_ONLY_A:
+        case TREE_ONLY_B:
+            *(r->kind == TREE_ONLY_A ? &only_a : &only_b) += 1;
+            if (slash)
+                printf("Only in %s/%.*s: %s\n", r->kind == TREE_ONLY_A ? dir_a : dir_b,
+                       (int) (slash - r->rel), r->rel, slash + 1);
+            else
+                printf("Only in %s: %s\n", r->kind == TREE_ONLY_A ? dir_a : dir_b, r->rel);
+            break;
+        case TREE_TYPE_DIFFERS:
+            differ++;
+            printf("File types of %s/%s and %s/%s differ\n", dir_a, r->rel, dir_b, r->rel);
+            break;
+        default:
+            compared++;
+            if (!r->differs)
+                break;
+            differ++;
+            char *path_a = malloc(strlen(dir_a) + strlen(r->rel) + 2);
+            char *path_b = malloc(strlen(dir_b) + strlen(r->rel) + 2);
+            sprintf(path_a, "%s/%s", dir_a, r->rel);
+            sprintf(path_b, "%s/%s", dir_b, r->rel);
+            printf("Files %s and %s differ\n", path_a, path_b);
+            if (!brief && r->kind == TREE_FILES) {
+                if (looks_like_text(path_a) && looks_like_text(path_b))
+                    kdiff_text(path_a, path_b);
+                else
+                    kdiff_binary(path_a, path_b, false, false);
+            }
+            free(path_a);
+            free(path_b);
+        }
+        free(r->rel);
+    }
+
+    if (differ + only_a + only_b == 0)
+        printf("The two directories are identical (%zu files)\n", compared);
+    else
+        printf("%zu files compared: %zu differ, %zu only in %s, %zu only in %s\n",
+               compared, differ, only_a, dir_a, only_b, dir_b);
+    last_status = tc.failed ? 2 : differ + only_a + only_b ? 1 : 0;
+
+    free(tc.results);
+    close(tc.root_a);
+    close(tc.root_b);
+    return SUCCESS;
+}
+
+/*
+ * kdiff -c: delta comparison with content defined chunking. Each file is
+ * streamed once and cut where a Gear rolling hash of the last bytes hits a
+ * mask (FastCDC style normalized chunking, 2-64 KB chunks, 8 KB average),
+ * so boundaries move with the data when bytes are inserted or removed.
+ * Chunks are matched by XXH64; only the chunk list stays in memory.
+ */
+#define CDC_MIN (2 * 1024)
+#define CDC_AVG (8 * 1024)
+#define CDC_MAX (64 * 1024)
+#define CDC_BLOCK (4 << 20)
+#define CDC_MASK_S (((1ULL << 15) - 1) << 49) // harder to hit before the average size
+#define CDC_MASK_L (((1ULL << 11) - 1) << 53) // easier after it
+
+uint64_t gear_table[256];
+
+void init_gear_table() {
+    uint64_t x = 0x9E3779B97F4A7C15ULL; // splitmix64, so every build cuts the same way
+    for (int i = 0; i < 256; ++i) {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear_table[i] = z ^ (z >> 31);
+    }
+}
+
+/**
+ * Length of the chunk starting at p; n must be at least CDC_MAX unless
+ * the data ends within it
+ */
+size_t cdc_cut(const unsigned char *p, size_t n) {
+    if (n <= CDC_MIN)
+        return n;
+    size_t end = n < CDC_MAX ? n : CDC_MAX, normal = n < CDC_AVG ? n : CDC_AVG, i = CDC_MIN;
+    uint64_t h = 0;
+    for (; i < normal; ++i) {
+        h = (h << 1) + gear_table[p[i]];
+        if (!(h & CDC_MASK_S))
+            return i + 1;
+    }
+    for (; i < end; ++i) {
+        h = (h << 1) + gear_table[p[i]];
+        if (!(h & CDC_MASK_L))
+            return i + 1;
+    }
+    return end;
+}
+
+struct cdc_chunk {
+    uint64_t hash;
+    size_t offset, length;
+    long match; // index of the matching chunk in the other file, -1 if none
+    bool in_order;
+};
+
+struct cdc_file {
+    const char *path;
+    struct cdc_chunk *chunks;
+    size_t count, capacity, size;
+    int error; // errno
+};
+
+void *cdc_scan(void *arg) {
+    struct cdc_file *f = arg;
+    int fd = open(f->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        f->error = errno;
+        return NULL;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    unsigned char *buf = malloc(CDC_BLOCK + CDC_MAX);
+    size_t have = 0, offset = 0;
+    bool eof = false;
+    while (!eof || have > 0) {
+        while (!eof && have < CDC_MAX) { // keep at least one maximal chunk in view
+            ssize_t n = read(fd, buf + have, CDC_BLOCK + CDC_MAX - have);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                if (n < 0)
+                    f->error = errno;
+                eof = true;
+                break;
+            }
+            have += n;
+        }
+        size_t pos = 0;
+        while (have - pos >= CDC_MAX || (eof && pos < have)) {
+            size_t len = cdc_cut(buf + pos, have - pos);
+            if (f->count == f->capacity) {
+                f->capacity = f->capacity ? f->capacity * 2 : 1024;
+                f->chunks = realloc(f->chunks, sizeof(struct cdc_chunk) * f->capacity);
+            }
+            struct cdc_chunk *c = &f->chunks[f->count++];
+            c->hash = hash64(buf + pos, len, 0);
+            c->offset = offset;
+            c->length = len;
+            c->match = -1;
+            c->in_order = false;
+            offset += len;
+            pos += len;
+        }
+        memmove(buf, buf + pos, have - pos);
+        have -= pos;
+    }
+    f->size = offset;
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+/**
+ * Match the chunks of b against those of a, preferring the next unused
+ * copy after the previous match so repeated content stays in order
+ */
+void cdc_match(struct cdc_file *a, struct cdc_file *b) {
+    size_t capacity = 1024;
+    while (capacity < a->count * 2)
+        capacity *= 2;
+    long *heads = malloc(sizeof(long) * capacity), *next_same = malloc(sizeof(long) * (a->count + 1));
+    for (size_t i = 0; i < capacity; ++i)
+        heads[i] = -1;
+    // chain equal hashes in increasing index order: insert from the back
+    for (long i = (long) a->count - 1; i >= 0; --i) {
+        size_t slot = a->chunks[i].hash & (capacity - 1);
+        while (heads[slot] != -1 && a->chunks[heads[slot]].hash != a->chunks[i].hash)
+            slot = (slot + 1) & (capacity - 1);
+        next_same[i] = heads[slot];
+        heads[slot] = i;
+    }
+
+    long previous = -1;
+    for (size_t j = 0; j < b->count; ++j) {
+        size_t slot = b->chunks[j].hash & (capacity - 1);
+        while (heads[slot] != -1 && a->chunks[heads[slot]].hash != b->chunks[j].hash)
+            slot = (slot + 1) & (capacity - 1);
+        long pick = -1;
+        for (long i = heads[slot]; i != -1; i = next_same[i]) {
+            if (a->chunks[i].match != -1 || a->chunks[i].length != b->chunks[j].length)
+                continue;
+            if (pick == -1)
+                pick = i;
+            if (i > previous) {
+                pick = i;
+                break;
+            }
+        }
+        if (pick == -1)
+            continue;
+        a->chunks[pick].match = j;
+        b->chunks[j].match = pick;
+        previous = pick;
+    }
+    free(next_same);
+    free(heads);
+
+    // matches on the longest increasing run stayed in place; the others moved
+    long n = 0, len = 0;
+    long *seq = malloc(sizeof(long) * (b->count + 1)), *tails = malloc(sizeof(long) * (b->count + 1)),
+            *prev = malloc(sizeof(long) * (b->count + 1));
+    for (size_t j = 0; j < b->count; ++j)
+        if (b->chunks[j].match != -1)
+            seq[n++] = j;
+    for (long k = 0; k < n; ++k) {
+        long lo = 0, hi = len, x = b->chunks[seq[k]].match;
+        while (lo < hi) {
+            long mid = (lo + hi) / 2;
+            if (b->chunks[seq[tails[mid]]].match < x)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        prev[k] = lo > 0 ? tails[lo - 1] : -1;
+        tails[lo] = k;
+        if (lo == len)
+            len++;
+    }
+    for (long k = len ? tails[len - 1] : -1; k >= 0; k = prev[k]) {
+        b->chunks[seq[k]].in_order = true;
+        a->chunks[b->chunks[seq[k]].match].in_order = true;
+    }
+    free(prev);
+    free(tails);
+    free(seq);
+}
+
+/**
+ * kdiff -c: report inserted, deleted and moved regions and a similarity score
+ * @param  brief  only print the summary
+ */
+int kdiff_chunked(const char *path1, const char *path2, bool brief) {
+    static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+    pthread_once(&gear_once, init_gear_table);
+
+    struct cdc_file a = {.path = path1}, b = {.path = path2};
+    pthread_t other;
+    bool threaded = pthread_create(&other, NULL, cdc_scan, &a) == 0; // both files stream at once
+    if (!threaded)
+        cdc_scan(&a);
+    cdc_scan(&b);
+    if (threaded)
+        pthread_join(other, NULL);
+    if (a.error || b.error) {
+        printf("-%s: kdiff: %s: %s\n", sysname, a.error ? path1 : path2, strerror(a.error ? a.error : b.error));
+        free(a.chunks);
+        free(b.chunks);
+        last_status = 2;
+        return SUCCESS;
+    }
+    cdc_match(&a, &b);
+
+    size_t matched = 0, moved_bytes = 0, inserted = 0, deleted = 0, regions[3] = {0, 0, 0};
+    for (size_t j = 0; j < b.count;) {
+        struct cdc_chunk *c = &b.chunks[j];
+        size_t k = j + 1, length = c->length;
+        if (c->match == -1) {
+            while (k < b.count && b.chunks[k].match == -1)
+                length += b.chunks[k++].length;
+            inserted += length;
+            regions[0]++;
+            if (!brief)
+                printf("inserted  %s 0x%010zx-0x%010zx %zu bytes\n", path2, c->offset, c->offset + length - 1, length);
+        } else if (!c->in_order) {
+            while (k < b.count && !b.chunks[k].in_order && b.chunks[k].match == b.chunks[k - 1].match + 1)
+                length += b.chunks[k++].length;
+            moved_bytes += length;
+            matched += length;
+            regions[2]++;
+            if (!brief)
+                printf("moved     %s 0x%010zx-0x%010zx -> %s 0x%010zx %zu bytes\n", path1,
+                       a.chunks[c->match].offset, a.chunks[c->match].offset + length - 1,
+                       path2, c->offset, length);
+        } else {
+            matched += length;
+        }
+        j = k;
+    }
+    for (size_t i = 0; i < a.count;) {
+        struct cdc_chunk *c = &a.chunks[i];
+        size_t k = i + 1, length = c->length;
+        if (c->match != -1) {
+            i = k;
+            continue;
+        }
+        while (k < a.count && a.chunks[k].match == -1)
+            length += a.chunks[k++].length;
+        deleted += length;
+        regions[1]++;
+        if (!brief)
+            printf("deleted   %s 0x%010zx-0x%010zx %zu bytes\n", path1, c->offset, c->offset + length - 1, length);
+        i = k;
+    }
+
+    double similarity = a.size + b.size ? 200.0 * matched / (a.size + b.size) : 100.0;
+    printf("%zu/%zu chunks, %zu bytes inserted in %zu regions, %zu deleted in %zu, %zu moved in %zu\n",
+           a.count, b.count, inserted, regions[0], deleted, regions[1], moved_bytes, regions[2]);
+    if (inserted + deleted + moved_bytes == 0 && a.size == b.size)
+        printf("The two files have the same content (%.2f%% similar)\n", similarity);
+    else
+        printf("The two files are %.2f%% similar\n", similarity);
+    last_status = inserted + deleted + moved_bytes ? 1 : 0;
+
+    free(a.chunks);
+    free(b.chunks);
+    return SUCCESS;
+}
+
+/**
+ * kdiff builtin: compare files (-a text, -b binary, -c chunked delta) or
+ * directory trees (-r)
+ */
+int builtin_kdiff(struct command_t *command) {
+    char *mode = command->arg_count > 0 && command->args[0][0] == '-' ? command->args[0] : "-a";
+    bool list = false, first_only = false, brief = false, trust_mtime = false;
+    int i = command->arg_count > 0 && command->args[0][0] == '-' ? 1 : 0;
+    for (; i < command->arg_count && command->args[i][0] == '-' && command->args[i][1]; ++i) {
+        if (strcmp(command->args[i], "-l") == 0)
+            list = true;
+        else if (strcmp(command->args[i], "-s") == 0)
+            first_only = true;
+        else if (strcmp(command->args[i], "-q") == 0)
+            brief = true;
+        else if (strcmp(command->args[i], "-m") == 0)
+            trust_mtime = true;
+        else
+            break;
+    }
+    if (command->arg_count - i != 2 || (strcmp(mode, "-a") && strcmp(mode, "-b")
+                                        && strcmp(mode, "-c") && strcmp(mode, "-r"))) {
+        printf("usage: kdiff [-a] file1 file2\n"
+               "       kdiff -b [-l] [-s] file1 file2\n"
+               "       kdiff -c [-q] file1 file2\n"
+               "       kdiff -r [-q] [-m] dir1 dir2\n");
+        last_status = 2;
+        return SUCCESS;
+    }
+
+    char *first = command->args[i], *second = command->args[i + 1];
+    if (strcmp(mode, "-b") == 0)
+        return kdiff_binary(first, second, list, first_only);
+    if (strcmp(mode, "-c") == 0)
+        return kdiff_chunked(first, second, brief);
+    if (strcmp(mode, "-r") == 0)
+        return kdiff_tree(first, second, brief, trust_mtime);
+    return kdiff_text(first, second);
+}
+
+/*
+ * highlight: color every occurrence of a set of words. The words are
+ * compiled into one Aho-Corasick automaton with a full transition table,
+ * so the input is scanned once whatever the number of words. While the
+ * automaton is at its root a SIMD prefilter skips to the next byte that
+ * can start a word. Input is mmap'd (or read in large blocks from pipes)
+ * and processed a line aligned slice at a time; bytes between matches are
+ * copied through untouched.
+ */
+#define HIGHLIGHT_SLICE (1 << 20)
+
+const char *highlight_colors[][2] = {
+    {"red", "\033[1;31m"}, {"green", "\033[0;32m"}, {"blue", "\033[0;34m"},
+    {"yellow", "\033[1;33m"}, {"magenta", "\033[0;35m"}, {"cyan", "\033[0;36m"},
+};
+#define HIGHLIGHT_COLOR_COUNT (int) (sizeof(highlight_colors) / sizeof(highlight_colors[0]))
+
+/**
+ * Color index for a name ("red") or its first letter ("r")
+ * @return  -1 if unknown
+ */
+int highlight_color(const char *name) {
+    for (int i = 0; i < HIGHLIGHT_COLOR_COUNT; ++i)
+        if (strcmp(name, highlight_colors[i][0]) == 0
+            || (name[0] == highlight_colors[i][0][0] && name[1] == '\0'))
+            return i;
+    return -1;
+}
+
+bool is_word_byte(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c >= 0x80;
+}
+
+struct highlight_pattern {
+    const char *text;
+    size_t length;
+    int color;
+    bool word_start, word_end; // a word boundary is needed on that side
+};
+
+struct highlighter {
+    struct highlight_pattern *patterns;
+    int count;
+    struct regex *regexes;
+    int regex_count;
+    uint32_t *delta; // states * 256 transitions
+    int32_t *out; // longest pattern ending in the state, -1 if none
+    uint32_t *dict; // next state on the fail chain with an output, 0 if none
+    int states;
+    bool start_byte[256];
+    unsigned char first[4]; // distinct first bytes, when there are at most 4
+    int first_count;
+};
+
+struct highlight_match {
+    size_t start, end;
+    int color;
+};
+
+struct highlight_output {
+    char *data;
+    size_t length, capacity;
+    struct highlight_match *matches;
+    size_t match_count, match_capacity;
+};
+
+/**
+ * Build the automaton for h->patterns
+ */
+void highlighter_build(struct highlighter *h) {
+    size_t max_states = 1;
+    for (int i = 0; i < h->count; ++i)
+        max_states += h->patterns[i].length;
+    h->delta = calloc(max_states * 256, sizeof(uint32_t));
+    h->out = malloc(sizeof(int32_t) * max_states);
+    h->dict = calloc(max_states, sizeof(uint32_t));
+    uint32_t *fail = calloc(max_states, sizeof(uint32_t)), *queue = malloc(sizeof(uint32_t) * max_states);
+    h->states = 1;
+    h->out[0] = -1;
+    memset(h->start_byte, 0, sizeof(h->start_byte));
+
+    // trie; 0 doubles as "no edge" since no edge leads back to the root
+    for (int i = 0; i < h->count; ++i) {
+        const unsigned char *p = (const unsigned char *) h->patterns[i].text;
+        uint32_t s = 0;
+        h->start_byte[p[0]] = true;
+        for (size_t k = 0; k < h->patterns[i].length; ++k) {
+            if (!h->delta[s * 256 + p[k]]) {
+                h->out[h->states] = -1;
+                h->delta[s * 256 + p[k]] = h->states++;
+            }
+            s = h->delta[s * 256 + p[k]];
+        }
+        if (h->out[s] == -1)
+            h->out[s] = i; // duplicates: the first one wins
+    }
+
+    // breadth first: fail links, then fill in the missing transitions
+    size_t head = 0, tail = 0;
+    for (int c = 0; c < 256; ++c)
+        if (h->delta[c])
+            queue[tail++] = h->delta[c];
+    while (head < tail) {
+        uint32_t s = queue[head++];
+        h->dict[s] = h->out[fail[s]] != -1 ? fail[s] : h->dict[fail[s]];
+        for (int c = 0; c < 256; ++c) {
+            uint32_t t = h->delta[s * 256 + c];
+            if (t) {
+                fail[t] = h->delta[fail[s] * 256 + c];
+                queue[tail++] = t;
+            } else {
+                h->delta[s * 256 + c] = h->delta[fail[s] * 256 + c];
+            }
+        }
+    }
+    free(queue);
+    free(fail);
+
+    h->first_count = 0;
+    for (int c = 0; c < 256; ++c)
+        if (h->start_byte[c] && h->first_count <= 4) {
+            if (h->first_count < 4)
+                h->first[h->first_count] = c;
+            h->first_count++;
+        }
+}
+
+void highlighter_free(struct highlighter *h) {
+    free(h->delta);
+    free(h->out);
+    free(h->dict);
+}
+
+/**
+ * Skip to the next byte that can start a pattern
+ */
+const unsigned char *highlight_skip(const struct highlighter *h, const unsigned char *p, const unsigned char *end) {
+#ifdef __SSE2__
+    if (h->first_count <= 4) {
+        const __m128i b0 = _mm_set1_epi8(h->first[0]), b1 = _mm_set1_epi8(h->first[h->first_count > 1]),
+                b2 = _mm_set1_epi8(h->first[h->first_count > 2 ? 2 : 0]),
+                b3 = _mm_set1_epi8(h->first[h->first_count > 3 ? 3 : 0]);
+        while (end - p >= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *) p);
+            __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, b0), _mm_cmpeq_epi8(v, b1)),
+                                     _mm_or_si128(_mm_cmpeq_epi8(v, b2), _mm_cmpeq_epi8(v, b3)));
+            int mask = _mm_movemask_epi8(m);
+            if (mask)
+                return p + __builtin_ctz(mask);
+            p += 16;
+        }
+    }
+#endif
+    while (p < end && !h->start_byte[*p])
+        p++;
+    return p;
+}
+
+/**
+ * Record a match, keeping the list non overlapping: a match that starts
+ * earlier replaces the ones it covers, unless it starts inside the match
+ * before them, in which case it is dropped
+ */
+void highlight_add_match(struct highlight_output *o, size_t start, size_t end, int color) {
+    size_t kept = o->match_count;
+    while (kept > 0 && start <= o->matches[kept - 1].start)
+        kept--;
+    if (kept > 0 && start < o->matches[kept - 1].end)
+        return;
+    o->match_count = kept;
+    if (o->match_count == o->match_capacity) {
+        o->match_capacity = o->match_capacity ? o->match_capacity * 2 : 1024;
+        o->matches = realloc(o->matches, sizeof(struct highlight_match) * o->match_capacity);
+    }
+    o->matches[o->match_count++] = (struct highlight_match) {start, end, color};
+}
+
+/*
+ * highlight -e: regular expressions in ERE syntax (. [] [^] [:class:] * + ?
+ * {m,n} | () and the \d \w \s escapes; ^ and $ anchor the whole expression
+ * to a line). An expression is compiled to a Thompson NFA, forwards and
+ * backwards, and each is run as a lazily built DFA whose states are cached
+ * per worker. A chunk is searched in passes that each read a byte once:
+ *   - forward, unanchored, for the lines that contain a match; when every
+ *     match starts with a literal, a SIMD scan for that literal instead;
+ *   - backward over a matching line, marking where matches start;
+ *   - forward, anchored, from the leftmost start to its longest match.
+ * The state cache is bounded. A full cache is flushed, and a chunk that
+ * keeps flushing it is finished by simulating the NFA directly.
+ */
+#define REGEX_MAX_NFA 8192
+#define REGEX_MAX_REPEAT 255
+#define REGEX_DFA_STATES 1024
+#define REGEX_DFA_FLUSHES 8 // per chunk, before falling back to the NFA
+#define REGEX_PREFIX_MAX 64
+
+enum regex_node_kind {
+    RE_EMPTY, RE_CLASS, RE_CAT, RE_ALT, RE_REPEAT
+};
+
+struct regex_node {
+    enum regex_node_kind kind;
+    int a, b; // children
+    int min, max; // RE_REPEAT; max is -1 when unbounded
+    uint64_t bits[4]; // RE_CLASS
+};
+
+struct regex_parser {
+    const char *p, *end;
+    struct regex_node *nodes;
+    int count, capacity;
+    const char *error;
+};
+
+enum nfa_op {
+    NFA_CLASS, NFA_SPLIT, NFA_MATCH
+};
+
+struct nfa_state {
+    enum nfa_op op;
+    int out, out1;
+    uint64_t bits[4];
+};
+
+struct nfa {
+    struct nfa_state *states;
+    int count, capacity, start;
+};
+
+struct regex {
+    const char *source;
+    int color;
+    struct nfa forward, reverse;
+    bool anchor_start, anchor_end;
+    char prefix[REGEX_PREFIX_MAX]; // every match starts with it
+    size_t prefix_length;
+    uint64_t first[4]; // bytes a match can start with
+    unsigned char first_bytes[3]; // the same, when there are at most three
+    int first_count;
+};
+
+void class_add(uint64_t *bits, unsigned char c) {
+    bits[c >> 6] |= 1ULL << (c & 63);
+}
+
+bool class_has(const uint64_t *bits, unsigned char c) {
+    return bits[c >> 6] >> (c & 63) & 1;
+}
+
+void class_add_range(uint64_t *bits, int lo, int hi) {
+    for (int c = lo; c <= hi; ++c)
+        class_add(bits, c);
+}
+
+/**
+ * Complement a class; a newline is never matched, so matches stay within a line
+ */
+void class_negate(uint64_t *bits) {
+    for (int i = 0; i < 4; ++i)
+        bits[i] = ~bits[i];
+    bits['\n' >> 6] &= ~(1ULL << ('\n' & 63));
+}
+
+/**
+ * Add a POSIX class name ("digit") to bits
+ * @return  false if the name is unknown
+ */
+bool class_add_named(uint64_t *bits, const char *name, size_t length) {
+    const char *names[] = {"alpha", "digit", "alnum", "upper", "lower", "space", "xdigit", "punct"};
+    int which = -1;
+    for (int i = 0; i < 8; ++i)
+        if (strlen(names[i]) == length && strncmp(name, names[i], length) == 0)
+            which = i;
+    for (int c = 0; c < 128; ++c) {
+        bool upper = c >= 'A' && c <= 'Z', lower = c >= 'a' && c <= 'z', digit = c >= '0' && c <= '9';
+        bool in[] = {upper || lower, digit, upper || lower || digit, upper, lower,
+                     c == ' ' || (c >= '\t' && c <= '\r'),
+                     digit || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'),
+                     c > ' ' && c < 127 && !upper && !lower && !digit};
+        if (which != -1 && in[which])
+            class_add(bits, c);
+    }
+    return which != -1;
+}
+
+/**
+ * Add the class of a \d \w \s (or negated \D \W \S) escape
+ * @return  false if e is not one of them
+ */
+bool class_add_escape(uint64_t *bits, char e) {
+    uint64_t cls[4] = {0, 0, 0, 0};
+    switch (e | 0x20) {
+        case 'd':
+            class_add_named(cls, "digit", 5);
+            break;
+        case 'w':
+            class_add_named(cls, "alnum", 5);
+            class_add(cls, '_');
+            break;
+        case 's':
+            class_add_named(cls, "space", 5);
+            break;
+        default:
+            return false;
+    }
+    if (e >= 'A' && e <= 'Z')
+        class_negate(cls);
+    for (int i = 0; i < 4; ++i)
+        bits[i] |= cls[i];
+    return true;
+}
+
+int regex_node_new(struct regex_parser *rp, enum regex_node_kind kind, int a, int b) {
+    if (rp->count == rp->capacity) {
+        rp->capacity = rp->capacity ? rp->capacity * 2 : 64;
+        rp->nodes = realloc(rp->nodes, sizeof(struct regex_node) * rp->capacity);
+    }
+    struct regex_node *n = &rp->nodes[rp->count];
+    memset(n, 0, sizeof(struct regex_node));
+    n->kind = kind;
+    n->a = a;
+    n->b = b;
+    return rp->count++;
+}
+
+int regex_parse_alt(struct regex_parser *rp);
+
+int regex_parse_class(struct regex_parser *rp) {
+    int n = regex_node_new(rp, RE_CLASS, -1, -1);
+    uint64_t bits[4] = {0, 0, 0, 0};
+    const char *p = ++rp->p, *end = rp->end;
+    bool negate = p < end && *p == '^';
+    if (negate)
+        p++;
+    for (bool first = true; p < end && (*p != ']' || first); first = false) {
+        if (p + 1 < end && p[0] == '[' && p[1] == ':') {
+            const char *close = p + 2;
+            while (close + 1 < end && !(close[0] == ':' && close[1] == ']'))
+                close++;
+            if (close + 1 >= end || !class_add_named(bits, p + 2, close - (p + 2))) {
+                rp->error = "unknown character class";
+                return n;
+            }
+            p = close + 2;
+            continue;
+        }
+        unsigned char lo = *p++;
+        if (lo == '\\' && p < end) {
+            if (class_add_escape(bits, *p)) {
+                p++;
+                continue;
+            }
+            lo = *p++;
+        }
+        if (p + 1 < end && *p == '-' && p[1] != ']') {
+            unsigned char hi = p[1];
+            p += 2;
+            if (hi < lo) {
+                rp->error = "invalid range";
+                return n;
+            }
+            class_add_range(bits, lo, hi);
+        } else {
+            class_add(bits, lo);
+        }
+    }
+    if (p >= end) {
+        rp->error = "missing ]";
+        return n;
+    }
+    rp->p = p + 1;
+    if (negate)
+        class_negate(bits);
+    memcpy(rp->nodes[n].bits, bits, sizeof(bits));
+    return n;
+}
+
+int regex_parse_atom(struct regex_parser *rp) {
+    char c = *rp->p;
+    if (c == '(') {
+        rp->p++;
+        int n = regex_parse_alt(rp);
+        if (!rp->error && (rp->p >= rp->end || *rp->p != ')'))
+            rp->error = "missing )";
+        rp->p++;
+        return n;
+    }
+    if (c == '[')
+        return regex_parse_class(rp);
+    if (c == '*' || c == '+' || c == '?' || c == '{') {
+        rp->error = "nothing to repeat";
+        return -1;
+    }
+    int n = regex_node_new(rp, RE_CLASS, -1, -1);
+    uint64_t *bits = rp->nodes[n].bits;
+    rp->p++;
+    if (c == '.') {
+        class_negate(bits);
+    } else if (c == '\\') {
+        if (rp->p >= rp->end) {
+            rp->error = "trailing backslash";
+            return n;
+        }
+        c = *rp->p++;
+        if (!class_add_escape(bits, c))
+            class_add(bits, c == 't' ? '\t' : c);
+    } else {
+        class_add(bits, c);
+    }
+    return n;
+}
+
+int regex_parse_repeat(struct regex_parser *rp) {
+    int n = regex_parse_atom(rp);
+    while (!rp->error && rp->p < rp->end) {
+        int min, max;
+        char c = *rp->p;
+        if (c == '*' || c == '+' || c == '?') {
+            min = c == '+';
+            max = c == '?' ? 1 : -1;
+            rp->p++;
+        } else if (c == '{') {
+            char *q;
+            min = max = strtol(rp->p + 1, &q, 10);
+            if (q == rp->p + 1) {
+                rp->error = "invalid repetition";
+                return n;
+            }
+            if (*q == ',') {
+                const char *r = q + 1;
+                max = *r == '}' ? -1 : strtol(r, &q, 10);
+                if (max != -1 && q == r) {
+                    rp->error = "invalid repetition";
+                    return n;
+                }
+                if (max == -1)
+                    q = (char *) r;
+            }
+            if (q >= rp->end || *q != '}' || min > REGEX_MAX_REPEAT || max > REGEX_MAX_REPEAT
+                || (max != -1 && max < min)) {
+                rp->error = "invalid repetition";
+                return n;
+            }
+            rp->p = q + 1;
+        } else {
+            break;
+        }
+        n = regex_node_new(rp, RE_REPEAT, n, -1);
+        rp->nodes[n].min = min;
+        rp->nodes[n].max = max;
+    }
+    return n;
+}
+
+int regex_parse_cat(struct regex_parser *rp) {
+    int n = -1;
+    while (!rp->error && rp->p < rp->end && *rp->p != '|' && *rp->p != ')') {
+        int next = regex_parse_repeat(rp);
+        n = n == -1 ? next : regex_node_new(rp, RE_CAT, n, next);
+    }
+    return n == -1 ? regex_node_new(rp, RE_EMPTY, -1, -1) : n;
+}
+
+int regex_parse_alt(struct regex_parser *rp) {
+    int n = regex_parse_cat(rp);
+    while (!rp->error && rp->p < rp->end && *rp->p == '|') {
+        rp->p++;
+        n = regex_node_new(rp, RE_ALT, n, regex_parse_cat(rp));
+    }
+    return n;
+}
+
+int nfa_add(struct nfa *nfa, enum nfa_op op, int out, int out1, const uint64_t *bits) {
+    if (nfa->count == REGEX_MAX_NFA)
+        return -1;
+    if (nfa->count == nfa->capacity) {
+        nfa->capacity = nfa->capacity ? nfa->capacity * 2 : 64;
+        nfa->states = realloc(nfa->states, sizeof(struct nfa_state) * nfa->capacity);
+    }
+    struct nfa_state *s = &nfa->states[nfa->count];
+    s->op = op;
+    s->out = out;
+    s->out1 = out1;
+    if (bits)
+        memcpy(s->bits, bits, sizeof(s->bits));
+    return nfa->count++;
+}
+
+/**
+ * Compile node so that it continues to state next
+ * @param  reverse  match the node's text backwards
+ * @return          the entry state, or -1 if the NFA grew too large
+ */
+int nfa_compile(struct nfa *nfa, const struct regex_node *nodes, int node, int next, bool reverse) {
+    const struct regex_node *n = &nodes[node];
+    if (next == -1)
+        return -1;
+    switch (n->kind) {
+        case RE_EMPTY:
+            return next;
+        case RE_CLASS:
+            return nfa_add(nfa, NFA_CLASS, next, -1, n->bits);
+        case RE_CAT:
+            if (reverse)
+                return nfa_compile(nfa, nodes, n->b, nfa_compile(nfa, nodes, n->a, next, reverse), reverse);
+            return nfa_compile(nfa, nodes, n->a, nfa_compile(nfa, nodes, n->b, next, reverse), reverse);
+        case RE_ALT: {
+            int a = nfa_compile(nfa, nodes, n->a, next, reverse), b = nfa_compile(nfa, nodes, n->b, next, reverse);
+            return a == -1 || b == -1 ? -1 : nfa_add(nfa, NFA_SPLIT, a, b, NULL);
+        }
+        case RE_REPEAT: {
+            int tail = next;
+            if (n->max == -1) {
+                int loop = nfa_add(nfa, NFA_SPLIT, -1, next, NULL);
+                if (loop == -1)
+                    return -1;
+                int body = nfa_compile(nfa, nodes, n->a, loop, reverse);
+                if (body == -1)
+                    return -1;
+                nfa->states[loop].out = body;
+                tail = loop;
+            } else {
+                for (int i = 0; i < n->max - n->min && tail != -1; ++i) {
+                    int body = nfa_compile(nfa, nodes, n->a, tail, reverse);
+                    tail = body == -1 ? -1 : nfa_add(nfa, NFA_SPLIT, body, next, NULL);
+                }
+            }
+            for (int i = 0; i < n->min && tail != -1; ++i)
+                tail = nfa_compile(nfa, nodes, n->a, tail, reverse);
+            return tail;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Append the literal text every match of node starts with to re->prefix
+ * @return  true if the whole node was literal, so the prefix may go on
+ */
+bool regex_prefix(struct regex *re, const struct regex_node *nodes, int node) {
+    const struct regex_node *n = &nodes[node];
+    int byte = -1, count = 0;
+    if (n->kind == RE_EMPTY)
+        return true;
+    if (n->kind == RE_CAT)
+        return regex_prefix(re, nodes, n->a) && regex_prefix(re, nodes, n->b);
+    const uint64_t *bits = n->kind == RE_CLASS ? n->bits : n->kind == RE_REPEAT && nodes[n->a].kind == RE_CLASS
+                                                           ? nodes[n->a].bits : NULL;
+    if (!bits)
+        return false;
+    for (int c = 0; c < 256 && count < 2; ++c)
+        if (class_has(bits, c)) {
+            byte = c;
+            count++;
+        }
+    if (count != 1)
+        return false;
+    int copies = n->kind == RE_CLASS ? 1 : n->min;
+    for (int i = 0; i < copies; ++i) {
+        if (re->prefix_length == REGEX_PREFIX_MAX)
+            return false;
+        re->prefix[re->prefix_length++] = byte;
+    }
+    return n->kind == RE_CLASS || n->max == n->min;
+}
+
+bool regex_nullable(const struct regex_node *nodes, int node) {
+    const struct regex_node *n = &nodes[node];
+    switch (n->kind) {
+        case RE_EMPTY:
+            return true;
+        case RE_CAT:
+            return regex_nullable(nodes, n->a) && regex_nullable(nodes, n->b);
+        case RE_ALT:
+            return regex_nullable(nodes, n->a) || regex_nullable(nodes, n->b);
+        case RE_REPEAT:
+            return n->min == 0 || regex_nullable(nodes, n->a);
+        default:
+            return false;
+    }
+}
+
+/**
+ * Add the bytes that can be matched first from NFA state s to bits
+ */
+void nfa_first_bytes(const struct nfa *nfa, int s, uint64_t *bits, bool *visited) {
+    if (visited[s])
+        return;
+    visited[s] = true;
+    const struct nfa_state *x = &nfa->states[s];
+    if (x->op == NFA_SPLIT) {
+        nfa_first_bytes(nfa, x->out, bits, visited);
+        nfa_first_bytes(nfa, x->out1, bits, visited);
+    } else if (x->op == NFA_CLASS) {
+        for (int i = 0; i < 4; ++i)
+            bits[i] |= x->bits[i];
+    }
+}
+
+/**
+ * Compile source into re
+ * @return  0, or -1 with *error set
+ */
+int regex_compile(struct regex *re, const char *source, const char **error) {
+    memset(re, 0, sizeof(struct regex));
+    re->source = source;
+    size_t length = strlen(source);
+    const char *p = source, *end = source + length;
+    if (p < end && *p == '^') {
+        re->anchor_start = true;
+        p++;
+    }
+    size_t backslashes = 0;
+    while (end - backslashes - 1 > p && end[-2 - (long) backslashes] == '\\')
+        backslashes++;
+    if (end > p && end[-1] == '$' && backslashes % 2 == 0) {
+        re->anchor_end = true;
+        end--;
+    }
+
+    struct regex_parser rp = {.p = p, .end = end};
+    int root = regex_parse_alt(&rp);
+    if (!rp.error && rp.p < rp.end)
+        rp.error = "unmatched )";
+    if (!rp.error && regex_nullable(rp.nodes, root))
+        rp.error = "matches the empty string";
+    if (!rp.error) {
+        regex_prefix(re, rp.nodes, root);
+        int match = nfa_add(&re->forward, NFA_MATCH, -1, -1, NULL);
+        re->forward.start = nfa_compile(&re->forward, rp.nodes, root, match, false);
+        match = nfa_add(&re->reverse, NFA_MATCH, -1, -1, NULL);
+        re->reverse.start = nfa_compile(&re->reverse, rp.nodes, root, match, true);
+        if (re->forward.start == -1 || re->reverse.start == -1)
+            rp.error = "expression too large";
+    }
+    if (!rp.error) {
+        bool *visited = calloc(re->forward.count, sizeof(bool));
+        nfa_first_bytes(&re->forward, re->forward.start, re->first, visited);
+        free(visited);
+        for (int c = 0; c < 256; ++c)
+            if (class_has(re->first, c) && re->first_count++ < 3)
+                re->first_bytes[re->first_count - 1] = c;
+    }
+    free(rp.nodes);
+    if (rp.error) {
+        *error = rp.error;
+        free(re->forward.states);
+        free(re->reverse.states);
+        return -1;
+    }
+    return 0;
+}
+
+void regex_free(struct regex *re) {
+    free(re->forward.states);
+    free(re->reverse.states);
+}
+
+struct dfa_state {
+    int32_t next[256]; // -1 until built
+    int set, size; // NFA states, at dfa->sets + set
+    bool accept;
+};
+
+/*
+ * State 0 is the dead state and state 1 the start state. Once in NFA mode
+ * nothing is cached and each step lands in state 2 or 3, alternately.
+ */
+struct lazy_dfa {
+    const struct nfa *nfa;
+    bool unanchored; // the start state is entered again at every byte
+    struct dfa_state *states;
+    int count, capacity;
+    int *sets;
+    size_t sets_used, sets_capacity;
+    int *table; // open addressing, state index or -1
+    int flushes;
+    bool use_nfa;
+    uint64_t *seen; // closure bitmap
+    int *stack, *list;
+};
+
+#define DFA_TABLE_SIZE (REGEX_DFA_STATES * 4)
+
+/**
+ * Add the epsilon closure of state s to the seen bitmap
+ */
+void dfa_closure(struct lazy_dfa *d, int s) {
+    int depth = 0;
+    if (d->seen[s >> 6] >> (s & 63) & 1)
+        return;
+    d->seen[s >> 6] |= 1ULL << (s & 63);
+    d->stack[depth++] = s;
+    while (depth > 0) {
+        const struct nfa_state *x = &d->nfa->states[d->stack[--depth]];
+        if (x->op != NFA_SPLIT)
+            continue;
+        int outs[2] = {x->out, x->out1};
+        for (int i = 0; i < 2; ++i)
+            if (!(d->seen[outs[i] >> 6] >> (outs[i] & 63) & 1)) {
+                d->seen[outs[i] >> 6] |= 1ULL << (outs[i] & 63);
+                d->stack[depth++] = outs[i];
+            }
+    }
+}
+
+/**
+ * Move the seen bitmap into out as a sorted set of CLASS and MATCH states,
+ * clearing it
+ * @return  the set size
+ */
+int dfa_collect(struct lazy_dfa *d, int *out) {
+    int size = 0, words = (d->nfa->count + 63) / 64;
+    for (int w = 0; w < words; ++w) {
+        for (uint64_t bits = d->seen[w]; bits; bits &= bits - 1) {
+            int s = w * 64 + __builtin_ctzll(bits);
+            if (d->nfa->states[s].op != NFA_SPLIT)
+                out[size++] = s;
+        }
+        d->seen[w] = 0;
+    }
+    return size;
+}
+
+/**
+ * The set reached from set on byte c, into d->list
+ */
+int dfa_step_set(struct lazy_dfa *d, const int *set, int size, unsigned char c) {
+    for (int i = 0; i < size; ++i) {
+        const struct nfa_state *x = &d->nfa->states[set[i]];
+        if (x->op == NFA_CLASS && class_has(x->bits, c))
+            dfa_closure(d, x->out);
+    }
+    if (d->unanchored)
+        dfa_closure(d, d->nfa->start);
+    return dfa_collect(d, d->list);
+}
+
+int dfa_lookup(struct lazy_dfa *d, const int *set, int size, uint64_t hash) {
+    for (size_t slot = hash & (DFA_TABLE_SIZE - 1);; slot = (slot + 1) & (DFA_TABLE_SIZE - 1)) {
+        int s = d->table[slot];
+        if (s == -1)
+            return -1;
+        if (d->states[s].size == size && memcmp(d->sets + d->states[s].set, set, sizeof(int) * size) == 0)
+            return s;
+    }
+}
+
+/**
+ * Add a state for set; the set may be d->list
+ */
+int dfa_add(struct lazy_dfa *d, const int *set, int size, uint64_t hash, bool index) {
+    if (d->count == d->capacity) {
+        d->capacity = d->capacity ? d->capacity * 2 : 16;
+        d->states = realloc(d->states, sizeof(struct dfa_state) * d->capacity);
+    }
+    if (d->sets_used + d->nfa->count > d->sets_capacity) {
+        d->sets_capacity = (d->sets_used + d->nfa->count) * 2;
+        d->sets = realloc(d->sets, sizeof(int) * d->sets_capacity);
+    }
+    struct dfa_state *st = &d->states[d->count];
+    memset(st->next, 0xff, sizeof(st->next));
+    st->set = d->sets_used;
+    st->size = size;
+    st->accept = false;
+    if (size > 0)
+        memcpy(d->sets + st->set, set, sizeof(int) * size);
+    for (int i = 0; i < size; ++i)
+        st->accept |= d->nfa->states[set[i]].op == NFA_MATCH;
+    d->sets_used += index ? (size_t) size : (size_t) d->nfa->count; // NFA slots are reused at any size
+    if (index) {
+        size_t slot = hash & (DFA_TABLE_SIZE - 1);
+        while (d->table[slot] != -1)
+            slot = (slot + 1) & (DFA_TABLE_SIZE - 1);
+        d->table[slot] = d->count;
+    }
+    return d->count++;
+}
+
+/**
+ * Drop every cached state, leaving dead and start (and, in NFA mode, the
+ * two scratch states)
+ */
+void dfa_reset(struct lazy_dfa *d) {
+    d->count = 0;
+    d->sets_used = 0;
+    memset(d->table, 0xff, sizeof(int) * DFA_TABLE_SIZE);
+    dfa_add(d, NULL, 0, hash64(NULL, 0, 0), true);
+    dfa_closure(d, d->nfa->start);
+    int size = dfa_collect(d, d->stack); // d->list may hold a set being built
+    dfa_add(d, d->stack, size, hash64(d->stack, sizeof(int) * size, 0), true);
+    if (d->use_nfa) {
+        dfa_add(d, NULL, 0, 0, false);
+        dfa_add(d, NULL, 0, 0, false);
+    }
+}
+
+void dfa_init(struct lazy_dfa *d, const struct nfa *nfa, bool unanchored) {
+    memset(d, 0, sizeof(struct lazy_dfa));
+    d->nfa = nfa;
+    d->unanchored = unanchored;
+    d->table = malloc(sizeof(int) * DFA_TABLE_SIZE);
+    d->seen = calloc((nfa->count + 63) / 64, sizeof(uint64_t));
+    d->stack = malloc(sizeof(int) * nfa->count);
+    d->list = malloc(sizeof(int) * nfa->count);
+    dfa_reset(d);
+}
+
+void dfa_free(struct lazy_dfa *d) {
+    free(d->states);
+    free(d->sets);
+    free(d->table);
+    free(d->seen);
+    free(d->stack);
+    free(d->list);
+}
+
+/**
+ * Start of a chunk: give the cache another chance if the last chunk gave up on it
+ */
+void dfa_begin_chunk(struct lazy_dfa *d) {
+    d->flushes = 0;
+    if (d->use_nfa) {
+        d->use_nfa = false;
+        dfa_reset(d);
+    }
+}
+
+/**
+ * Build the transition of state s on byte c
+ */
+int dfa_build(struct lazy_dfa *d, int s, unsigned char c) {
+    int size = dfa_step_set(d, d->sets + d->states[s].set, d->states[s].size, c);
+    bool flushed = false;
+    if (!d->use_nfa) {
+        uint64_t hash = hash64(d->list, sizeof(int) * size, 0);
+        int t = dfa_lookup(d, d->list, size, hash);
+        if (t == -1 && d->count == REGEX_DFA_STATES) {
+            d->use_nfa = ++d->flushes > REGEX_DFA_FLUSHES; // thrashing
+            dfa_reset(d);
+            flushed = true;
+            t = d->use_nfa ? -1 : dfa_lookup(d, d->list, size, hash);
+        }
+        if (!d->use_nfa) {
+            if (t == -1)
+                t = dfa_add(d, d->list, size, hash, true);
+            if (!flushed)
+                d->states[s].next[c] = t;
+            return t;
+        }
+    }
+    if (size == 0)
+        return 0;
+    int t = s == 2 && !flushed ? 3 : 2;
+    struct dfa_state *st = &d->states[t];
+    memcpy(d->sets + st->set, d->list, sizeof(int) * size);
+    st->size = size;
+    st->accept = false;
+    for (int i = 0; i < size; ++i)
+        st->accept |= d->nfa->states[d->list[i]].op == NFA_MATCH;
+    return t;
+}
+
+static inline int dfa_next(struct lazy_dfa *d, int s, unsigned char c) {
+    int t = d->states[s].next[c];
+    return t >= 0 ? t : dfa_build(d, s, c);
+}
+
+/**
+ * End of the longest match starting at data[start], within the line ending at line_end
+ * @return  start if there is none
+ */
+size_t regex_longest(const struct regex *re, struct lazy_dfa *d, const char *data, size_t start, size_t line_end) {
+    size_t last = start;
+    int s = 1;
+    for (size_t i = start; i < line_end; ++i) {
+        s = dfa_next(d, s, data[i]);
+        if (s == 0)
+            break;
+        if (d->states[s].accept && (!re->anchor_end || i + 1 == line_end))
+            last = i + 1;
+    }
+    return last;
+}
+
+/**
+ * Next occurrence of the literal prefix in [p, end)
+ */
+const char *regex_find_prefix(const struct regex *re, const char *p, const char *end) {
+    size_t n = re->prefix_length;
+    if (n == 1)
+        return memchr(p, re->prefix[0], end - p);
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(re->prefix[0]), last = _mm_set1_epi8(re->prefix[n - 1]);
+    while (end - p >= (long) n + 15) {
+        __m128i a = _mm_loadu_si128((const __m128i *) p), b = _mm_loadu_si128((const __m128i *) (p + n - 1));
+        for (int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+             mask; mask &= mask - 1) {
+            const char *q = p + __builtin_ctz(mask);
+            if (memcmp(q + 1, re->prefix + 1, n - 2) == 0)
+                return q;
+        }
+        p += 16;
+    }
+#endif
+    return memmem(p, end - p, re->prefix, n);
+}
+
+/**
+ * Next position from i holding a byte a match can start with, or a newline
+ */
+size_t regex_skip(const struct regex *re, const char *data, size_t i, size_t size) {
+    const unsigned char *p = (const unsigned char *) data + i, *end = (const unsigned char *) data + size;
+#ifdef __SSE2__
+    if (re->first_count <= 3) {
+        const __m128i nl = _mm_set1_epi8('\n'), b0 = _mm_set1_epi8(re->first_bytes[0]),
+                b1 = _mm_set1_epi8(re->first_bytes[re->first_count > 1]),
+                b2 = _mm_set1_epi8(re->first_bytes[re->first_count > 2 ? 2 : 0]);
+        while (end - p >= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *) p);
+            __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, b0)),
+                                     _mm_or_si128(_mm_cmpeq_epi8(v, b1), _mm_cmpeq_epi8(v, b2)));
+            int mask = _mm_movemask_epi8(m);
+            if (mask)
+                return p - (const unsigned char *) data + __builtin_ctz(mask);
+            p += 16;
+        }
+    }
+#endif
+    while (p < end && !class_has(re->first, *p) && *p != '\n')
+        p++;
+    return p - (const unsigned char *) data;
+}
+
+size_t regex_line_start(const char *data, size_t i) {
+    const char *nl = memrchr(data, '\n', i);
+    return nl ? (size_t) (nl + 1 - data) : 0;
+}
+
+struct regex_matches {
+    struct highlight_match *items;
+    size_t count, capacity;
+    unsigned char *marks; // per byte of a line: a match starts here
+    size_t marks_capacity;
+};
+
+void regex_add_match(struct regex_matches *m, size_t start, size_t end, int color) {
+    if (m->count == m->capacity) {
+        m->capacity = m->capacity ? m->capacity * 2 : 1024;
+        m->items = realloc(m->items, sizeof(struct highlight_match) * m->capacity);
+    }
+    m->items[m->count++] = (struct highlight_match) {start, end, color};
+}
+
+/**
+ * Matches in a line known to contain one: mark the starts backwards, then
+ * take the longest match from each leftmost start
+ */
+void regex_match_line(const struct regex *re, struct lazy_dfa *dfas, const char *data, size_t line_start,
+                      size_t line_end, struct regex_matches *m) {
+    size_t length = line_end - line_start;
+    if (length > m->marks_capacity) {
+        m->marks_capacity = length * 2;
+        m->marks = realloc(m->marks, m->marks_capacity);
+    }
+    memset(m->marks, 0, length);
+    int s = 1;
+    for (size_t i = line_end; i-- > line_start;) {
+        s = dfa_next(&dfas[1], s, data[i]);
+        if (s == 0)
+            break;
+        if (dfas[1].states[s].accept)
+            m->marks[i - line_start] = 1;
+    }
+    for (size_t i = line_start; i < line_end; ++i) {
+        if (!m->marks[i - line_start] || (re->anchor_start && i != line_start))
+            continue;
+        size_t end = regex_longest(re, &dfas[2], data, i, line_end);
+        if (end > i) {
+            regex_add_match(m, i, end, re->color);
+            i = end - 1;
+        }
+    }
+}
+
+/**
+ * Find the matches of re in data[0, size), which ends on a line boundary
+ * @param  dfas  forward filter, backward and forward anchored DFAs for re
+ */
+void regex_find(const struct regex *re, struct lazy_dfa *dfas, const char *data, size_t size,
+                struct regex_matches *m) {
+    for (int i = 0; i < 3; ++i)
+        dfa_begin_chunk(&dfas[i]);
+    m->count = 0;
+    const char *end = data + size;
+    if (re->prefix_length > 0) {
+        for (const char *p = data, *q; p < end && (q = regex_find_prefix(re, p, end));) {
+            p = q + 1;
+            if (re->anchor_start && q > data && q[-1] != '\n')
+                continue;
+            const char *nl = memchr(q, '\n', end - q);
+            size_t start = q - data, stop = regex_longest(re, &dfas[2], data, start, nl ? nl - data : size);
+            if (stop > start) {
+                regex_add_match(m, start, stop, re->color);
+                p = data + stop;
+            }
+        }
+        return;
+    }
+
+    int s = 1;
+    for (size_t i = 0; i < size; ++i) {
+        if (s == 1 && !re->anchor_start) { // no match under way: skip to a byte that can start one
+            i = regex_skip(re, data, i, size);
+            if (i == size)
+                break;
+        }
+        unsigned char c = data[i];
+        if (c == '\n') {
+            if (re->anchor_end && dfas[0].states[s].accept)
+                regex_match_line(re, dfas, data, regex_line_start(data, i), i, m);
+            s = 1;
+            continue;
+        }
+        s = dfa_next(&dfas[0], s, c);
+        if (s == 0 || (!re->anchor_end && dfas[0].states[s].accept)) {
+            const char *nl = memchr(data + i, '\n', size - i);
+            size_t line_end = nl ? (size_t) (nl - data) : size;
+            if (s != 0)
+                regex_match_line(re, dfas, data, regex_line_start(data, i), line_end, m);
+            s = 0;
+            i = line_end - 1; // the newline resets the scan
+        }
+    }
+    if (re->anchor_end && s != 1 && dfas[0].states[s].accept)
+        regex_match_line(re, dfas, data, regex_line_start(data, size), size, m);
+}
+
+/**
+ * Per worker state: the lazy DFAs of each expression and match buffers
+ */
+struct highlight_scratch {
+    struct lazy_dfa *dfas; // three per expression, see regex_find
+    struct regex_matches found;
+    struct highlight_match *merged;
+    size_t merged_capacity;
+};
+
+void highlight_scratch_init(struct highlight_scratch *scratch, const struct highlighter *h) {
+    memset(scratch, 0, sizeof(struct highlight_scratch));
+    scratch->dfas = malloc(sizeof(struct lazy_dfa) * 3 * h->regex_count + 1);
+    for (int i = 0; i < h->regex_count; ++i) {
+        const struct regex *re = &h->regexes[i];
+        dfa_init(&scratch->dfas[3 * i], &re->forward, !re->anchor_start);
+        dfa_init(&scratch->dfas[3 * i + 1], &re->reverse, !re->anchor_end);
+        dfa_init(&scratch->dfas[3 * i + 2], &re->forward, false);
+    }
+}
+
+void highlight_scratch_free(struct highlight_scratch *scratch, const struct highlighter *h) {
+    for (int i = 0; i < 3 * h->regex_count; ++i)
+        dfa_free(&scratch->dfas[i]);
+    free(scratch->dfas);
+    free(scratch->found.items);
+    free(scratch->found.marks);
+    free(scratch->merged);
+}
+
+/**
+ * Merge the matches found for one expression into o->matches, keeping them
+ * leftmost longest and non overlapping
+ */
+void highlight_merge(struct highlight_output *o, struct highlight_scratch *scratch) {
+    struct regex_matches *f = &scratch->found;
+    size_t need = o->match_count + f->count, a = 0, b = 0, n = 0;
+    if (f->count == 0)
+        return;
+    if (need > scratch->merged_capacity) {
+        scratch->merged_capacity = need * 2;
+        scratch->merged = realloc(scratch->merged, sizeof(struct highlight_match) * scratch->merged_capacity);
+    }
+    while (a < o->match_count || b < f->count) {
+        struct highlight_match *x = a < o->match_count ? &o->matches[a] : NULL, *y = b < f->count ? &f->items[b] : NULL;
+        struct highlight_match *m = !y || (x && (x->start < y->start || (x->start == y->start && x->end >= y->end)))
+                                    ? &o->matches[a++] : &f->items[b++];
+        if (n == 0 || m->start >= scratch->merged[n - 1].end)
+            scratch->merged[n++] = *m;
+    }
+    struct highlight_match *swap = o->matches;
+    o->matches = scratch->merged;
+    o->match_count = n;
+    scratch->merged = swap;
+    size_t capacity = o->match_capacity;
+    o->match_capacity = scratch->merged_capacity;
+    scratch->merged_capacity = capacity;
+}
+
+/**
+ * Find the matches in data[0, size), which starts and ends on line boundaries
+ */
+void highlight_find(const struct highlighter *h, struct highlight_scratch *scratch, const char *data, size_t size,
+                    struct highlight_output *o) {
+    const unsigned char *base = (const unsigned char *) data, *p = base, *end = h->count ? base + size : base;
+    const uint32_t *delta = h->delta;
+    uint32_t s = 0;
+    o->match_count = 0;
+    while (p < end) {
+        if (s == 0) {
+            p = highlight_skip(h, p, end);
+            if (p == end)
+                break;
+        }
+        s = delta[s * 256 + *p++];
+        for (uint32_t t = h->out[s] != -1 ? s : h->dict[s]; t; t = h->dict[t]) {
+            const struct highlight_pattern *pat = &h->patterns[h->out[t]];
+            size_t stop = p - base, start = stop - pat->length;
+            if (pat->word_start && start > 0 && is_word_byte(base[start - 1]))
+                continue;
+            if (pat->word_end && stop < size && is_word_byte(base[stop]))
+                continue;
+            highlight_add_match(o, start, stop, pat->color);
+        }
+    }
+    for (int i = 0; i < h->regex_count; ++i) {
+        regex_find(&h->regexes[i], &scratch->dfas[3 * i], data, size, &scratch->found);
+        highlight_merge(o, scratch);
+    }
+}
+
+void highlight_append(struct highlight_output *o, const char *p, size_t n) {
+    if (o->length + n > o->capacity) {
+        while (o->length + n > o->capacity)
+            o->capacity = o->capacity ? o->capacity * 2 : HIGHLIGHT_SLICE;
+        o->data = realloc(o->data, o->capacity);
+    }
+    memcpy(o->data + o->length, p, n);
+    o->length += n;
+}
+
+/**
+ * Append data with its matches colored; adjacent matches of one color
+ * share a single escape sequence
+ */
+void highlight_render(const char *data, size_t size, struct highlight_output *o) {
+    size_t pos = 0;
+    int color = -1;
+    for (size_t i = 0; i < o->match_count; ++i) {
+        struct highlight_match *m = &o->matches[i];
+        if (m->start > pos) {
+            if (color != -1)
+                highlight_append(o, "\033[0m", 4);
+            color = -1;
+            highlight_append(o, data + pos, m->start - pos);
+        }
+        if (m->color != color) {
+            const char *seq = highlight_colors[m->color][1];
+            highlight_append(o, seq, strlen(seq));
+            color = m->color;
+        }
+        highlight_append(o, data + m->start, m->end - m->start);
+        pos = m->end;
+    }
+    if (color != -1)
+        highlight_append(o, "\033[0m", 4);
+    highlight_append(o, data + pos, size - pos);
+}
+
+/*
+ * The scan runs on a worker pool. The shell thread cuts the inputs into
+ * line aligned chunks and hands them out through a ring of slots; workers
+ * color chunks in any order, and the shell thread writes them back in
+ * input order. The ring bounds both the read-ahead and the memory held in
+ * finished but unwritten output.
+ */
+#define HIGHLIGHT_SLOTS_PER_WORKER 4
+#define HIGHLIGHT_MAX_WORKERS 64
+
+enum chunk_state {
+    CHUNK_FREE, CHUNK_QUEUED, CHUNK_DONE
+};
+
+struct highlight_source {
+    const char *path;
+    const char *map; // mmap'd regular file, NULL when streamed
+    size_t map_size;
+    size_t chunks_left; // submitted but not yet written
+    bool produced; // every chunk has been submitted
+    size_t count;
+};
+
+struct highlight_chunk {
+    const char *data;
+    size_t size;
+    char *owned; // read buffer of a streamed input
+    struct highlight_source *source;
+    struct highlight_output out;
+    enum chunk_state state;
+};
+
+struct highlight_run {
+    const struct highlighter *h;
+    bool count_only, show_names;
+    struct highlight_chunk *slots;
+    size_t window; // slot count
+    size_t produced, claimed, written; // chunk sequence numbers
+    bool closing, failed;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    size_t total;
+};
+
+void *highlight_worker(void *arg) {
+    struct highlight_run *run = arg;
+    struct highlight_scratch scratch;
+    highlight_scratch_init(&scratch, run->h);
+    pthread_mutex_lock(&run->lock);
+    for (;;) {
+        while (run->claimed == run->produced && !run->closing)
+            pthread_cond_wait(&run->work, &run->lock);
+        if (run->claimed == run->produced)
+            break;
+        struct highlight_chunk *c = &run->slots[run->claimed++ % run->window];
+        pthread_mutex_unlock(&run->lock);
+
+        highlight_find(run->h, &scratch, c->data, c->size, &c->out);
+        c->out.length = 0;
+        if (!run->count_only)
+            highlight_render(c->data, c->size, &c->out);
+
+        pthread_mutex_lock(&run->lock);
+        c->state = CHUNK_DONE;
+        pthread_cond_broadcast(&run->done);
+    }
+    pthread_mutex_unlock(&run->lock);
+    highlight_scratch_free(&scratch, run->h);
+    return NULL;
+}
+
+/**
+ * Called once the last chunk of a source is written: print its count in
+ * -c mode and release the input
+ */
+void highlight_source_done(struct highlight_run *run, struct highlight_source *s) {
+    if (run->count_only && !run->failed) {
+        if (run->show_names)
+            dprintf(STDOUT_FILENO, "%s:%zu\n", s->path, s->count);
+        else
+            dprintf(STDOUT_FILENO, "%zu\n", s->count);
+    }
+    if (s->map)
+        munmap((void *) s->map, s->map_size);
+    free(s);
+}
+
+/**
+ * Wait for the oldest outstanding chunk and write it out
+ */
+void highlight_write_next(struct highlight_run *run) {
+    struct highlight_chunk *c = &run->slots[run->written % run->window];
+    pthread_mutex_lock(&run->lock);
+    while (c->state != CHUNK_DONE)
+        pthread_cond_wait(&run->done, &run->lock);
+    pthread_mutex_unlock(&run->lock);
+
+    if (!run->failed && c->out.length && write_all(STDOUT_FILENO, c->out.data, c->out.length) == -1)
+        run->failed = true; // EPIPE and friends: stop producing, just drain
+    run->total += c->out.match_count;
+    c->source->count += c->out.match_count;
+    if (--c->source->chunks_left == 0 && c->source->produced)
+        highlight_source_done(run, c->source);
+    free(c->owned);
+    c->owned = NULL;
+    c->state = CHUNK_FREE;
+    run->written++;
+}
+
+void highlight_drain(struct highlight_run *run) {
+    while (run->written < run->produced)
+        highlight_write_next(run);
+}
+
+/**
+ * Queue a chunk, first writing out the oldest one if the ring is full
+ * @param  owned  buffer to free once the chunk is written, or NULL
+ */
+void highlight_submit(struct highlight_run *run, struct highlight_source *s, const char *data, size_t size,
+                      char *owned) {
+    if (run->produced - run->written == run->window)
+        highlight_write_next(run);
+    struct highlight_chunk *c = &run->slots[run->produced % run->window];
+    c->data = data;
+    c->size = size;
+    c->owned = owned;
+    c->source = s;
+    c->state = CHUNK_QUEUED;
+    s->chunks_left++;
+    pthread_mutex_lock(&run->lock);
+    run->produced++;
+    pthread_cond_signal(&run->work);
+    pthread_mutex_unlock(&run->lock);
+}
+
+/**
+ * Cut a file, or stdin for "-", into chunks
+ * @return  0, or -1 with errno set if it could not be opened or read
+ */
+int highlight_produce(struct highlight_run *run, const char *path) {
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    struct highlight_source *s = calloc(1, sizeof(struct highlight_source));
+    s->path = path;
+    size_t first = run->produced;
+    struct stat st;
+    int r = fstat(fd, &st);
+    if (r == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise((void *) data, st.st_size, MADV_SEQUENTIAL);
+            s->map = data;
+            s->map_size = st.st_size;
+        }
+    }
+    if (s->map) {
+        for (size_t pos = 0, size = s->map_size; pos < size && !run->failed;) {
+            size_t n = size - pos;
+            if (n > HIGHLIGHT_SLICE) {
+                const char *nl = memchr(s->map + pos + HIGHLIGHT_SLICE, '\n', n - HIGHLIGHT_SLICE);
+                n = nl ? (size_t) (nl + 1 - (s->map + pos)) : n;
+            }
+            highlight_submit(run, s, s->map + pos, n, NULL);
+            pos += n;
+        }
+    } else if (r == 0) {
+        // pipes and terminals: ship what has arrived, up to the last newline,
+        // and carry the partial line into the next buffer
+        char *buf = malloc(HIGHLIGHT_SLICE);
+        size_t have = 0;
+        bool eof = false;
+        while (!eof && !run->failed) {
+            bool more = true;
+            while (have < HIGHLIGHT_SLICE && more) {
+                ssize_t n = read(fd, buf + have, HIGHLIGHT_SLICE - have);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0) {
+                    r = n < 0 ? -1 : 0;
+                    eof = true;
+                    break;
+                }
+                have += n;
+                struct pollfd pfd = {.fd = fd, .events = POLLIN};
+                more = poll(&pfd, 1, 0) == 1;
+            }
+            const char *nl = eof ? NULL : memrchr(buf, '\n', have);
+            size_t done = eof ? have : nl ? (size_t) (nl + 1 - buf) : have == HIGHLIGHT_SLICE ? have : 0;
+            if (done == 0)
+                continue;
+            char *next = malloc(HIGHLIGHT_SLICE);
+            memcpy(next, buf + done, have - done);
+            highlight_submit(run, s, buf, done, buf);
+            buf = next;
+            have -= done;
+            if (!eof && !more)
+                highlight_drain(run); // input is trickling in: keep the output live
+        }
+        free(buf);
+    }
+    int saved = errno;
+    if (fd != STDIN_FILENO)
+        close(fd);
+    if (run->produced == first)
+        highlight_submit(run, s, "", 0, NULL); // an empty input still gets its turn in the output
+    s->produced = true;
+    if (s->chunks_left == 0)
+        highlight_source_done(run, s);
+    errno = saved;
+    return r == 0 ? 0 : -1;
+}
+
+/**
+ * Expand the file arguments that contain glob characters; a pattern that
+ * matches nothing is kept as it is
+ */
+void highlight_glob(char **args, int count, glob_t *files) {
+    memset(files, 0, sizeof(glob_t));
+    for (int i = 0; i < count; ++i) {
+        int flags = GLOB_NOCHECK | (i ? GLOB_APPEND : 0);
+        if (!strpbrk(args[i], "*?["))
+            flags |= GLOB_NOESCAPE | GLOB_NOMAGIC;
+        glob(args[i], flags, NULL, files);
+    }
+}
+
+/**
+ * highlight [-c] [-w word color]... [-e regex color]... [word color] [file...]:
+ * copy the files (or stdin) to stdout with every whole word occurrence and
+ * every regular expression match colored; -c prints the number of matches
+ * per file instead
+ * @return  SUCCESS; last_status is 0 if anything matched, 1 if not, 2 on error
+ */
+int builtin_highlight(struct command_t *command) {
+    struct highlight_pattern *patterns = malloc(sizeof(struct highlight_pattern) * (command->arg_count / 2 + 1));
+    struct regex *regexes = malloc(sizeof(struct regex) * (command->arg_count / 3 + 1));
+    int count = 0, regex_count = 0, i = 0;
+    bool usage = false, count_only = false;
+    const char *word = NULL, *color = NULL;
+    while (i < command->arg_count && !usage) {
+        const char *arg = command->args[i];
+        if (strcmp(arg, "-c") == 0) {
+            count_only = true;
+            i++;
+            continue;
+        }
+        bool regex = strcmp(arg, "-e") == 0, positional = false;
+        if ((regex || strcmp(arg, "-w") == 0) && i + 2 < command->arg_count) {
+            word = command->args[i + 1];
+            color = command->args[i + 2];
+            i += 3;
+        } else if (count + regex_count == 0 && arg[0] != '-' && i + 1 < command->arg_count) {
+            word = arg;
+            color = command->args[i + 1];
+            i += 2;
+            positional = true;
+        } else {
+            usage = count + regex_count == 0;
+            break; // the rest are files
+        }
+        int c = highlight_color(color);
+        if (c == -1 || word[0] == '\0') {
+            usage = true;
+            break;
+        }
+        if (regex) {
+            const char *error;
+            if (regex_compile(&regexes[regex_count], word, &error) == -1) {
+                printf("-%s: %s: %s: %s\n", sysname, command->name, word, error);
+                for (int r = 0; r < regex_count; ++r)
+                    regex_free(&regexes[r]);
+                free(regexes);
+                free(patterns);
+                last_status = 2;
+                return SUCCESS;
+            }
+            regexes[regex_count++].color = c;
+            continue;
+        }
+        struct highlight_pattern *p = &patterns[count++];
+        p->text = word;
+        p->length = strlen(word);
+        p->color = c;
+        p->word_start = is_word_byte(word[0]);
+        p->word_end = is_word_byte(word[p->length - 1]);
+        if (positional)
+            break; // the rest are files
+    }
+    if (usage || count + regex_count == 0) {
+        printf("usage: highlight [-c] [-w word color]... [-e regex color]... [word color] [file...]\n"
+               "colors: red, green, blue, yellow, magenta, cyan\n");
+        for (int r = 0; r < regex_count; ++r)
+            regex_free(&regexes[r]);
+        free(regexes);
+        free(patterns);
+        last_status = 2;
+        return SUCCESS;
+    }
+
+    struct highlighter h = {.patterns = patterns, .count = count, .regexes = regexes, .regex_count = regex_count};
+    highlighter_build(&h);
+    glob_t files;
+    char *stdin_path[] = {"-"};
+    highlight_glob(i < command->arg_count ? command->args + i : stdin_path,
+                   i < command->arg_count ? command->arg_count - i : 1, &files);
+
+    int workers = online_cpus();
+    if (workers > HIGHLIGHT_MAX_WORKERS)
+        workers = HIGHLIGHT_MAX_WORKERS;
+    struct highlight_run run = {.h = &h, .count_only = count_only, .show_names = files.gl_pathc > 1};
+    run.window = (size_t) workers * HIGHLIGHT_SLOTS_PER_WORKER;
+    run.slots = calloc(run.window, sizeof(struct highlight_chunk));
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.work, NULL);
+    pthread_cond_init(&run.done, NULL);
+    pthread_t threads[HIGHLIGHT_MAX_WORKERS];
+    int started = 0;
+    while (started < workers && pthread_create(&threads[started], NULL, highlight_worker, &run) == 0)
+        started++;
+    if (started == 0) {
+        printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+        last_status = 2;
+    } else {
+        fflush(stdout);
+        last_status = 0;
+        for (size_t f = 0; f < files.gl_pathc && !run.failed; ++f) {
+            if (highlight_produce(&run, files.gl_pathv[f]) == -1) {
+                highlight_drain(&run); // keep the message in its place in the output
+                dprintf(STDOUT_FILENO, "-%s: %s: %s: %s\n", sysname, command->name, files.gl_pathv[f],
+                        strerror(errno));
+                last_status = 2;
+            }
+        }
+        highlight_drain(&run);
+        if (last_status == 0 && run.total == 0)
+            last_status = 1;
+    }
+
+    pthread_mutex_lock(&run.lock);
+    run.closing = true;
+    pthread_cond_broadcast(&run.work);
+    pthread_mutex_unlock(&run.lock);
+    for (int t = 0; t < started; ++t)
+        pthread_join(threads[t], NULL);
+    for (size_t k = 0; k < run.window; ++k) {
+        free(run.slots[k].out.data);
+        free(run.slots[k].out.matches);
+    }
+    free(run.slots);
+    pthread_mutex_destroy(&run.lock);
+    pthread_cond_destroy(&run.work);
+    pthread_cond_destroy(&run.done);
+    globfree(&files);
+    highlighter_free(&h);
+    for (int r = 0; r < regex_count; ++r)
+        regex_free(&regexes[r]);
+    free(regexes);
+    free(patterns);
+    return SUCCESS;
+}
+
+char data_dir_made[PATH_MAX]; // the data directory once created, with a trailing /
+
+/**
+ * Path of a file in the shell's data directory: $SEASHELL_HOME, else
+ * $XDG_DATA_HOME/seashell, else ~/.local/share/seashell; the directory is
+ * created the first time it is used
+ * @return  0, or -1 with errno set
+ */
+int data_path(const char *name, char *buf, size_t size) {
+    const char *home = getenv("SEASHELL_HOME"), *xdg = getenv("XDG_DATA_HOME"), *user = getenv("HOME");
+    int n;
+    if (home && *home)
+        n = snprintf(buf, size, "%s/", home);
+    else if (xdg && *xdg)
+        n = snprintf(buf, size, "%s/seashell/", xdg);
+    else if (user && *user)
+        n = snprintf(buf, size, "%s/.local/share/seashell/", user);
+    else
+        n = snprintf(buf, size, "/tmp/seashell-%d/", (int) getuid());
+    if (n < 0 || (size_t) n + strlen(name) >= size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (strcmp(buf, data_dir_made) != 0) { // first use, or the variables changed
+        for (char *p = buf + 1; *p; ++p) { // mkdir -p
+            if (*p != '/')
+                continue;
+            *p = '\0';
+            int r = mkdir(buf, 0700);
+            *p = '/';
+            if (r == -1 && errno != EEXIST)
+                return -1;
+        }
+        if ((size_t) n < sizeof(data_dir_made))
+            strcpy(data_dir_made, buf);
+    }
+    strcat(buf, name);
+    return 0;
+}
+
+/*
+ * shortdir bookmarks live in one file that is an open addressing hash
+ * table: a header, the slots, then the names and paths they point into.
+ * Lookups map the file and probe it directly. Updates take an exclusive
+ * flock on a side lock file, write a complete new table to a temporary
+ * file and rename it into place, so a reader (or a crash) only ever sees
+ * a whole table, the old one or the new one.
+ */
+#define BOOKMARK_MAGIC "SSBM0001"
+
+struct bookmark_header {
+    char magic[8];
+    uint32_t capacity; // slots, a power of two
+    uint32_t count;
+    uint64_t strings_size;
+};
+
+struct bookmark_slot {
+    uint64_t hash;
+    uint32_t name, name_length; // offsets into the strings; name_length 0 if free
+    uint32_t path, path_length;
+};
+
+struct bookmark_store {
+    const char *map; // NULL if there is no store yet
+    size_t size;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+};
+
+struct bookmark_store bookmarks;
+
+const struct bookmark_slot *bookmark_slots(const struct bookmark_store *store) {
+    return (const struct bookmark_slot *) (store->map + sizeof(struct bookmark_header));
+}
+
+const char *bookmark_strings(const struct bookmark_store *store) {
+    const struct bookmark_header *h = (const struct bookmark_header *) store->map;
+    return store->map + sizeof(struct bookmark_header) + sizeof(struct bookmark_slot) * h->capacity;
+}
+
+/**
+ * Map the current store, unless the mapping already is of it
+ * @return  0 (with store->map NULL if there is no store), or -1 with errno set
+ */
+int bookmark_open(struct bookmark_store *store) {
+    char path[PATH_MAX];
+    struct stat st;
+    if (data_path("bookmarks", path, sizeof(path)) == -1)
+        return -1;
+    if (stat(path, &st) == -1) {
+        if (errno != ENOENT)
+            return -1;
+        st.st_ino = 0;
+    }
+    if (store->map && st.st_ino == store->ino && st.st_dev == store->dev
+        && st.st_mtim.tv_sec == store->mtime.tv_sec && st.st_mtim.tv_nsec == store->mtime.tv_nsec)
+        return 0;
+    if (store->map)
+        munmap((void *) store->map, store->size);
+    store->map = NULL;
+    if (st.st_ino == 0)
+        return 0;
+
+    const char *data;
+    size_t size;
+    if (map_file(path, &data, &size) == -1)
+        return -1;
+    const struct bookmark_header *h = (const struct bookmark_header *) data;
+    if (size < sizeof(struct bookmark_header) || memcmp(h->magic, BOOKMARK_MAGIC, 8) != 0
+        || (h->capacity & (h->capacity - 1)) != 0
+        || size != sizeof(struct bookmark_header) + sizeof(struct bookmark_slot) * (size_t) h->capacity
+                   + h->strings_size) {
+        unmap_file(data, size);
+        errno = EINVAL;
+        return -1;
+    }
+    store->map = data;
+    store->size = size;
+    store->dev = st.st_dev;
+    store->ino = st.st_ino;
+    store->mtime = st.st_mtim;
+    return 0;
+}
+
+/**
+ * Look a bookmark up
+ * @return  the slot, or NULL
+ */
+const struct bookmark_slot *bookmark_find(const struct bookmark_store *store, const char *name) {
+    if (!store->map)
+        return NULL;
+    const struct bookmark_header *h = (const struct bookmark_header *) store->map;
+    const struct bookmark_slot *slots = bookmark_slots(store);
+    const char *strings = bookmark_strings(store);
+    size_t length = strlen(name);
+    uint64_t hash = hash64(name, length, 0);
+    for (uint32_t i = hash & (h->capacity - 1);; i = (i + 1) & (h->capacity - 1)) {
+        if (slots[i].name_length == 0)
+            return NULL;
+        if (slots[i].hash == hash && slots[i].name_length == length
+            && memcmp(strings + slots[i].name, name, length) == 0)
+            return &slots[i];
+    }
+}
+
+/**
+ * Rewrite the store with name set to path, or removed if path is NULL, or
+ * emptied if name is NULL too
+ * @return  0, 1 if the bookmark to remove is not there, or -1 with errno set
+ */
+int bookmark_update(const char *name, const char *path) {
+    char file[PATH_MAX], lock[PATH_MAX], temp[PATH_MAX];
+    if (data_path("bookmarks", file, sizeof(file)) == -1 || data_path("bookmarks.lock", lock, sizeof(lock)) == -1
+        || data_path("bookmarks.XXXXXX", temp, sizeof(temp)) == -1)
+        return -1;
+    int lock_fd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lock_fd == -1)
+        return -1;
+    while (flock(lock_fd, LOCK_EX) == -1)
+        if (errno != EINTR) {
+            close(lock_fd);
+            return -1;
+        }
+
+    // the table as it is now that no one else can change it
+    int r = bookmark_open(&bookmarks);
+    if (!name)
+        r = 0; // clearing replaces even a damaged store
+    if (r == 0 && name && !path && !bookmark_find(&bookmarks, name)) {
+        close(lock_fd);
+        return 1; // nothing to rewrite
+    }
+    const struct bookmark_header *old = bookmarks.map ? (const struct bookmark_header *) bookmarks.map : NULL;
+    uint32_t count = old && name ? old->count : 0, capacity = 16;
+    size_t strings_size = old && name ? old->strings_size : 0;
+    if (path) {
+        count++;
+        strings_size += strlen(name) + strlen(path);
+    }
+    while (capacity < count * 2)
+        capacity *= 2;
+
+    size_t size = sizeof(struct bookmark_header) + sizeof(struct bookmark_slot) * (size_t) capacity + strings_size;
+    char *table = calloc(1, size);
+    struct bookmark_header *h = (struct bookmark_header *) table;
+    struct bookmark_slot *slots = (struct bookmark_slot *) (table + sizeof(struct bookmark_header));
+    char *strings = (char *) (slots + capacity);
+    size_t used = 0;
+    memcpy(h->magic, BOOKMARK_MAGIC, 8);
+    h->capacity = capacity;
+
+    // insert each entry once: the new one first, then the old ones it does not replace
+    uint32_t old_count = old && name ? old->capacity : 0;
+    for (long i = path ? -1 : 0; r == 0 && i < (long) old_count; ++i) {
+        const char *n = name, *p = path;
+        size_t nl, pl;
+        if (i == -1) {
+            nl = strlen(name);
+            pl = strlen(path);
+        } else {
+            const struct bookmark_slot *s = &bookmark_slots(&bookmarks)[i];
+            if (s->name_length == 0)
+                continue;
+            n = bookmark_strings(&bookmarks) + s->name;
+            p = bookmark_strings(&bookmarks) + s->path;
+            nl = s->name_length;
+            pl = s->path_length;
+            if (nl == strlen(name) && memcmp(n, name, nl) == 0)
+                continue;
+        }
+        uint64_t hash = hash64(n, nl, 0);
+        uint32_t k = hash & (capacity - 1);
+        while (slots[k].name_length)
+            k = (k + 1) & (capacity - 1);
+        slots[k] = (struct bookmark_slot) {hash, used, nl, used + nl, pl};
+        memcpy(strings + used, n, nl);
+        memcpy(strings + used + nl, p, pl);
+        used += nl + pl;
+        h->count++;
+    }
+    h->strings_size = used;
+    size = sizeof(struct bookmark_header) + sizeof(struct bookmark_slot) * (size_t) capacity + used;
+
+    int fd = r == 0 ? mkstemp(temp) : -1;
+    if (fd == -1 || write_all(fd, table, size) == -1 || fsync(fd) == -1 || rename(temp, file) == -1)
+        r = -1;
+    int saved = errno;
+    if (fd != -1) {
+        close(fd);
+        if (r == -1)
+            unlink(temp);
+    }
+    free(table);
+    close(lock_fd); // releases the lock
+    errno = saved;
+    return r;
+}
+
+/*
+ * A set of distinct strings with a trigram index over their lower cased
+ * bytes, so substring lookups only look at the strings that hold every
+ * trigram of what is searched for. Used for visited directories and for
+ * command history.
+ */
+struct trigram_list {
+    uint32_t key; // three lower cased bytes, plus one so 0 is free
+    uint32_t count, capacity;
+    uint32_t *ids; // increasing string ids
+};
+
+struct indexed_string {
+    char *text;
+    size_t length;
+    double value; // up to the user: a score, a line number
+};
+
+struct string_index {
+    struct indexed_string *items;
+    size_t count, capacity;
+    uint32_t *table; // text hash -> id + 1
+    size_t table_size;
+    struct trigram_list *trigrams;
+    size_t trigram_count, trigram_size;
+};
+
+unsigned char lower_byte(unsigned char c) {
+    return c >= 'A' && c <= 'Z' ? c + 32 : c;
+}
+
+uint32_t trigram_key(const char *p) {
+    return ((uint32_t) lower_byte(p[0]) << 16 | (uint32_t) lower_byte(p[1]) << 8 | lower_byte(p[2])) + 1;
+}
+
+struct trigram_list *trigram_find(struct string_index *idx, uint32_t key, bool add) {
+    if (add && (idx->trigram_count + 1) * 2 > idx->trigram_size) {
+        size_t size = idx->trigram_size ? idx->trigram_size * 2 : 1024;
+        struct trigram_list *grown = calloc(size, sizeof(struct trigram_list));
+        for (size_t i = 0; i < idx->trigram_size; ++i) {
+            if (!idx->trigrams[i].key)
+                continue;
+            size_t k = hash64(&idx->trigrams[i].key, 4, 0) & (size - 1);
+            while (grown[k].key)
+                k = (k + 1) & (size - 1);
+            grown[k] = idx->trigrams[i];
+        }
+        free(idx->trigrams);
+        idx->trigrams = grown;
+        idx->trigram_size = size;
+    }
+    if (!idx->trigram_size)
+        return NULL;
+    size_t k = hash64(&key, 4, 0) & (idx->trigram_size - 1);
+    while (idx->trigrams[k].key && idx->trigrams[k].key != key)
+        k = (k + 1) & (idx->trigram_size - 1);
+    if (!idx->trigrams[k].key) {
+        if (!add)
+            return NULL;
+        idx->trigrams[k].key = key;
+        idx->trigram_count++;
+    }
+    return &idx->trigrams[k];
+}
+
+/**
+ * Id of a string, adding it (and its trigrams) if it is new
+ */
+uint32_t string_intern(struct string_index *idx, const char *text, size_t length) {
+    if ((idx->count + 1) * 2 > idx->table_size) {
+        idx->table_size = idx->table_size ? idx->table_size * 2 : 1024;
+        free(idx->table);
+        idx->table = calloc(idx->table_size, sizeof(uint32_t));
+        for (size_t i = 0; i < idx->count; ++i) {
+            size_t k = hash64(idx->items[i].text, idx->items[i].length, 0) & (idx->table_size - 1);
+            while (idx->table[k])
+                k = (k + 1) & (idx->table_size - 1);
+            idx->table[k] = i + 1;
+        }
+    }
+    size_t k = hash64(text, length, 0) & (idx->table_size - 1);
+    for (; idx->table[k]; k = (k + 1) & (idx->table_size - 1)) {
+        struct indexed_string *s = &idx->items[idx->table[k] - 1];
+        if (s->length == length && memcmp(s->text, text, length) == 0)
+            return idx->table[k] - 1;
+    }
+    if (idx->count == idx->capacity) {
+        idx->capacity = idx->capacity ? idx->capacity * 2 : 256;
+        idx->items = realloc(idx->items, sizeof(struct indexed_string) * idx->capacity);
+    }
+    uint32_t id = idx->count++;
+    idx->items[id] = (struct indexed_string) {strndup(text, length), length, 0};
+    idx->table[k] = id + 1;
+    for (size_t i = 0; i + 3 <= length; ++i) {
+        struct trigram_list *t = trigram_find(idx, trigram_key(text + i), true);
+        if (t->count && t->ids[t->count - 1] == id)
+            continue;
+        if (t->count == t->capacity) {
+            t->capacity = t->capacity ? t->capacity * 2 : 4;
+            t->ids = realloc(t->ids, sizeof(uint32_t) * t->capacity);
+        }
+        t->ids[t->count++] = id;
+    }
+    return id;
+}
+
+void string_index_free(struct string_index *idx) {
+    for (size_t i = 0; i < idx->count; ++i)
+        free(idx->items[i].text);
+    for (size_t i = 0; i < idx->trigram_size; ++i)
+        free(idx->trigrams[i].ids);
+    free(idx->items);
+    free(idx->table);
+    free(idx->trigrams);
+    memset(idx, 0, sizeof(struct string_index));
+}
+
+int compare_trigram_lists(const void *a, const void *b) {
+    const struct trigram_list *x = *(struct trigram_list *const *) a, *y = *(struct trigram_list *const *) b;
+    return x->count < y->count ? -1 : x->count > y->count;
+}
+
+/**
+ * Ids of the strings that may contain every fragment: those holding all of
+ * their trigrams, or every string if the fragments are too short to have any
+ * @param  fragments  lower cased in place
+ * @return            the ids (to free), *total of them
+ */
+uint32_t *string_candidates(struct string_index *idx, char **fragments, int count, size_t *total) {
+    size_t list_count = 0;
+    for (int i = 0; i < count; ++i)
+        list_count += strlen(fragments[i]) >= 3 ? strlen(fragments[i]) - 2 : 0;
+    struct trigram_list **lists = malloc(sizeof(struct trigram_list *) * (list_count + 1));
+    list_count = 0;
+    *total = 0;
+    for (int i = 0; i < count; ++i) {
+        for (char *c = fragments[i]; *c; ++c)
+            *c = lower_byte(*c);
+        for (size_t k = 0; k + 3 <= strlen(fragments[i]); ++k) {
+            struct trigram_list *t = trigram_find(idx, trigram_key(fragments[i] + k), false);
+            if (!t) {
+                free(lists);
+                return malloc(sizeof(uint32_t));
+            }
+            lists[list_count++] = t;
+        }
+    }
+    // rarest first, intersecting in place until few are left
+    qsort(lists, list_count, sizeof(struct trigram_list *), compare_trigram_lists);
+    size_t n = list_count ? lists[0]->count : idx->count;
+    uint32_t *ids = malloc(sizeof(uint32_t) * (n + 1));
+    for (size_t i = 0; i < n; ++i)
+        ids[i] = list_count ? lists[0]->ids[i] : i;
+    for (size_t l = 1; l < list_count && n > 16; ++l) {
+        size_t kept = 0, j = 0;
+        for (size_t i = 0; i < n; ++i) {
+            while (j < lists[l]->count && lists[l]->ids[j] < ids[i])
+                j++;
+            if (j < lists[l]->count && lists[l]->ids[j] == ids[i])
+                ids[kept++] = ids[i];
+        }
+        n = kept;
+    }
+    free(lists);
+    *total = n;
+    return ids;
+}
+
+/**
+ * Case insensitive search for a lower cased needle
+ */
+const char *find_folded(const char *hay, size_t hay_length, const char *needle, size_t length) {
+    for (size_t i = 0; i + length <= hay_length; ++i) {
+        size_t k = 0;
+        while (k < length && lower_byte(hay[i + k]) == (unsigned char) needle[k])
+            k++;
+        if (k == length)
+            return hay + i;
+    }
+    return NULL;
+}
+
+/**
+ * Take a shared (to append) or exclusive (to rewrite) flock on a lock file
+ * in the data directory
+ * @return  the lock fd, or -1
+ */
+int data_lock(const char *name, int how) {
+    char lock[PATH_MAX];
+    if (data_path(name, lock, sizeof(lock)) == -1)
+        return -1;
+    int fd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return -1;
+    while (flock(fd, how) == -1)
+        if (errno != EINTR) {
+            close(fd);
+            return -1;
+        }
+    return fd;
+}
+
+/**
+ * Append one line to a file in the data directory with a single O_APPEND
+ * write, so lines from concurrent sessions never interleave
+ * @param  lock  lock file to hold shared while appending, or NULL
+ */
+void data_append(const char *name, const char *lock, const char *line, size_t length) {
+    char file[PATH_MAX];
+    if (data_path(name, file, sizeof(file)) == -1)
+        return;
+    int lock_fd = lock ? data_lock(lock, LOCK_SH) : -1;
+    int fd = open(file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd != -1) {
+        write_all(fd, line, length);
+        close(fd);
+    }
+    if (lock_fd != -1)
+        close(lock_fd);
+}
+
+/**
+ * Call fn on each complete line of a data file from *offset on, advancing
+ * *offset past them; a file that was replaced since (other inode, or
+ * shorter) is read from the start after calling reset
+ * @return  0, or -1 with errno set; a missing file counts as empty
+ */
+int data_read_lines(const char *name, off_t *offset, dev_t *dev, ino_t *ino, void (*reset)(void *),
+                    void (*fn)(void *, const char *, size_t), void *arg) {
+    char file[PATH_MAX];
+    if (data_path(name, file, sizeof(file)) == -1)
+        return -1;
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno != ENOENT)
+            return -1;
+        reset(arg);
+        *offset = 0;
+        *dev = 0;
+        *ino = 0;
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_ino != *ino || st.st_dev != *dev || st.st_size < *offset) {
+        reset(arg);
+        *offset = 0;
+        *dev = st.st_dev;
+        *ino = st.st_ino;
+    }
+    char *buf = malloc(PIPELINE_CHUNK);
+    size_t have = 0;
+    ssize_t n;
+    while ((n = pread(fd, buf + have, PIPELINE_CHUNK - have, *offset + have)) > 0) {
+        have += n;
+        char *p = buf, *end = buf + have, *nl;
+        while ((nl = memchr(p, '\n', end - p))) {
+            fn(arg, p, nl - p);
+            p = nl + 1;
+        }
+        if (p == buf && have == PIPELINE_CHUNK) // an absurdly long line: skip it
+            p = end;
+        *offset += p - buf;
+        have = end - p;
+        memmove(buf, p, have);
+    }
+    free(buf);
+    close(fd);
+    return 0;
+}
+
+/*
+ * Directory visits. Every successful cd or jump appends "time weight path"
+ * to a log shared by all sessions. A session reads the log only when it
+ * first needs it, and after that only what other sessions appended since,
+ * folding each line into a frecency score: the sum of the visit weights,
+ * halved for every week of age. Scores are kept relative to a base time,
+ * so a visit is a single multiply-add. Once the log holds many more lines
+ * than paths it is compacted to one line per path, and the paths that have
+ * decayed away are dropped.
+ */
+#define VISIT_HALF_LIFE (7 * 24 * 3600.0)
+#define VISIT_MIN_SCORE 0.02 // dropped at compaction
+#define VISIT_COMPACT_LINES 4096 // plus two per known path
+
+struct visit_index {
+    struct string_index paths; // value: score relative to base
+    time_t base;
+    off_t offset; // of the log read so far
+    dev_t dev;
+    ino_t ino;
+    size_t lines;
+};
+
+struct visit_index visits;
+
+/**
+ * 2^x to about four digits, which is plenty for ranking (and keeps libm out)
+ */
+double decay_pow2(double x) {
+    if (x < -1000)
+        return 0;
+    if (x > 1000)
+        x = 1000;
+    long n = (long) x;
+    if (n > x)
+        n--;
+    double f = x - n, r = 1 + f * (0.6931472 + f * (0.2402265 + f * (0.0555041 + f * (0.0096181 + f * 0.0013334))));
+    union {
+        uint64_t bits;
+        double value;
+    } scale = {.bits = (uint64_t) (n + 1023) << 52};
+    return r * scale.value;
+}
+
+void visit_add(struct visit_index *idx, time_t when, double weight, const char *path, size_t length) {
+    if (idx->paths.count == 0 && idx->base == 0)
+        idx->base = when;
+    double age = (when - idx->base) / VISIT_HALF_LIFE;
+    if (age > 256 || age < -256) { // keep the relative scores in range
+        double scale = decay_pow2(-age);
+        for (size_t i = 0; i < idx->paths.count; ++i)
+            idx->paths.items[i].value *= scale;
+        idx->base = when;
+        age = 0;
+    }
+    uint32_t id = string_intern(&idx->paths, path, length); // may move idx->paths.items
+    idx->paths.items[id].value += weight * decay_pow2(age);
+}
+
+/**
+ * Score of a path as of now
+ */
+double visit_score(const struct visit_index *idx, uint32_t id, time_t now) {
+    return idx->paths.items[id].value * decay_pow2((idx->base - now) / VISIT_HALF_LIFE);
+}
+
+void visit_reset(void *arg) {
+    struct visit_index *idx = arg;
+    string_index_free(&idx->paths);
+    idx->base = 0;
+    idx->lines = 0;
+}
+
+void visit_line(void *arg, const char *line, size_t length) {
+    struct visit_index *idx = arg;
+    const char *end = line + length;
+    char *q;
+    long long when = strtoll(line, &q, 10);
+    double weight = q < end && *q == ' ' ? strtod(q + 1, &q) : 0;
+    if (q < end && *q == ' ' && q + 1 < end && weight > 0)
+        visit_add(idx, when, weight, q + 1, end - (q + 1));
+    idx->lines++;
+}
+
+/**
+ * Append a visit of path to the log
+ */
+void visit_record(const char *path) {
+    char line[PATH_MAX + 64];
+    int n = snprintf(line, sizeof(line), "%lld 1 %s\n", (long long) time(NULL), path);
+    if (n > 0 && (size_t) n < sizeof(line) && !strchr(path, '\n'))
+        data_append("visits", "visits.lock", line, n);
+}
+
+/**
+ * Fold the lines appended to the log since the last call into the index
+ */
+int visit_read(struct visit_index *idx) {
+    return data_read_lines("visits", &idx->offset, &idx->dev, &idx->ino, visit_reset, visit_line, idx);
+}
+
+/**
+ * Rewrite the log with one line per path, leaving out decayed paths
+ */
+void visit_compact(struct visit_index *idx) {
+    char file[PATH_MAX], temp[PATH_MAX];
+    if (data_path("visits", file, sizeof(file)) == -1 || data_path("visits.XXXXXX", temp, sizeof(temp)) == -1)
+        return;
+    int lock = data_lock("visits.lock", LOCK_EX);
+    if (lock == -1)
+        return;
+    int fd = -1;
+    if (visit_read(idx) == 0 && (fd = mkstemp(temp)) != -1) { // with the lock held nothing is appended now
+        FILE *out = fdopen(fd, "w");
+        time_t now = time(NULL);
+        for (size_t i = 0; i < idx->paths.count; ++i) {
+            double score = visit_score(idx, i, now);
+            if (score >= VISIT_MIN_SCORE)
+                fprintf(out, "%lld %.4g %s\n", (long long) now, score, idx->paths.items[i].text);
+        }
+        if (fflush(out) == 0 && fsync(fd) == 0 && rename(temp, file) == 0)
+            temp[0] = '\0';
+        fclose(out);
+        if (temp[0])
+            unlink(temp);
+    }
+    close(lock);
+    visit_read(idx); // the new file: start over from it
+}
+
+/**
+ * Does the path contain the fragments in order, the last one in its final component?
+ */
+bool visit_matches(const struct indexed_string *v, char **fragments, int count) {
+    const char *p = v->text, *end = v->text + v->length, *base = memrchr(v->text, '/', v->length);
+    base = base && base + 1 < end ? base + 1 : v->text;
+    for (int i = 0; i < count; ++i) {
+        size_t length = strlen(fragments[i]);
+        if (i == count - 1 && p < base)
+            p = base;
+        const char *q = find_folded(p, end - p, fragments[i], length);
+        if (!q)
+            return false;
+        p = q + length;
+    }
+    return true;
+}
+
+struct visit_candidate {
+    double score;
+    uint32_t id;
+};
+
+/**
+ * The highest scoring existing directory matching the fragments, other
+ * than the current one unless it is the only match
+ * @return  the path (owned by the index), or NULL
+ */
+const char *visit_best(struct visit_index *idx, char **fragments, int count) {
+    if (visit_read(idx) == -1)
+        return NULL;
+    if (idx->lines > VISIT_COMPACT_LINES + 2 * idx->paths.count)
+        visit_compact(idx);
+
+    char **folded = malloc(sizeof(char *) * count); // the caller's fragments are left as typed
+    for (int i = 0; i < count; ++i)
+        folded[i] = strdup(fragments[i]);
+    size_t total, found = 0;
+    uint32_t *ids = string_candidates(&idx->paths, folded, count, &total);
+    struct visit_candidate *matches = malloc(sizeof(struct visit_candidate) * (total + 1));
+    time_t now = time(NULL);
+    for (size_t i = 0; i < total; ++i)
+        if (visit_matches(&idx->paths.items[ids[i]], folded, count))
+            matches[found++] = (struct visit_candidate) {visit_score(idx, ids[i], now), ids[i]};
+    free(ids);
+    for (int i = 0; i < count; ++i)
+        free(folded[i]);
+    free(folded);
+
+    // best first; drop the ones that are gone
+    char *cwd = getcwd(NULL, 0);
+    const char *best = NULL, *here = NULL;
+    while (found > 0 && !best) {
+        size_t top = 0;
+        for (size_t i = 1; i < found; ++i) {
+            const struct visit_candidate *x = &matches[i], *y = &matches[top];
+            if (x->score > y->score
+                || (x->score == y->score && idx->paths.items[x->id].length < idx->paths.items[y->id].length))
+                top = i;
+        }
+        const char *path = idx->paths.items[matches[top].id].text;
+        matches[top] = matches[--found];
+        struct stat st;
+        if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+            continue;
+        if (cwd && strcmp(cwd, path) == 0)
+            here = path;
+        else
+            best = path;
+    }
+    free(cwd);
+    free(matches);
+    return best ? best : here;
+}
+
+/**
+ * chdir, recording the visit
+ * @return  0, or -1 with errno set
+ */
+int change_directory(const char *path) {
+    if (chdir(path) == -1)
+        return -1;
+    char *cwd = getcwd(NULL, 0);
+    if (cwd)
+        visit_record(cwd);
+    prompt_set_cwd(cwd);
+    free(cwd);
+    return 0;
+}
+
+/*
+ * Command history. The session keeps its most recent lines in a ring (a
+ * struct Queue) for the up and down keys, filled at startup from the tail
+ * of the history file: one read, however long the file has grown. Each
+ * line entered goes into the ring and is appended to the file, which all
+ * sessions share. Ctrl-R searches the whole file through a string index of
+ * its distinct lines, each remembering the number of its latest use; the
+ * index is built by the first search and afterwards only reads what was
+ * appended since.
+ */
+#define HISTORY_SIZE 1000
+#define HISTORY_TAIL (256 * 1024)
+
+struct history_index {
+    struct string_index lines; // value: line number of the latest use
+    off_t offset;
+    dev_t dev;
+    ino_t ino;
+    uint64_t count;
+};
+
+struct Queue *history_ring;
+struct history_index history;
+
+void history_remember(const char *line, size_t length) {
+    if (isFull(history_ring))
+        free(dequeue(history_ring));
+    enqueue(history_ring, strndup(line, length));
+}
+
+/**
+ * Set up the ring with the last lines of the history file
+ */
+void history_init() {
+    char file[PATH_MAX];
+    history_ring = createQueue(HISTORY_SIZE);
+    if (data_path("history", file, sizeof(file)) == -1)
+        return;
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+    off_t start = st.st_size > HISTORY_TAIL ? st.st_size - HISTORY_TAIL : 0;
+    char *buf = malloc(HISTORY_TAIL);
+    ssize_t n = pread(fd, buf, st.st_size - start, start);
+    close(fd);
+    char *p = buf, *end = buf + (n > 0 ? n : 0), *nl;
+    if (start > 0 && (nl = memchr(p, '\n', end - p))) // skip the partial first line
+        p = nl + 1;
+    for (; (nl = memchr(p, '\n', end - p)); p = nl + 1)
+        if (nl > p)
+            history_remember(p, nl - p);
+    free(buf);
+}
+
+int history_count() {
+    return history_ring ? history_ring->size : 0;
+}
+
+/**
+ * Entry i of the ring, 0 being the oldest
+ */
+const char *history_at(int i) {
+    return queue_at(history_ring, i);
+}
+
+/**
+ * Remember a line entered at the prompt, unless it is blank or repeats the last one
+ */
+void history_add(const char *line) {
+    size_t length = strlen(line);
+    if (!history_ring || strspn(line, " \t") == length || strchr(line, '\n')
+        || (history_count() > 0 && strcmp(rear(history_ring), line) == 0))
+        return;
+    history_remember(line, length);
+    char *record = malloc(length + 1);
+    memcpy(record, line, length);
+    record[length] = '\n';
+    data_append("history", NULL, record, length + 1);
+    free(record);
+}
+
+void history_reset(void *arg) {
+    struct history_index *h = arg;
+    string_index_free(&h->lines);
+    h->count = 0;
+}
+
+void history_line(void *arg, const char *line, size_t length) {
+    struct history_index *h = arg;
+    h->count++;
+    if (length == 0)
+        return;
+    uint32_t id = string_intern(&h->lines, line, length);
+    h->lines.items[id].value = h->count;
+}
+
+/**
+ * Latest history line containing query (case insensitively) that was last
+ * used before line number before
+ * @param  found  set to the line number of the match
+ * @return        the line, owned by the index, or NULL
+ */
+const char *history_search(const char *query, uint64_t before, uint64_t *found) {
+    data_read_lines("history", &history.offset, &history.dev, &history.ino, history_reset, history_line, &history);
+    char *folded = strdup(query);
+    size_t total, length = strlen(query);
+    uint32_t *ids = string_candidates(&history.lines, &folded, 1, &total);
+    const struct indexed_string *best = NULL;
+    for (size_t i = 0; i < total; ++i) {
+        const struct indexed_string *s = &history.lines.items[ids[i]];
+        if (s->value < before && (!best || s->value > best->value) && find_folded(s->text, s->length, folded, length))
+            best = s;
+    }
+    free(ids);
+    free(folded);
+    if (!best)
+        return NULL;
+    *found = best->value;
+    return best->text;
+}
+
+int compare_bookmarks(const void *a, const void *b) {
+    const struct bookmark_slot *x = *(const struct bookmark_slot **) a, *y = *(const struct bookmark_slot **) b;
+    const char *strings = bookmark_strings(&bookmarks);
+    size_t n = x->name_length < y->name_length ? x->name_length : y->name_length;
+    int c = memcmp(strings + x->name, strings + y->name, n);
+    return c ? c : (int) x->name_length - (int) y->name_length;
+}
+
+/**
+ * shortdir set|del|jump name, shortdir list|clear: named directory bookmarks;
+ * shortdir jump fragment... goes to the most frecent visited directory
+ * whose path contains the fragments in order
+ */
+int builtin_shortdir(struct command_t *command) {
+    const char *op = command->arg_count > 0 ? command->args[0] : "";
+    const char *name = command->arg_count > 1 ? command->args[1] : NULL;
+    bool named = strcmp(op, "set") == 0 || strcmp(op, "del") == 0 || strcmp(op, "jump") == 0;
+    if ((named && (!name || !*name || (command->arg_count > 2 && strcmp(op, "jump") != 0)))
+        || (!named && (command->arg_count != 1 || (strcmp(op, "list") != 0 && strcmp(op, "clear") != 0)))) {
+        printf("usage: shortdir set|del name\n"
+               "       shortdir jump name | fragment...\n"
+               "       shortdir list|clear\n");
+        last_status = 2;
+        return SUCCESS;
+    }
+    last_status = 0;
+
+    if (strcmp(op, "set") == 0 || strcmp(op, "del") == 0 || strcmp(op, "clear") == 0) {
+        char *cwd = strcmp(op, "set") == 0 ? getcwd(NULL, 0) : NULL;
+        int r = strcmp(op, "set") == 0 && !cwd ? -1 : bookmark_update(name, cwd);
+        if (r == -1)
+            printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+        else if (r == 1)
+            printf("-%s: %s: %s: no such bookmark\n", sysname, command->name, name);
+        last_status = r != 0;
+        free(cwd);
+        return SUCCESS;
+    }
+
+    if (bookmark_open(&bookmarks) == -1) {
+        printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+        last_status = 1;
+        return SUCCESS;
+    }
+    if (strcmp(op, "list") == 0) {
+        if (!bookmarks.map)
+            return SUCCESS;
+        const struct bookmark_header *h = (const struct bookmark_header *) bookmarks.map;
+        const struct bookmark_slot **sorted = malloc(sizeof(struct bookmark_slot *) * (h->count + 1));
+        size_t n = 0;
+        for (uint32_t i = 0; i < h->capacity; ++i)
+            if (bookmark_slots(&bookmarks)[i].name_length)
+                sorted[n++] = &bookmark_slots(&bookmarks)[i];
+        qsort(sorted, n, sizeof(struct bookmark_slot *), compare_bookmarks);
+        const char *strings = bookmark_strings(&bookmarks);
+        for (size_t i = 0; i < n; ++i)
+            printf("Name-Directory: %.*s %.*s\n", (int) sorted[i]->name_length, strings + sorted[i]->name,
+                   (int) sorted[i]->path_length, strings + sorted[i]->path);
+        free(sorted);
+        return SUCCESS;
+    }
+
+    // a bookmark by name, else the most frecent visited directory matching the fragments
+    const struct bookmark_slot *s = command->arg_count == 2 ? bookmark_find(&bookmarks, name) : NULL;
+    char *dir = s ? strndup(bookmark_strings(&bookmarks) + s->path, s->path_length) : NULL;
+    if (!s) {
+        const char *best = visit_best(&visits, command->args + 1, command->arg_count - 1);
+        if (!best) {
+            printf("-%s: %s: %s: no such bookmark or visited directory\n", sysname, command->name, name);
+            last_status = 1;
+            return SUCCESS;
+        }
+        dir = strdup(best);
+        printf("%s\n", dir);
+    }
+    if (change_directory(dir) == -1) {
+        printf("-%s: %s: %s: %s\n", sysname, command->name, dir, strerror(errno));
+        last_status = 1;
+    }
+    free(dir);
+    return SUCCESS;
+}
+
+/*
+ * Tab completion. The word before the cursor is completed from a sorted
+ * list of names: the builtins and the files in the $PATH directories for a
+ * command name, the entries of a directory for a file name, subcommands,
+ * options or bookmark names after the builtins that take them. In a sorted
+ * list the names starting with a prefix are one range, found with two
+ * binary searches, and the prefix they all share is the one shared by the
+ * first and the last of them. The command list is sorted again only after
+ * the PATH table was rebuilt. Directories are read with getdents64 and
+ * their listings kept for a few directories, until their mtime changes.
+ */
+#define COMPLETE_DIRS 8 // directory listings kept
+#define COMPLETE_LIST_MAX 256 // candidates shown at most
+#define COMPLETE_DENTS (256 * 1024)
+
+/*
+ * Names with their d_type, packed as type byte, name, NUL; names points
+ * just past each type byte once the list is finished
+ */
+struct name_list {
+    char *strings;
+    size_t size, capacity;
+    char **names;
+    size_t count, names_capacity;
+};
+
+struct dir_listing {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct name_list list;
+    unsigned long used;
+};
+
+// what getdents64 fills its buffer with
+struct dirent_record {
+    uint64_t ino;
+    int64_t off;
+    unsigned short reclen;
+    unsigned char type;
+    char name[];
+};
+
+struct name_list command_names;
+unsigned long command_names_generation, command_names_plugins;
+struct dir_listing dir_listings[COMPLETE_DIRS];
+unsigned long dir_listings_used;
+
+const char *complete_options[][2] = {
+    {"kdiff", "-a -b -c -r -l -s -q -m"},
+    {"highlight", "-c -w -e"},
+    {"hash", "-r"},
+    {NULL, NULL}
+};
+
+void name_list_add(struct name_list *l, const char *name, size_t length, unsigned char type) {
+    if (l->size + length + 2 > l->capacity) {
+        l->capacity = (l->size + length + 2) * 2;
+        l->strings = realloc(l->strings, l->capacity);
+    }
+    if (l->count == l->names_capacity) {
+        l->names_capacity = l->names_capacity ? l->names_capacity * 2 : 256;
+        l->names = realloc(l->names, sizeof(char *) * l->names_capacity);
+    }
+    l->names[l->count++] = (char *) (uintptr_t) (l->size + 1); // an offset until the list is finished
+    l->strings[l->size] = type;
+    memcpy(l->strings + l->size + 1, name, length);
+    l->strings[l->size + 1 + length] = 0;
+    l->size += length + 2;
+}
+
+int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/**
+ * Sort the names, dropping duplicates (the first one added is kept)
+ */
+void name_list_finish(struct name_list *l) {
+    for (size_t i = 0; i < l->count; ++i)
+        l->names[i] = l->strings + (uintptr_t) l->names[i];
+    if (l->count == 0)
+        return;
+    qsort(l->names, l->count, sizeof(char *), compare_names);
+    size_t kept = 1;
+    for (size_t i = 1; i < l->count; ++i) {
+        if (strcmp(l->names[i], l->names[kept - 1]) != 0)
+            l->names[kept++] = l->names[i];
+        else if (l->names[i] < l->names[kept - 1]) // added earlier
+            l->names[kept - 1] = l->names[i];
+    }
+    l->count = kept;
+}
+
+void name_list_free(struct name_list *l) {
+    free(l->strings);
+    free(l->names);
+    memset(l, 0, sizeof(struct name_list));
+}
+
+/**
+ * The range of names that start with prefix
+ */
+void name_list_range(const struct name_list *l, const char *prefix, size_t *lo, size_t *hi) {
+    size_t length = strlen(prefix), a = 0, b = l->count;
+    while (a < b) {
+        size_t m = a + (b - a) / 2;
+        if (strcmp(l->names[m], prefix) < 0)
+            a = m + 1;
+        else
+            b = m;
+    }
+    *lo = a;
+    b = l->count;
+    while (a < b) {
+        size_t m = a + (b - a) / 2;
+        if (strncmp(l->names[m], prefix, length) == 0)
+            a = m + 1;
+        else
+            b = m;
+    }
+    *hi = a;
+}
+
+/**
+ * Builtins and everything in the $PATH directories
+ */
+struct name_list *complete_commands() {
+    if (path_cache_stale(false))
+        path_cache_build();
+    if (command_names.names && command_names_generation == path_cache_generation
+        && command_names_plugins == plugins.generation)
+        return &command_names;
+    name_list_free(&command_names);
+    const char *name;
+    for (size_t i = 0; (name = builtin_name(i)); ++i)
+        name_list_add(&command_names, name, strlen(name), DT_REG);
+    for (unsigned i = 0; i < path_cache.capacity; ++i)
+        if (path_cache.slots[i].name && path_cache.slots[i].name[0] && path_cache.slots[i].state >= 0)
+            name_list_add(&command_names, path_cache.slots[i].name, strlen(path_cache.slots[i].name), DT_REG);
+    name_list_finish(&command_names);
+    command_names_generation = path_cache_generation;
+    command_names_plugins = plugins.generation;
+    return &command_names;
+}
+
+/**
+ * Add the entries of an open directory but . and .. to a list
+ */
+void name_list_read_dir(struct name_list *l, int fd) {
+    char *buf = malloc(COMPLETE_DENTS);
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buf, COMPLETE_DENTS)) > 0) {
+        for (long p = 0; p < n; p += ((struct dirent_record *) (buf + p))->reclen) {
+            struct dirent_record *e = (struct dirent_record *) (buf + p);
+            if (strcmp(e->name, ".") != 0 && strcmp(e->name, "..") != 0)
+                name_list_add(l, e->name, strlen(e->name), e->type);
+        }
+    }
+    free(buf);
+}
+
+/**
+ * The entries of a directory, read again only if it changed
+ * @return  the listing, or NULL if the directory cannot be read
+ */
+struct name_list *complete_directory(const char *path) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1)
+        return NULL;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return NULL;
+    }
+    struct dir_listing *d = NULL, *oldest = &dir_listings[0];
+    for (int i = 0; i < COMPLETE_DIRS && !d; ++i) {
+        if (dir_listings[i].used && dir_listings[i].dev == st.st_dev && dir_listings[i].ino == st.st_ino)
+            d = &dir_listings[i];
+        else if (dir_listings[i].used < oldest->used)
+            oldest = &dir_listings[i];
+    }
+    d = d ? d : oldest;
+    d->used = ++dir_listings_used;
+    if (d->list.names && d->dev == st.st_dev && d->ino == st.st_ino
+        && d->mtime.tv_sec == st.st_mtim.tv_sec && d->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        close(fd);
+        return &d->list;
+    }
+    name_list_free(&d->list);
+    d->dev = st.st_dev;
+    d->ino = st.st_ino;
+    d->mtime = st.st_mtim;
+    name_list_read_dir(&d->list, fd);
+    close(fd);
+    name_list_finish(&d->list);
+    if (!d->list.names) // an empty directory still has a listing
+        d->list.names = malloc(sizeof(char *));
+    return &d->list;
+}
+
+/**
+ * Subcommands, options or bookmark names as a list
+ */
+struct name_list *complete_words(const char *words, struct name_list *l) {
+    for (const char *w = words; *w;) {
+        size_t length = strcspn(w, " ");
+        name_list_add(l, w, length, DT_REG);
+        w += length + (w[length] == ' ');
+    }
+    name_list_finish(l);
+    return l;
+}
+
+/*
+ * The word being completed, unquoted, and where it sits in its command
+ */
+struct complete_word {
+    char text[PATH_MAX];
+    size_t length;
+    char quote; // the word has an open quote
+    bool redirect; // a redirection target
+    int position; // 0 for the command name
+    char first[64], second[64]; // command name and first argument
+};
+
+void complete_scan(const char *buf, int index, struct complete_word *w) {
+    bool in_word = false, escape = false;
+    memset(w, 0, sizeof(struct complete_word));
+    for (int i = 0; i < index; ++i) {
+        char c = buf[i];
+        bool ends = !escape && !w->quote && (c == ' ' || c == '\t' || c == '|' || c == ';' || c == '&'
+                                             || c == '<' || c == '>');
+        if (ends && in_word) {
+            w->text[w->length] = 0;
+            if (w->redirect)
+                w->redirect = false;
+            else if (w->position++ == 0)
+                snprintf(w->first, sizeof(w->first), "%.63s", w->text);
+            else if (w->position == 2)
+                snprintf(w->second, sizeof(w->second), "%.63s", w->text);
+            in_word = false;
+            w->length = 0;
+        }
+        if (ends) {
+            if (c == '|' || c == ';' || c == '&') { // a new command
+                w->position = 0;
+                w->first[0] = w->second[0] = 0;
+                w->redirect = false;
+            } else if (c == '<' || c == '>')
+                w->redirect = true;
+            continue;
+        }
+        in_word = true;
+        if (escape)
+            escape = false;
+        else if (w->quote && c == w->quote) {
+            w->quote = 0;
+            continue;
+        } else if (!w->quote && (c == '\'' || c == '"')) {
+            w->quote = c;
+            continue;
+        } else if (c == '\\' && w->quote != '\'') {
+            escape = true;
+            continue;
+        }
+        if (w->length < sizeof(w->text) - 1)
+            w->text[w->length++] = c;
+    }
+    w->text[w->length] = 0;
+}
+
+/**
+ * Is this entry a directory? d_type says, unless it is a link or unknown
+ */
+bool complete_is_dir(const char *dir, const char *name) {
+    unsigned char type = name[-1];
+    if (type != DT_LNK && type != DT_UNKNOWN)
+        return type == DT_DIR;
+    char path[PATH_MAX];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/**
+ * Add text at the end of the line, quoted for the lexer unless it goes
+ * inside an open quote
+ */
+void complete_insert(char *buf, size_t size, int *index, const char *text, size_t length, char quote) {
+    for (size_t i = 0; i < length && *index < (int) size - 3; ++i) {
+        if (!quote && lex_special[(unsigned char) text[i]])
+            buf[(*index)++] = '\\';
+        buf[(*index)++] = text[i];
+    }
+    buf[*index] = 0;
+}
+
+/**
+ * Show candidates in columns under the line
+ */
+void complete_list(char **names, size_t count, size_t total, const bool *dirs) {
+    struct winsize ws;
+    int width = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+    int column = 1;
+    for (size_t i = 0; i < count; ++i)
+        if ((int) strlen(names[i]) + 3 > column)
+            column = strlen(names[i]) + 3;
+    int per_row = width / column > 0 ? width / column : 1;
+    size_t rows = (count + per_row - 1) / per_row;
+    putchar('\n');
+    for (size_t r = 0; r < rows; ++r) {
+        for (size_t i = r; i < count; i += rows)
+            printf("%s%-*s", names[i], (int) (column - strlen(names[i])), dirs[i] ? "/" : "");
+        putchar('\n');
+    }
+    if (total > count)
+        printf("(%zu more)\n", total - count);
+}
+
+/**
+ * Complete the word at the end of buf: as far as all candidates agree, and
+ * all the way if there is only one; list them if they agree no further
+ * @return  true if candidates were listed, below the line
+ */
+bool complete(char *buf, size_t size, int *index) {
+    static struct complete_word w;
+    struct name_list words = {0}, *list = NULL;
+    char dir[PATH_MAX] = ".";
+    const char *prefix;
+    bool files = false, dirs_only = false, listed = false;
+
+    buf[*index] = 0;
+    complete_scan(buf, *index, &w);
+    prefix = w.text;
+    const char *options = NULL;
+    for (int i = 0; complete_options[i][0]; ++i)
+        if (strcmp(w.first, complete_options[i][0]) == 0)
+            options = complete_options[i][1];
+
+    if (w.redirect || w.position > 0 || strchr(w.text, '/')) {
+        if (w.position == 1 && strcmp(w.first, "shortdir") == 0)
+            list = complete_words("set del jump list clear", &words);
+        else if (w.position == 2 && strcmp(w.first, "shortdir") == 0
+                 && (strcmp(w.second, "jump") == 0 || strcmp(w.second, "del") == 0)) {
+            list = &words;
+            if (bookmark_open(&bookmarks) == 0 && bookmarks.map) {
+                const struct bookmark_header *h = (const struct bookmark_header *) bookmarks.map;
+                for (uint32_t i = 0; i < h->capacity; ++i) {
+                    const struct bookmark_slot *s = &bookmark_slots(&bookmarks)[i];
+                    if (s->name_length)
+                        name_list_add(&words, bookmark_strings(&bookmarks) + s->name, s->name_length, DT_REG);
+                }
+            }
+            name_list_finish(&words);
+        } else if (!w.redirect && options && w.text[0] == '-')
+            list = complete_words(options, &words);
+        else {
+            // a file name: list the directory part, complete the rest
+            char *slash = strrchr(w.text, '/');
+            files = true;
+            dirs_only = !w.redirect && strcmp(w.first, "cd") == 0;
+            if (slash) {
+                const char *home = getenv("HOME");
+                if (w.text[0] == '~' && w.text[1] == '/' && home)
+                    snprintf(dir, sizeof(dir), "%s%.*s", home, (int) (slash - w.text - 1), w.text + 1);
+                else
+                    snprintf(dir, sizeof(dir), "%.*s", (int) (slash - w.text), w.text);
+                if (!dir[0])
+                    strcpy(dir, "/");
+                prefix = slash + 1;
+            }
+            list = complete_directory(dir);
+        }
+    } else
+        list = complete_commands();
+    if (!list) {
+        putchar('\a');
+        return false;
+    }
+
+    size_t lo, hi, found = 0, shown = 0, length = strlen(prefix), common = 0;
+    name_list_range(list, prefix, &lo, &hi);
+    char *first = NULL, *last = NULL, *shown_names[COMPLETE_LIST_MAX];
+    bool shown_dirs[COMPLETE_LIST_MAX];
+    for (size_t i = lo; i < hi; ++i) {
+        char *name = list->names[i];
+        if (files && name[0] == '.' && prefix[0] != '.')
+            continue;
+        bool is_dir = files && (dirs_only ? complete_is_dir(dir, name) : (unsigned char) name[-1] == DT_DIR);
+        if (dirs_only && !is_dir)
+            continue;
+        first = first ? first : name;
+        last = name;
+        if (shown < COMPLETE_LIST_MAX) {
+            shown_dirs[shown] = is_dir;
+            shown_names[shown++] = name;
+        }
+        found++;
+    }
+    if (found == 0)
+        putchar('\a');
+    else {
+        while (first[common] && first[common] == last[common])
+            common++;
+        if (common > length)
+            complete_insert(buf, size, index, first + length, common - length, w.quote);
+        if (found == 1) {
+            if (files && complete_is_dir(dir, first))
+                complete_insert(buf, size, index, "/", 1, w.quote);
+            else if (*index < (int) size - 3) {
+                if (w.quote)
+                    buf[(*index)++] = w.quote;
+                buf[(*index)++] = ' ';
+                buf[*index] = 0;
+            }
+        } else if (common == length) {
+            complete_list(shown_names, shown, found, shown_dirs);
+            listed = true;
+        }
+    }
+    name_list_free(&words);
+    return listed;
+}
+
+/*
+ * Coreutils. cat, wc, head, ls and a fixed string grep run inside the
+ * shell, so scripts that call them in a loop don't pay for a process each
+ * time. They know the common options only: anything else (and
+ * SEASHELL_COREUTILS=0) leaves the command to the real program. Input is
+ * read in large blocks, newlines are counted 16 bytes at a time with SSE2,
+ * and errors go to stderr in the words of the programs they stand in for.
+ * One that would read the terminal is started as a job instead, like the
+ * program would be, so that ^C and ^Z reach it.
+ */
+#define COREUTILS_BLOCK (1 << 18)
 
-    	char read_el1[SIZE];
-    	char read_el2[SIZE];
+struct util_options {
+    bool set[128];
+    const char *value[128];
+    int operands; // index of the first operand in args
+};
 
-    	if(strcmp(command->args[0],"-a") == 0){
+struct util_output {
+    char *buf;
+    size_t length;
+    bool tty; // flushed after every block read
+    bool failed; // writing stdout failed, the rest is dropped
+    int error;
+};
 
-    		if(strstr(command->args[1],".txt") == NULL || strstr(command->args[2],".txt") == NULL){
+struct {
+    char *in; // input blocks, grown for grep's long lines
+    size_t in_size;
+    struct util_output out;
+    locale_t collate; // for ls, sorting like the program does
+    int enabled; // 0 unknown, 1 on, -1 off
+} utils;
+
+bool utils_enabled() {
+    if (!utils.enabled) {
+        const char *env = getenv("SEASHELL_COREUTILS");
+        utils.enabled = env && strcmp(env, "0") == 0 ? -1 : 1;
+    }
+    return utils.enabled > 0;
+}
 
-    			printf("Invalid Text Names\n");
+/**
+ * Parse options the way getopt does, from args[from]. known lists the
+ * letters, those followed by ':' take a value.
+ * @return  false if there is one the builtin doesn't know, or an option after an operand
+ */
+bool util_options(struct command_t *command, int from, const char *known, struct util_options *o) {
+    memset(o, 0, sizeof(struct util_options));
+    int i = from;
+    for (; i < command->arg_count; ++i) {
+        const char *a = command->args[i];
+        if (a[0] != '-' || a[1] == 0)
+            break;
+        if (strcmp(a, "--") == 0) {
+            o->operands = i + 1;
+            return true;
+        }
+        for (const char *p = a + 1; *p; ++p) {
+            const char *k = *p & 0x80 || *p == ':' ? NULL : strchr(known, *p);
+            if (!k)
+                return false;
+            o->set[(int) *p] = true;
+            if (k[1] == ':') {
+                if (p[1])
+                    o->value[(int) *p] = p + 1;
+                else if (i + 1 < command->arg_count)
+                    o->value[(int) *p] = command->args[++i];
+                else
+                    return false;
+                break;
+            }
+        }
+    }
+    o->operands = i;
+    for (; i < command->arg_count; ++i) // GNU tools take options after operands too
+        if (command->args[i][0] == '-' && command->args[i][1])
+            return false;
+    return true;
+}
 
-    		}else{
+/**
+ * Whether the operands from the i-th on leave stdin to be read
+ */
+bool util_reads_stdin(struct command_t *command, int i) {
+    if (i >= command->arg_count)
+        return true;
+    for (; i < command->arg_count; ++i)
+        if (strcmp(command->args[i], "-") == 0)
+            return true;
+    return false;
+}
 
-    			int valid = 0;
-    			int difference = 0;
-        		FILE *fptr1 = fopen(command->args[1], "r");
-        		FILE *fptr2 = fopen(command->args[2], "r");
+/**
+ * A decimal count, without the suffixes the programs also take
+ * @return  false if s is something else
+ */
+bool util_count(const char *s, unsigned long long *count) {
+    char *end;
+    if (!s || *s < '0' || *s > '9')
+        return false;
+    errno = 0;
+    *count = strtoull(s, &end, 10);
+    return *end == 0 && errno == 0;
+}
 
-        		char *f1 = fgets(read_el1,SIZE,fptr1);
-        		char *f2 = fgets(read_el2,SIZE,fptr2);
+/**
+ * Count the newlines in p[0..n)
+ */
+size_t count_newlines(const char *p, size_t n) {
+    size_t count = 0, i = 0;
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (n - i >= 16) {
+        // byte counters go up to 255 before they are summed
+        __m128i counts = _mm_setzero_si128();
+        for (int k = 0; k < 255 && n - i >= 16; ++k, i += 16)
+            counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + i)), newline));
+        counts = _mm_sad_epu8(counts, _mm_setzero_si128());
+        count += _mm_cvtsi128_si32(counts) + _mm_extract_epi16(counts, 4);
+    }
+#endif
+    for (const char *q; i < n && (q = memchr(p + i, '\n', n - i)); i = q - p + 1)
+        count++;
+    return count;
+}
 
-        		int line = 1;
+void util_output_start(struct util_output *out) {
+    if (!out->buf)
+        out->buf = malloc(COREUTILS_BLOCK);
+    out->length = 0;
+    out->tty = isatty(STDOUT_FILENO);
+    out->failed = false;
+    fflush(stdout);
+}
 
-        		while(f1 != NULL && f2 != NULL){
+void util_flush(struct util_output *out) {
+    if (out->length && !out->failed && write_all(STDOUT_FILENO, out->buf, out->length) == -1) {
+        out->failed = true;
+        out->error = errno;
+    }
+    out->length = 0;
+}
 
-					if(strcmp(read_el1,read_el2) == 0){
-				
-					}else{
+void util_write(struct util_output *out, const char *data, size_t length) {
+    if (out->length + length > COREUTILS_BLOCK) {
+        util_flush(out);
+        if (length > COREUTILS_BLOCK) {
+            if (!out->failed && write_all(STDOUT_FILENO, data, length) == -1) {
+                out->failed = true;
+                out->error = errno;
+            }
+            return;
+        }
+    }
+    memcpy(out->buf + out->length, data, length);
+    out->length += length;
+}
 
-						valid = 1;
-						printf("Line%d for 1st Text: %s\n", line, read_el1);
-						printf("Line%d for 2nd Text: %s\n", line, read_el2);
-						difference = difference + 1;
+/**
+ * Report an error on stderr, after what was written to stdout before it
+ */
+void util_error(const char *format, ...) {
+    va_list ap;
+    util_flush(&utils.out);
+    fflush(stdout);
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+}
 
-					}
-					
-					f1 = fgets(read_el1,SIZE,fptr1);
-	        		f2 = fgets(read_el2,SIZE,fptr2);
-	        		line = line + 1;
+void util_printf(struct util_output *out, const char *format, ...) {
+    char text[PATH_MAX + 64];
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(text, sizeof(text), format, ap);
+    va_end(ap);
+    util_write(out, text, n < (int) sizeof(text) ? (size_t) n : sizeof(text) - 1);
+}
 
-        		}
-    	    	while(true){
-	        		if(f1 != NULL){
+/**
+ * Flush what is left and set last_status
+ * @param  status  the program's exit status, unless writing failed
+ */
+int util_finish(struct util_output *out, const char *name, int status) {
+    util_flush(out);
+    last_status = status;
+    if (out->failed && out->error == EPIPE) {
+        last_status = 128 + SIGPIPE; // as if the signal had killed the program
+    } else if (out->failed) {
+        util_error("%s: write error: %s\n", name, strerror(out->error));
+        last_status = 1;
+    }
+    return SUCCESS;
+}
 
-						printf("Line%d for 1st Text Alone: %s\n", line, read_el1);
-						f1 = fgets(read_el1,SIZE,fptr1);
-	        			line = line + 1;
-	        			difference = difference + 1;
+/**
+ * Open an operand, "-" being stdin
+ * @return  the fd, or -1 with errno set
+ */
+int util_open(const char *path) {
+    return strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY | O_CLOEXEC);
+}
 
-        			}else if(f2 != NULL){
+void util_close(int fd) {
+    if (fd != STDIN_FILENO)
+        close(fd);
+}
 
-        				printf("Line%d for 2nd Text Alone: %s\n", line, read_el2);
-	        			f2 = fgets(read_el2,SIZE,fptr2);
-	        			line = line + 1;
-	        			difference = difference + 1;
+ssize_t util_read(int fd, char *buf, size_t size) {
+    ssize_t n;
+    while ((n = read(fd, buf, size)) == -1 && errno == EINTR)
+        ;
+    return n;
+}
 
-        			}else{
-        				break;
-        			}
-        		}
+char *util_block() {
+    if (!utils.in) {
+        utils.in_size = COREUTILS_BLOCK;
+        utils.in = malloc(utils.in_size + 1);
+    }
+    return utils.in;
+}
 
-        		if(valid == 0){
+/**
+ * cat [-u] [file...]: copied with redirect_copy, so inside the kernel where it can be
+ */
+bool cat_accepts(struct command_t *command, bool *reads_stdin) {
+    struct util_options o;
+    if (!utils_enabled() || !util_options(command, 0, "u", &o))
+        return false;
+    *reads_stdin = util_reads_stdin(command, o.operands);
+    return true;
+}
 
-        			printf("The two files are identical\n");
+int builtin_cat(struct command_t *command) {
+    struct util_options o;
+    struct stat out_st, st;
+    util_options(command, 0, "u", &o);
+    int count = command->arg_count - o.operands;
+    char *stdin_only[] = {"-"}, **paths = count ? command->args + o.operands : stdin_only;
+    bool out_regular = fstat(STDOUT_FILENO, &out_st) == 0 && S_ISREG(out_st.st_mode);
+    int status = 0;
+
+    fflush(stdout);
+    for (int i = 0; i < (count ? count : 1); ++i) {
+        int in = util_open(paths[i]);
+        if (in == -1) {
+            util_error("cat: %s: %s\n", paths[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        if (out_regular && fstat(in, &st) == 0 && st.st_dev == out_st.st_dev && st.st_ino == out_st.st_ino
+            && lseek(in, 0, SEEK_CUR) < st.st_size) {
+            util_error("cat: %s: input file is output file\n", paths[i]);
+            status = 1;
+        } else if (redirect_copy(in, STDOUT_FILENO) == -1) {
+            util_close(in);
+            if (errno == EPIPE) {
+                last_status = 128 + SIGPIPE;
+                return SUCCESS;
+            }
+            util_error("cat: %s: %s\n", paths[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        util_close(in);
+    }
+    last_status = status;
+    return SUCCESS;
+}
 
-        		}else{
+/**
+ * wc [-lwc] [file...], with the columns the program lines up
+ */
+bool wc_accepts(struct command_t *command, bool *reads_stdin) {
+    struct util_options o;
+    if (!utils_enabled() || !util_options(command, 0, "lwc", &o))
+        return false;
+    *reads_stdin = util_reads_stdin(command, o.operands);
+    return true;
+}
 
-        			printf("%d different lines are found\n", difference);
-        		}
+/**
+ * Count the lines, words and bytes of fd
+ * @return  0, or -1 if reading failed
+ */
+int wc_count(int fd, bool words, bool bytes_only, unsigned long long counts[3]) {
+    struct stat st;
+    off_t at;
+    counts[0] = counts[1] = counts[2] = 0;
+    if (bytes_only && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0
+        && (at = lseek(fd, 0, SEEK_CUR)) != -1) {
+        counts[2] = st.st_size > at ? st.st_size - at : 0;
+        lseek(fd, 0, SEEK_END);
+        return 0;
+    }
+    char *buf = util_block();
+    bool in_word = false;
+    ssize_t n;
+    while ((n = util_read(fd, buf, COREUTILS_BLOCK)) > 0) {
+        counts[2] += n;
+        if (bytes_only)
+            continue;
+        counts[0] += count_newlines(buf, n);
+        if (!words)
+            continue;
+        for (ssize_t i = 0; i < n; ++i) {
+            unsigned char c = buf[i];
+            bool space = c == ' ' || (c >= '\t' && c <= '\r');
+            counts[1] += !space && !in_word;
+            in_word = !space;
+        }
+    }
+    return n == 0 ? 0 : -1;
+}
 
-        		fclose(fptr2);
-        		fptr2 = NULL;
-        		fclose(fptr1);
-        		fptr1 = NULL;
-        	}
+int builtin_wc(struct command_t *command) {
+    struct util_options o;
+    util_options(command, 0, "lwc", &o);
+    bool show[3] = {o.set['l'], o.set['w'], o.set['c']};
+    if (!show[0] && !show[1] && !show[2])
+        show[0] = show[1] = show[2] = true;
+    int count = command->arg_count - o.operands;
+    char **paths = command->args + o.operands;
+    struct util_output *out = &utils.out;
+    unsigned long long counts[3], total[3] = {0, 0, 0};
+    int status = 0;
+
+    // as wide as the bytes of all regular files need, 7 when there are others
+    int width = 1;
+    if (count > 1 || show[0] + show[1] + show[2] > 1) {
+        unsigned long long regular = 0;
+        int minimum = 1;
+        struct stat st;
+        for (int i = 0; i < (count ? count : 1); ++i) {
+            if (!count || strcmp(paths[i], "-") == 0 ? fstat(STDIN_FILENO, &st) == -1 : stat(paths[i], &st) == -1)
+                continue;
+            if (S_ISREG(st.st_mode))
+                regular += st.st_size;
+            else
+                minimum = 7;
+        }
+        for (; regular >= 10; regular /= 10)
+            width++;
+        width = width < minimum ? minimum : width;
+    }
 
-    	}else if(strcmp(command->args[0],"-b") == 0){
+    util_output_start(out);
+    for (int i = 0; i < (count ? count : 1); ++i) {
+        const char *path = count ? paths[i] : "-";
+        int fd = util_open(path);
+        if (fd == -1) {
+            util_error("wc: %s: %s\n", path, strerror(errno));
+            status = 1;
+            continue;
+        }
+        if (wc_count(fd, show[1], !show[0] && !show[1], counts) == -1) {
+            util_error("wc: %s: %s\n", path, strerror(errno));
+            status = 1;
+        }
+        util_close(fd);
+        const char *separator = "";
+        for (int k = 0; k < 3; ++k) {
+            total[k] += counts[k];
+            if (show[k]) {
+                util_printf(out, "%s%*llu", separator, width, counts[k]);
+                separator = " ";
+            }
+        }
+        util_printf(out, count ? " %s\n" : "\n", path);
+    }
+    if (count > 1) {
+        const char *separator = "";
+        for (int k = 0; k < 3; ++k) {
+            if (show[k]) {
+                util_printf(out, "%s%*llu", separator, width, total[k]);
+                separator = " ";
+            }
+        }
+        util_printf(out, " total\n");
+    }
+    return util_finish(out, "wc", status);
+}
 
-        	FILE *fptr1 = fopen(command->args[1], "rb");
-        	FILE *fptr2 = fopen(command->args[2], "rb");
+/**
+ * head [-n N | -N | -c N] [-qv] [file...]. Whatever was read past the end
+ * of what is shown is given back to a seekable input, for the next reader
+ * of a shared stdin.
+ */
+bool head_options(struct command_t *command, struct util_options *o, bool *bytes, unsigned long long *count) {
+    unsigned long long n = 10;
+    int from = 0;
+    if (command->arg_count > 0 && command->args[0][0] == '-' && util_count(command->args[0] + 1, &n))
+        from = 1;
+    if (!utils_enabled() || !util_options(command, from, "n:c:qv", o) || (o->set['n'] && o->set['c'])
+        || (o->set['n'] && !util_count(o->value['n'], &n)) || (o->set['c'] && !util_count(o->value['c'], &n)))
+        return false;
+    *bytes = o->set['c'];
+    *count = n;
+    return true;
+}
 
-        	int f1 = fgetc(fptr1);
-       		int f2 = fgetc(fptr2);
-		
-			int count = 0;
+bool head_accepts(struct command_t *command, bool *reads_stdin) {
+    struct util_options o;
+    bool bytes;
+    unsigned long long count;
+    if (!head_options(command, &o, &bytes, &count))
+        return false;
+    *reads_stdin = util_reads_stdin(command, o.operands);
+    return true;
+}
 
-			while(f1 != EOF && f2 != EOF){
+/**
+ * Copy the first count lines (or bytes) of fd to out
+ * @return  0, or -1 if reading failed
+ */
+int head_copy(int fd, bool bytes, unsigned long long count, struct util_output *out) {
+    char *buf = util_block();
+    ssize_t n = 0;
+    while (count > 0 && !out->failed && (n = util_read(fd, buf, COREUTILS_BLOCK)) > 0) {
+        size_t take = n;
+        if (bytes) {
+            take = count < (unsigned long long) n ? count : (size_t) n;
+            count -= take;
+        } else if (count_newlines(buf, n) < count) {
+            count -= count_newlines(buf, n);
+        } else {
+            const char *p = buf;
+            for (; count > 0; --count)
+                p = (const char *) memchr(p, '\n', buf + n - p) + 1;
+            take = p - buf;
+        }
+        util_write(out, buf, take);
+        if (out->tty)
+            util_flush(out);
+        if (take < (size_t) n)
+            lseek(fd, (off_t) take - n, SEEK_CUR); // fails harmlessly on pipes
+    }
+    return n == -1 ? -1 : 0;
+}
 
-				if(f1 == f2){
+int builtin_head(struct command_t *command) {
+    struct util_options o;
+    bool bytes;
+    unsigned long long lines;
+    head_options(command, &o, &bytes, &lines);
+    int count = command->arg_count - o.operands;
+    char *stdin_only[] = {"-"}, **paths = count ? command->args + o.operands : stdin_only;
+    bool headers = o.set['v'] || (count > 1 && !o.set['q']);
+    struct util_output *out = &utils.out;
+    int status = 0;
+
+    util_output_start(out);
+    for (int i = 0; i < (count ? count : 1) && !out->failed; ++i) {
+        int fd = util_open(paths[i]);
+        if (fd == -1) {
+            util_error("head: cannot open '%s' for reading: %s\n", paths[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        if (headers)
+            util_printf(out, "%s==> %s <==\n", i ? "\n" : "",
+                        strcmp(paths[i], "-") == 0 ? "standard input" : paths[i]);
+        if (head_copy(fd, bytes, lines, out) == -1) {
+            util_error("head: error reading '%s': %s\n", paths[i], strerror(errno));
+            status = 1;
+        }
+        util_close(fd);
+    }
+    return util_finish(out, "head", status);
+}
 
-				}else{
+/**
+ * ls [-1aA] [file...] into a pipe or file, one name a line and sorted by
+ * the locale like the program does. On a terminal ls lays names out in
+ * columns, that is left to it.
+ */
+bool ls_accepts(struct command_t *command, bool *reads_stdin) {
+    struct util_options o;
+    char **r = command->redirects;
+    *reads_stdin = false;
+    return utils_enabled() && util_options(command, 0, "1aA", &o)
+        && (command->next || r[REDIRECT_OUT] || r[REDIRECT_APPEND] || r[REDIRECT_ALL] || !isatty(STDOUT_FILENO));
+}
 
-					count = count + 1;
+int compare_collated(const void *a, const void *b) {
+    const char *x = *(const char **) a, *y = *(const char **) b;
+    int r = utils.collate ? strcoll_l(x, y, utils.collate) : 0;
+    return r ? r : strcmp(x, y);
+}
 
-				}
+int builtin_ls(struct command_t *command) {
+    struct util_options o;
+    util_options(command, 0, "1aA", &o);
+    int count = command->arg_count - o.operands, files = 0, dirs = 0, status = 0;
+    char *here[] = {"."}, **paths = count ? command->args + o.operands : here;
+    count = count ? count : 1;
+    const char **sorted = malloc(sizeof(char *) * count * 2);
+    struct util_output *out = &utils.out;
+    struct stat st;
+
+    if (!utils.collate)
+        utils.collate = newlocale(LC_COLLATE_MASK, "", (locale_t) 0);
+    // files first, then the directories
+    for (int i = 0; i < count; ++i) {
+        if (stat(paths[i], &st) == -1) {
+            util_error("ls: cannot access '%s': %s\n", paths[i], strerror(errno));
+            status = 2;
+        } else if (S_ISDIR(st.st_mode)) {
+            sorted[count + dirs++] = paths[i];
+        } else {
+            sorted[files++] = paths[i];
+        }
+    }
+    qsort(sorted, files, sizeof(char *), compare_collated);
+    qsort(sorted + count, dirs, sizeof(char *), compare_collated);
+
+    util_output_start(out);
+    for (int i = 0; i < files; ++i)
+        util_printf(out, "%s\n", sorted[i]);
+    for (int i = 0; i < dirs; ++i) {
+        const char *dir = sorted[count + i];
+        struct name_list list = {0};
+        int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+            util_error("ls: cannot open directory '%s': %s\n", dir, strerror(errno));
+            status = 2;
+            continue;
+        }
+        name_list_read_dir(&list, fd);
+        close(fd);
+        if (o.set['a']) {
+            name_list_add(&list, ".", 1, DT_DIR);
+            name_list_add(&list, "..", 2, DT_DIR);
+        }
+        name_list_finish(&list);
+        size_t shown = 0;
+        for (size_t k = 0; k < list.count; ++k)
+            if (list.names[k][0] != '.' || o.set['a'] || o.set['A'])
+                list.names[shown++] = list.names[k];
+        qsort(list.names, shown, sizeof(char *), compare_collated);
+        if (files + dirs > 1 || status)
+            util_printf(out, "%s%s:\n", files || i ? "\n" : "", dir);
+        for (size_t k = 0; k < shown; ++k) {
+            util_write(out, list.names[k], strlen(list.names[k]));
+            util_write(out, "\n", 1);
+        }
+        name_list_free(&list);
+    }
+    free(sorted);
+    return util_finish(out, "ls", status);
+}
 
-				f1 = fgetc(fptr1);
-				f2 = fgetc(fptr2);
+/**
+ * grep [-cilnqsvFHh] pattern [file...] for a fixed string pattern:
+ * memmem() finds the matches in whole blocks, and the lines between them
+ * are copied (or counted) in one go.
+ */
+struct grep_state {
+    const char *pattern; // folded for -i
+    size_t length;
+    bool ignore_case, invert, numbers, count, list, quiet, prefix;
+    const char *name;
+    char *folded; // scratch for -i
+    size_t folded_size;
+    unsigned long long line, selected;
+    bool binary, done, suppressed;
+    bool utf8; // the locale's encoding, lines that are not valid in it are binary
+};
 
-			}
+/**
+ * Whether p[0..n) is valid UTF-8
+ */
+bool utf8_valid(const char *s, size_t n) {
+    const unsigned char *p = (const unsigned char *) s, *end = p + n;
+    while (p < end) {
+        if (*p < 0x80) {
+            p++;
+            continue;
+        }
+        int more = *p >= 0xf0 && *p <= 0xf4 ? 3 : *p >= 0xe0 ? 2 : *p >= 0xc2 && *p < 0xe0 ? 1 : -1;
+        if (more == -1 || *p > 0xf4 || end - p <= more)
+            return false;
+        for (int k = 1; k <= more; ++k)
+            if ((p[k] & 0xc0) != 0x80)
+                return false;
+        // overlong forms, surrogates and past U+10FFFF
+        if ((p[0] == 0xe0 && p[1] < 0xa0) || (p[0] == 0xed && p[1] >= 0xa0)
+            || (p[0] == 0xf0 && p[1] < 0x90) || (p[0] == 0xf4 && p[1] >= 0x90))
+            return false;
+        p += more + 1;
+    }
+    return true;
+}
 
-			while(true){
+bool grep_options(struct command_t *command, struct util_options *o) {
+    if (!utils_enabled() || !util_options(command, 0, "cilnqsvFHh", o) || o->operands >= command->arg_count)
+        return false;
+    const char *pattern = command->args[o->operands];
+    for (const char *p = pattern; *p; ++p)
+        if ((!o->set['F'] && strchr(".[]*^$\\", *p)) || (o->set['i'] && (*p & 0x80)) || *p == '\n')
+            return false;
+    return true;
+}
 
-				if(f1 != EOF){
+bool grep_accepts(struct command_t *command, bool *reads_stdin) {
+    struct util_options o;
+    if (!grep_options(command, &o))
+        return false;
+    *reads_stdin = util_reads_stdin(command, o.operands + 1);
+    return true;
+}
 
-					count = count + 1;
-					f1 = fgetc(fptr1);
-				}
-				if(f2 != EOF){
+/**
+ * Lower case copy of a block for -i, searched in place of it
+ */
+const char *grep_fold(struct grep_state *g, const char *p, size_t n) {
+    if (n > g->folded_size) {
+        g->folded_size = n;
+        g->folded = realloc(g->folded, n);
+    }
+    for (size_t i = 0; i < n; ++i)
+        g->folded[i] = p[i] >= 'A' && p[i] <= 'Z' ? p[i] + 32 : p[i];
+    return g->folded;
+}
 
-					count = count + 1;
-					f2 = fgetc(fptr2);
+/**
+ * Take the selected lines in p[0..n), all of them whole
+ */
+void grep_select(struct grep_state *g, const char *p, size_t n, struct util_output *out) {
+    size_t lines = count_newlines(p, n);
+    if (!lines || g->done)
+        return;
+    g->selected += lines;
+    if (g->count || g->list || g->quiet) {
+        g->done = !g->count;
+    } else if (g->binary) {
+        util_error("grep: %s: binary file matches\n", g->name);
+        g->done = true;
+    } else if (!g->prefix && !g->numbers && !(g->utf8 && !utf8_valid(p, n))) {
+        util_write(out, p, n);
+    } else {
+        for (const char *end = p + n; p < end; ++g->line) {
+            const char *eol = (const char *) memchr(p, '\n', end - p) + 1;
+            if (g->utf8 && !utf8_valid(p, eol - p)) { // not shown, GNU grep calls that binary too
+                g->suppressed = true;
+                p = eol;
+                continue;
+            }
+            if (g->prefix)
+                util_printf(out, "%s:", g->name);
+            if (g->numbers)
+                util_printf(out, "%llu:", g->line + 1);
+            util_write(out, p, eol - p);
+            p = eol;
+        }
+        g->line -= lines; // counted again by the caller
+    }
+}
 
-				}else{
+/**
+ * Go through whole lines in p[0..n)
+ */
+void grep_lines(struct grep_state *g, char *block, size_t n, struct util_output *out) {
+    const char *p = block, *end = block + n;
+    // once there is a NUL the input is binary, and NULs end lines like GNU grep has them
+    if (g->binary || memchr(block, 0, n)) {
+        g->binary = true;
+        for (char *z = block; (z = memchr(z, 0, end - z)); )
+            *z = '\n';
+    }
+    const char *hay = g->ignore_case ? grep_fold(g, p, n) : p;
+    ptrdiff_t shift = hay - p;
+    while (p < end && !g->done) {
+        const char *m = memmem(p + shift, end - p, g->pattern, g->length);
+        const char *bol = end, *eol = end;
+        if (m) {
+            m -= shift;
+            const char *nl = memrchr(p, '\n', m - p);
+            bol = nl ? nl + 1 : p;
+            eol = (const char *) memchr(m, '\n', end - m) + 1;
+        }
+        if (g->invert)
+            grep_select(g, p, bol - p, out);
+        if (g->numbers)
+            g->line += count_newlines(p, bol - p);
+        if (m && !g->invert)
+            grep_select(g, bol, eol - bol, out);
+        g->line += m != NULL;
+        p = eol;
+    }
+}
 
-					break;
-				
-				}
-			}
+/**
+ * Search fd, in blocks that end at a line end
+ * @return  0, or -1 if reading failed
+ */
+int grep_fd(struct grep_state *g, int fd, struct util_output *out) {
+    char *buf = util_block();
+    size_t kept = 0;
+    ssize_t n;
+    while (!g->done && (n = util_read(fd, buf + kept, utils.in_size - kept)) > 0) {
+        size_t length = kept + n;
+        const char *last = memrchr(buf + kept, '\n', n);
+        if (!last) {
+            kept = length;
+            if (kept == utils.in_size) { // a line longer than the buffer
+                utils.in_size *= 2;
+                buf = utils.in = realloc(utils.in, utils.in_size + 1);
+            }
+            continue;
+        }
+        size_t whole = last - buf + 1;
+        grep_lines(g, buf, whole, out);
+        kept = length - whole;
+        memmove(buf, buf + whole, kept);
+        if (out->tty)
+            util_flush(out);
+    }
+    if (g->done)
+        return 0;
+    if (n == -1)
+        return -1;
+    if (kept > 0) { // the last line has no newline, it is shown with one
+        buf[kept++] = '\n';
+        grep_lines(g, buf, kept, out);
+    }
+    return 0;
+}
 
-			if(count == 0){
+int builtin_grep(struct command_t *command) {
+    struct util_options o;
+    grep_options(command, &o);
+    int count = command->arg_count - o.operands - 1;
+    char *stdin_only[] = {"-"}, **paths = count ? command->args + o.operands + 1 : stdin_only;
+    struct util_output *out = &utils.out;
+    struct grep_state g = {
+        .pattern = strdup(command->args[o.operands]),
+        .ignore_case = o.set['i'], .invert = o.set['v'], .numbers = o.set['n'],
+        .count = o.set['c'], .list = o.set['l'], .quiet = o.set['q'],
+        .prefix = o.set['H'] || (count > 1 && !o.set['h']),
+    };
+    locale_t ctype = newlocale(LC_CTYPE_MASK, "", (locale_t) 0);
+    if (ctype) {
+        g.utf8 = strcmp(nl_langinfo_l(CODESET, ctype), "UTF-8") == 0;
+        freelocale(ctype);
+    }
+    g.length = strlen(g.pattern);
+    if (g.ignore_case)
+        for (char *p = (char *) g.pattern; *p; ++p)
+            *p = *p >= 'A' && *p <= 'Z' ? *p + 32 : *p;
+    bool selected = false, failed = false;
+
+    util_output_start(out);
+    for (int i = 0; i < (count ? count : 1) && !(selected && g.quiet) && !out->failed; ++i) {
+        int fd = util_open(paths[i]);
+        g.name = strcmp(paths[i], "-") == 0 ? "(standard input)" : paths[i];
+        g.line = g.selected = 0;
+        g.binary = g.done = g.suppressed = false;
+        if (fd == -1 || grep_fd(&g, fd, out) == -1) {
+            if (!o.set['s'])
+                util_error("grep: %s: %s\n", paths[i], strerror(errno));
+            failed = true;
+        } else if (g.count) {
+            util_printf(out, g.prefix ? "%s:%llu\n" : "%.0s%llu\n", g.name, g.selected);
+        } else if (g.list && g.selected) {
+            util_printf(out, "%s\n", g.name);
+        } else if (g.suppressed) {
+            util_error("grep: %s: binary file matches\n", g.name);
+        }
+        if (fd != -1)
+            util_close(fd);
+        selected |= g.selected > 0;
+    }
+    free((char *) g.pattern);
+    free(g.folded);
+    return util_finish(out, "grep", selected && g.quiet ? 0 : failed ? 2 : selected ? 0 : 1);
+}
 
-				printf("The two files are identical.\n");
+/*
+ * Profiling. `time command` and `profile command` measure a pipeline: wall
+ * time, the user and system time, page faults and context switches of the
+ * shell and of every child, each child's rusage collected as wait4() reaps
+ * it, and the largest resident set among them. profile also counts cycles,
+ * instructions and cache misses with perf_event_open(): the counters are
+ * opened on the shell and inherited by everything it starts while they
+ * are enabled, user space only so that no privileges are needed. Every
+ * measured command adds to running stats for its name, with a histogram of
+ * its wall time in buckets four to a power of two, shown by `stats`. With
+ * `profile on` (or SEASHELL_PROFILE=1) every pipeline is measured for the
+ * stats, without a report.
+ */
+#define PROFILE_BUCKETS 256 // of microseconds, 4 per power of two
+#define PROFILE_COUNTERS 3
+
+struct profile_sample {
+    struct profile_sample *parent; // an enclosing time or profile
+    struct timespec start;
+    struct rusage self; // the shell's own usage at the start
+    struct rusage children; // children reaped since, added up, ru_maxrss the largest
+    int counters[PROFILE_COUNTERS]; // perf event fds, -1 when not counting
+};
 
-			}else{
+struct profile_result {
+    double real, user, sys;
+    long maxrss, minflt, majflt, nvcsw, nivcsw;
+    bool counted; // the hardware counters were read
+    unsigned long long counters[PROFILE_COUNTERS];
+};
 
-				printf("The two files are different in %d bytes\n",count);
+struct profile_stats {
+    unsigned long count;
+    double real, user, sys, real_max; // real, user and sys added up
+    long maxrss;
+    unsigned long minflt, majflt, nvcsw, nivcsw;
+    uint32_t buckets[PROFILE_BUCKETS];
+};
 
-			}
-			fclose(fptr2);
-        	fptr2 = NULL;
-        	fclose(fptr1);
-        	fptr1 = NULL;
+struct {
+    int always; // 0 unknown, 1 every pipeline is measured, -1 only time/profile
+    struct profile_sample *active;
+    struct string_index names; // command names, ids index stats
+    struct profile_stats *stats;
+    size_t stats_capacity;
+} profile;
 
-    	}else{
-			
-			if(strstr(command->args[1],".txt") == NULL || strstr(command->args[2],".txt") == NULL){
+const char *profile_counter_names[PROFILE_COUNTERS] = {"cycles", "instructions", "cache misses"};
 
-    			printf("Invalid Text Names\n");
+bool profile_always() {
+    if (!profile.always) {
+        const char *env = getenv("SEASHELL_PROFILE");
+        profile.always = env && strcmp(env, "1") == 0 ? 1 : -1;
+    }
+    return profile.always > 0;
+}
 
-    		}else{
+void rusage_add(struct rusage *to, const struct rusage *from) {
+    timeradd(&to->ru_utime, &from->ru_utime, &to->ru_utime);
+    timeradd(&to->ru_stime, &from->ru_stime, &to->ru_stime);
+    to->ru_maxrss = from->ru_maxrss > to->ru_maxrss ? from->ru_maxrss : to->ru_maxrss;
+    to->ru_minflt += from->ru_minflt;
+    to->ru_majflt += from->ru_majflt;
+    to->ru_nvcsw += from->ru_nvcsw;
+    to->ru_nivcsw += from->ru_nivcsw;
+}
 
-    			int valid = 0;
-    			int difference = 0;
-        		FILE *fptr1 = fopen(command->args[0], "r");
-        		FILE *fptr2 = fopen(command->args[1], "r");
+/**
+ * Account for a child of a foreground job that exited, called from job_update
+ */
+void profile_child(struct job *job, const struct rusage *usage) {
+    if (profile.active && !job->background)
+        rusage_add(&profile.active->children, usage);
+}
 
-        		char *f1 = fgets(read_el1,SIZE,fptr1);
-        		char *f2 = fgets(read_el2,SIZE,fptr2);
+/**
+ * Open and enable the hardware counters, inherited by the children
+ * @return  0, or the errno of the first counter that could not be opened
+ */
+int profile_counters_open(struct profile_sample *sample) {
+    const uint64_t configs[PROFILE_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES
+    };
+    for (int i = 0; i < PROFILE_COUNTERS; ++i) {
+        struct perf_event_attr attr = {
+            .type = PERF_TYPE_HARDWARE, .size = sizeof(attr), .config = configs[i],
+            .disabled = 1, .inherit = 1, .exclude_kernel = 1, .exclude_hv = 1,
+        };
+        sample->counters[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (sample->counters[i] == -1) {
+            int error = errno;
+            for (int k = 0; k < i; ++k)
+                close(sample->counters[k]);
+            sample->counters[0] = -1;
+            return error;
+        }
+    }
+    for (int i = 0; i < PROFILE_COUNTERS; ++i)
+        ioctl(sample->counters[i], PERF_EVENT_IOC_ENABLE, 0);
+    return 0;
+}
 
-        		int line = 1;
+double minute_seconds(double seconds) {
+    return seconds - 60 * (int) (seconds / 60);
+}
 
-        		while(f1 != NULL && f2 != NULL){
+double timeval_seconds(struct timeval t) {
+    return t.tv_sec + t.tv_usec / 1e6;
+}
 
-					if(strcmp(read_el1,read_el2) == 0){
-				
-					}else{
+/**
+ * Stop measuring and work out what the sample cost
+ */
+void profile_finish(struct profile_sample *sample, struct profile_result *result) {
+    struct timespec now;
+    struct rusage self;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    getrusage(RUSAGE_SELF, &self);
+    memset(result, 0, sizeof(struct profile_result));
+    if (sample->counters[0] != -1) {
+        result->counted = true;
+        for (int i = 0; i < PROFILE_COUNTERS; ++i) {
+            ioctl(sample->counters[i], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(sample->counters[i], &result->counters[i], sizeof(uint64_t)) != sizeof(uint64_t))
+                result->counted = false;
+            close(sample->counters[i]);
+        }
+    }
+    struct rusage *c = &sample->children;
+    result->real = (now.tv_sec - sample->start.tv_sec) + (now.tv_nsec - sample->start.tv_nsec) / 1e9;
+    result->user = timeval_seconds(self.ru_utime) - timeval_seconds(sample->self.ru_utime) + timeval_seconds(c->ru_utime);
+    result->sys = timeval_seconds(self.ru_stime) - timeval_seconds(sample->self.ru_stime) + timeval_seconds(c->ru_stime);
+    result->maxrss = c->ru_maxrss ? c->ru_maxrss : self.ru_maxrss; // the shell's own for builtins
+    result->minflt = self.ru_minflt - sample->self.ru_minflt + c->ru_minflt;
+    result->majflt = self.ru_majflt - sample->self.ru_majflt + c->ru_majflt;
+    result->nvcsw = self.ru_nvcsw - sample->self.ru_nvcsw + c->ru_nvcsw;
+    result->nivcsw = self.ru_nivcsw - sample->self.ru_nivcsw + c->ru_nivcsw;
+}
 
-						valid = 1;
-						printf("Line%d for 1st Text: %s\n", line, read_el1);
-						printf("Line%d for 2nd Text: %s\n", line, read_el2);
-						difference = difference + 1;
+int profile_bucket(double seconds) {
+    unsigned long long us = seconds > 0 ? (unsigned long long) (seconds * 1e6) : 0;
+    if (us < 4)
+        return us;
+    int bit = 63 - __builtin_clzll(us);
+    return 4 * (bit - 1) + ((us >> (bit - 2)) & 3);
+}
 
-					}
-					
-					f1 = fgets(read_el1,SIZE,fptr1);
-	        		f2 = fgets(read_el2,SIZE,fptr2);
-	        		line = line + 1;
+/**
+ * Smallest value of a bucket, in seconds
+ */
+double profile_bucket_start(int bucket) {
+    if (bucket < 4)
+        return bucket / 1e6;
+    return (double) ((4ull + bucket % 4) << (bucket / 4 - 1)) / 1e6;
+}
 
-        		}
-    	    	while(true){
-	        		if(f1 != NULL){
+void profile_record(const char *name, const struct profile_result *result) {
+    uint32_t id = string_intern(&profile.names, name, strlen(name));
+    if (id >= profile.stats_capacity) {
+        size_t old = profile.stats_capacity;
+        profile.stats_capacity = profile.stats_capacity ? profile.stats_capacity * 2 : 64;
+        profile.stats = realloc(profile.stats, sizeof(struct profile_stats) * profile.stats_capacity);
+        memset(profile.stats + old, 0, sizeof(struct profile_stats) * (profile.stats_capacity - old));
+    }
+    struct profile_stats *s = &profile.stats[id];
+    s->count++;
+    s->real += result->real;
+    s->user += result->user;
+    s->sys += result->sys;
+    s->real_max = result->real > s->real_max ? result->real : s->real_max;
+    s->maxrss = result->maxrss > s->maxrss ? result->maxrss : s->maxrss;
+    s->minflt += result->minflt;
+    s->majflt += result->majflt;
+    s->nvcsw += result->nvcsw;
+    s->nivcsw += result->nivcsw;
+    s->buckets[profile_bucket(result->real)]++;
+}
 
-						printf("Line%d for 1st Text Alone: %s\n", line, read_el1);
-						f1 = fgets(read_el1,SIZE,fptr1);
-	        			line = line + 1;
-	        			difference = difference + 1;
+/**
+ * Run a command and measure it
+ * @param  report    print what it cost on stderr
+ * @param  posix     in the format of `time -p`
+ * @param  hardware  with the hardware counters
+ */
+int profile_run(struct command_t *command, bool report, bool posix, bool hardware) {
+    struct profile_sample sample = {.parent = profile.active, .counters = {-1}};
+    int counter_error = hardware ? profile_counters_open(&sample) : 0;
+    getrusage(RUSAGE_SELF, &sample.self);
+    clock_gettime(CLOCK_MONOTONIC, &sample.start);
+    profile.active = &sample;
+    char *name = strdup(command->name);
+    int code = process_command(command);
+    struct profile_result result;
+    profile.active = sample.parent;
+    profile_finish(&sample, &result);
+    if (sample.parent)
+        rusage_add(&sample.parent->children, &sample.children);
+    profile_record(name, &result);
+    free(name);
+    if (!report)
+        return code;
+
+    fflush(stdout);
+    if (posix) {
+        fprintf(stderr, "real %.2f\nuser %.2f\nsys %.2f\n", result.real, result.user, result.sys);
+        return code;
+    }
+    fprintf(stderr, "\nreal\t%dm%.3fs\nuser\t%dm%.3fs\nsys\t%dm%.3fs\n",
+            (int) result.real / 60, minute_seconds(result.real), (int) result.user / 60, minute_seconds(result.user),
+            (int) result.sys / 60, minute_seconds(result.sys));
+    fprintf(stderr, "maxrss\t%ld KB\nfaults\t%ld minor, %ld major\nswitches\t%ld voluntary, %ld involuntary\n",
+            result.maxrss, result.minflt, result.majflt, result.nvcsw, result.nivcsw);
+    if (hardware && !result.counted) {
+        fprintf(stderr, "counters\tnot available: %s\n", strerror(counter_error ? counter_error : EIO));
+    } else if (hardware) {
+        for (int i = 0; i < PROFILE_COUNTERS; ++i)
+            fprintf(stderr, "%s\t%llu\n", profile_counter_names[i], result.counters[i]);
+        if (result.counters[0])
+            fprintf(stderr, "IPC\t%.2f\n", (double) result.counters[1] / result.counters[0]);
+    }
+    return code;
+}
 
-        			}else if(f2 != NULL){
+/**
+ * `time [-p] command` and `profile command` in front of a pipeline measure
+ * all of it, so they are taken off the first stage before it runs
+ * @return  true if command starts with one
+ */
+bool profile_prefix(struct command_t *command) {
+    if (strcmp(command->name, "time") == 0) {
+        int skip = command->arg_count > 0 && strcmp(command->args[0], "-p") == 0;
+        return command->arg_count > skip;
+    }
+    return strcmp(command->name, "profile") == 0 && command->arg_count > 0
+        && strcmp(command->args[0], "on") != 0 && strcmp(command->args[0], "off") != 0;
+}
 
-        				printf("Line%d for 2nd Text Alone: %s\n", line, read_el2);
-	        			f2 = fgets(read_el2,SIZE,fptr2);
-	        			line = line + 1;
-	        			difference = difference + 1;
+int profile_command(struct command_t *command) {
+    bool hardware = strcmp(command->name, "profile") == 0;
+    int skip = !hardware && strcmp(command->args[0], "-p") == 0;
+    bool posix = skip;
+    char *name = command->name, **args = command->args, **argv = command->argv;
+    int arg_count = command->arg_count;
+
+    command->name = args[skip];
+    command->args = args + skip + 1;
+    command->argv = argv ? argv + skip + 1 : NULL;
+    command->arg_count = arg_count - skip - 1;
+    int code = profile_run(command, true, posix, hardware);
+    command->name = name;
+    command->args = args;
+    command->argv = argv;
+    command->arg_count = arg_count;
+    return code;
+}
 
-        			}else{
-        				break;
-        			}
-        		}
+/**
+ * time [-p] command: what running it cost
+ */
+int builtin_time(struct command_t *command) {
+    printf("usage: %s [-p] command [args...]\n", command->name);
+    last_status = 2;
+    return SUCCESS;
+}
 
-        		if(valid == 0){
+/**
+ * profile command | profile on | profile off
+ */
+int builtin_profile(struct command_t *command) {
+    profile_always();
+    last_status = 0;
+    if (command->arg_count == 1 && strcmp(command->args[0], "on") == 0) {
+        profile.always = 1;
+    } else if (command->arg_count == 1 && strcmp(command->args[0], "off") == 0) {
+        profile.always = -1;
+    } else if (command->arg_count == 0) {
+        printf("profiling every command is %s\n", profile.always > 0 ? "on" : "off");
+    } else {
+        printf("usage: profile command [args...]\n"
+               "       profile on|off\n");
+        last_status = 2;
+    }
+    return SUCCESS;
+}
 
-        			printf("The two files are identical\n");
+/**
+ * A duration with a unit that keeps it short
+ */
+char *profile_duration(char *buf, double seconds) {
+    if (seconds < 1e-3)
+        sprintf(buf, "%.0fus", seconds * 1e6);
+    else if (seconds < 1)
+        sprintf(buf, "%.2fms", seconds * 1e3);
+    else
+        sprintf(buf, "%.2fs", seconds);
+    return buf;
+}
 
-        		}else{
+/**
+ * Wall time under which a fraction of the runs finished, to the bucket
+ */
+double profile_percentile(const struct profile_stats *s, double fraction) {
+    unsigned long want = (unsigned long) (fraction * s->count + 0.999999), seen = 0;
+    for (int b = 0; b < PROFILE_BUCKETS; ++b) {
+        seen += s->buckets[b];
+        if (seen >= want && seen > 0) {
+            double end = b + 1 < PROFILE_BUCKETS ? profile_bucket_start(b + 1) : s->real_max;
+            return end < s->real_max ? end : s->real_max;
+        }
+    }
+    return s->real_max;
+}
 
-        			printf("%d different lines are found\n", difference);
-        		}
+void profile_histogram(const struct profile_stats *s) {
+    int first = 0, last = PROFILE_BUCKETS - 1;
+    uint32_t most = 0;
+    while (first < last && !s->buckets[first])
+        first++;
+    while (last > first && !s->buckets[last])
+        last--;
+    for (int b = first; b <= last; ++b)
+        most = s->buckets[b] > most ? s->buckets[b] : most;
+    for (int b = first; b <= last; ++b) {
+        char from[32];
+        int width = most ? (int) ((uint64_t) s->buckets[b] * 40 / most) : 0;
+        printf("  >= %9s %8u ", profile_duration(from, profile_bucket_start(b)), s->buckets[b]);
+        for (int k = 0; k < width; ++k)
+            printf("#");
+        printf("\n");
+    }
+}
 
-        		fclose(fptr2);
-        		fptr2 = NULL;
-        		fclose(fptr1);
-        		fptr1 = NULL;
-        	}
-    	}
-        
+/**
+ * stats [-r] [name]: the running stats of every measured command, or the
+ * histogram of those whose name contains name; -r forgets them
+ */
+int builtin_stats(struct command_t *command) {
+    bool reset = command->arg_count > 0 && strcmp(command->args[0], "-r") == 0;
+    const char *filter = command->arg_count > reset ? command->args[reset] : NULL;
+    last_status = 0;
+    if (reset && !filter) {
+        memset(profile.stats, 0, sizeof(struct profile_stats) * profile.stats_capacity);
         return SUCCESS;
     }
+    bool header = false;
+    for (size_t id = 0; id < profile.names.count; ++id) {
+        struct profile_stats *s = &profile.stats[id];
+        const char *name = profile.names.items[id].text;
+        if (!s->count || (filter && !strstr(name, filter)))
+            continue;
+        if (reset) {
+            memset(s, 0, sizeof(struct profile_stats));
+            continue;
+        }
+        char mean[32], p50[32], p90[32], p99[32], max[32], user[32], sys[32];
+        if (!header)
+            printf("%-16s %8s %9s %9s %9s %9s %9s %9s %9s %9s\n", "command", "count", "mean", "p50", "p90", "p99",
+                   "max", "user", "sys", "maxrss");
+        header = true;
+        printf("%-16s %8lu %9s %9s %9s %9s %9s %9s %9s %7ldKB\n", name, s->count,
+               profile_duration(mean, s->real / s->count), profile_duration(p50, profile_percentile(s, 0.5)),
+               profile_duration(p90, profile_percentile(s, 0.9)), profile_duration(p99, profile_percentile(s, 0.99)),
+               profile_duration(max, s->real_max), profile_duration(user, s->user / s->count),
+               profile_duration(sys, s->sys / s->count), s->maxrss);
+        if (filter) {
+            printf("  faults %lu minor, %lu major; switches %lu voluntary, %lu involuntary\n",
+                   s->minflt, s->majflt, s->nvcsw, s->nivcsw);
+            profile_histogram(s);
+        }
+    }
+    if (!header && !reset) {
+        printf(filter ? "-%s: stats: nothing measured matches %s\n" : "-%s: stats: nothing measured yet%.0s\n",
+               sysname, filter);
+        last_status = 1;
+    }
+    return SUCCESS;
+}
 
-    pid_t pid = fork();
-    if (pid == 0) {
-        /// This shows how to do exec with environ (but is not available on MacOs)
-        // extern char** environ; // environment variables
-        // execvpe(command->name, command->args, environ); // exec+args+path+environ
+/**
+ * Run a `;`, `&`, `&&`, `||` separated list of pipelines
+ */
+int run_list(struct command_t *command) {
+    while (command) {
+        struct command_t *rest = command->next_list;
+        int op = command->list_op;
+        command->next_list = NULL;
+        int code = process_command(command);
+        if (code == EXIT)
+            return EXIT;
+        // skip pipelines whose && / || condition fails; the status carries over
+        while (rest && ((op == TOKEN_AND && last_status != 0) || (op == TOKEN_OR && last_status == 0))) {
+            op = rest->list_op;
+            rest = rest->next_list;
+        }
+        command = rest;
+    }
+    return SUCCESS;
+}
 
-        /// This shows how to do exec with auto-path resolve
-        // add a NULL argument to the end of args, and the name to the beginning
-        // as required by exec
+/**
+ * exit [status]
+ */
+int builtin_exit(struct command_t *command) {
+    if (command->arg_count > 0)
+        last_status = atoi(command->args[0]) & 0xff;
+    return EXIT;
+}
 
-        // increase args size by 2
-        command->args = (char **) realloc(
-                command->args, sizeof(char *) * (command->arg_count += 2));
+/**
+ * cd [dir], to $HOME without one
+ */
+int builtin_cd(struct command_t *command) {
+    const char *dir = command->arg_count > 0 ? command->args[0] : getenv("HOME");
+    last_status = 0;
+    if (!dir) {
+        printf("-%s: %s: HOME not set\n", sysname, command->name);
+        last_status = 1;
+    } else if (change_directory(dir) == -1) {
+        printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+        last_status = 1;
+    }
+    return SUCCESS;
+}
 
-        // shift everything forward by 1
-        for (int i = command->arg_count - 2; i > 0; --i)
-            command->args[i] = command->args[i - 1];
+/**
+ * myNetwork: print the host name and its address
+ */
+int builtin_mynetwork(struct command_t *command) {
+    char hostbuffer[256];
+    struct hostent *host_entry;
 
-        // set args[0] as a copy of name
-        command->args[0] = strdup(command->name);
-        // set args[arg_count-1] (last) to NULL
-        command->args[command->arg_count - 1] = NULL;
+    last_status = 1;
+    if (gethostname(hostbuffer, sizeof(hostbuffer)) == -1) {
+        printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+        return SUCCESS;
+    }
+    host_entry = gethostbyname(hostbuffer);
+    if (!host_entry || !host_entry->h_addr_list[0]) {
+        printf("-%s: %s: %s: %s\n", sysname, command->name, hostbuffer, hstrerror(h_errno));
+        return SUCCESS;
+    }
+    printf("Hostname: %s\n", hostbuffer);
+    printf("Host IP: %s\n", inet_ntoa(*((struct in_addr *) host_entry->h_addr_list[0])));
+    last_status = 0;
+    return SUCCESS;
+}
 
-        char path[20] = "/bin/";
-        strcat(path, command->name);
-        execv(path, command->args); // exec+args+path
-        exit(0);
-        /// TODO: do your own exec  path resolving using execv()
-    } else {
+/**
+ * goodMorning hour.minute file: play file every morning, through crontab(1)
+ */
+int builtin_goodmorning(struct command_t *command) {
+    char *hour, *minute, *save = NULL;
 
-        wait(0); 
-       // wait for child process to finish
+    if (command->arg_count < 2 || !(hour = strtok_r(command->args[0], ".", &save))
+            || !(minute = strtok_r(NULL, ".", &save))) {
+        printf("usage: %s hour.minute file\n", command->name);
+        last_status = 2;
         return SUCCESS;
     }
+    FILE *fptr = fopen("morning.txt", "w");
+    if (!fptr) {
+        printf("-%s: %s: morning.txt: %s\n", sysname, command->name, strerror(errno));
+        last_status = 1;
+        return SUCCESS;
+    }
+    fprintf(fptr, "%s %s * * * env DISPLAY=:0.0 audacious /home/abrakadabra/deneme %s\n", minute, hour, command->args[1]);
+    fclose(fptr);
+
+    // install it with crontab(1) as a normal foreground job
+    char *cron_args[] = {"morning.txt"};
+    struct command_t cron = {.name = "crontab", .arg_count = 1, .args = cron_args};
+    return launch_job(&cron);
+}
+
+int process_command(struct command_t *command) {
+    if (command->next_list)
+        return run_list(command);
+
+    if (strcmp(command->name, "") == 0) return SUCCESS;
+
+    if (profile_prefix(command))
+        return profile_command(command);
+    if (!profile.active && profile_always() && strcmp(command->name, "stats") != 0
+        && strcmp(command->name, "profile") != 0)
+        return profile_run(command, false, false, false);
+
+    if (command->next || command->background)
+        return launch_job(command);
+
+    if (redirect_any(command) && redirect_cat(command))
+        return SUCCESS;
 
-    printf("-%s: %s: command not found\n", sysname, command->name);
-    return UNKNOWN;
+    bool reads_stdin;
+    const struct builtin *b = builtin_for(command, &reads_stdin);
+    if (b && redirect_any(command))
+        return redirect_builtin(command);
+    // a stand-in reading the terminal becomes a job, so ^C and ^Z reach it
+    if (b && !(reads_stdin && isatty(STDIN_FILENO)))
+        return builtin_run(b, command);
 
+    return launch_job(command);
 }
 
 
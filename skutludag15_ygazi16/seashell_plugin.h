@@ -0,0 +1,36 @@
+/*
+ * seashell plugin interface. A plugin is a shared object that exports
+ * seashell_plugin_init(), which returns the builtins it adds. They run in
+ * the shell process, without a fork: argv[0] is the name the builtin was
+ * called by, output goes to stdout (redirected and piped like any other
+ * builtin's) and the return value is the exit status.
+ *
+ *   cc -shared -fPIC -o hello.so hello.c
+ *
+ * and then `plugin load ./hello.so`, or put it in $SEASHELL_PLUGINS (a
+ * colon separated list of paths) to have it loaded at startup.
+ */
+#ifndef SEASHELL_PLUGIN_H
+#define SEASHELL_PLUGIN_H
+
+#define SEASHELL_PLUGIN_VERSION 1
+
+// the builtin never reads the terminal, so the line editor can keep it
+#define SEASHELL_BUILTIN_NO_TTY 1
+
+struct seashell_builtin {
+    const char *name;
+    int (*run)(int argc, char **argv);
+    int flags;
+};
+
+struct seashell_plugin {
+    int version; // SEASHELL_PLUGIN_VERSION
+    const char *name;
+    const struct seashell_builtin *builtins;
+    int count;
+};
+
+const struct seashell_plugin *seashell_plugin_init(void);
+
+#endif
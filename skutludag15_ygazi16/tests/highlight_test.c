@@ -0,0 +1,78 @@
+/*
+ * highlight: overlapping matches of several patterns. Each case lists the
+ * matches in the order the scanner reports them (by where they end) and
+ * the ones that must be left to color.
+ *
+ *   make test
+ */
+#define SEASHELL_NO_MAIN
+#include "../seashell.c"
+
+struct match_case {
+    const char *name;
+    struct highlight_match reported[4], expected[4];
+    size_t reported_count, expected_count;
+};
+
+struct match_case match_cases[] = {
+    // x=+-* with -w x= -w - -w =+-*: =+-* overlaps x=, so - must stay
+    {"dropped match keeps covered ones", {{0, 2, 1}, {3, 4, 2}, {1, 5, 3}}, {{0, 2, 1}, {3, 4, 2}}, 3, 2},
+    {"earlier match replaces covered ones", {{2, 3, 1}, {4, 5, 2}, {1, 6, 3}}, {{1, 6, 3}}, 3, 1},
+    {"match inside the last one is dropped", {{0, 4, 1}, {2, 3, 2}}, {{0, 4, 1}}, 2, 1},
+    {"adjacent matches both stay", {{0, 2, 1}, {2, 4, 2}}, {{0, 2, 1}, {2, 4, 2}}, 2, 2},
+};
+
+/**
+ * Run the shell's highlight on text and return what it printed
+ */
+char *highlight_text(const char *text, const char *args) {
+    char path[] = "/tmp/seashell-test.XXXXXX", line[256];
+    int fd = mkstemp(path);
+    if (write(fd, text, strlen(text)) != (ssize_t) strlen(text))
+        return NULL;
+    close(fd);
+    snprintf(line, sizeof(line), "highlight %s %s", args, path);
+
+    FILE *out = tmpfile();
+    int saved = dup(STDOUT_FILENO);
+    fflush(stdout);
+    dup2(fileno(out), STDOUT_FILENO);
+    struct command_t *command = arena_zalloc(&line_arena, sizeof(struct command_t));
+    if (parse_command(line, command) == SUCCESS)
+        process_command(command);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    arena_reset(&line_arena);
+    unlink(path);
+
+    static char printed[4096];
+    size_t length = fread(printed, 1, sizeof(printed) - 1, (rewind(out), out));
+    printed[length] = '\0';
+    fclose(out);
+    return printed;
+}
+
+int main() {
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(match_cases) / sizeof(match_cases[0]); ++i) {
+        struct match_case *t = &match_cases[i];
+        struct highlight_output o;
+        memset(&o, 0, sizeof(o));
+        for (size_t j = 0; j < t->reported_count; ++j)
+            highlight_add_match(&o, t->reported[j].start, t->reported[j].end, t->reported[j].color);
+        bool ok = o.match_count == t->expected_count;
+        for (size_t j = 0; ok && j < o.match_count; ++j)
+            ok = o.matches[j].start == t->expected[j].start && o.matches[j].end == t->expected[j].end &&
+                 o.matches[j].color == t->expected[j].color;
+        printf("%s: %s\n", ok ? "ok" : "FAIL", t->name);
+        failed += !ok;
+        free(o.matches);
+    }
+
+    char *printed = highlight_text("x=+-*\n", "-w x= red -w - green -w =+-* blue");
+    bool ok = printed && strcmp(printed, "\033[1;31mx=\033[0m+\033[0;32m-\033[0m*\n") == 0;
+    printf("%s: highlight of overlapping words\n", ok ? "ok" : "FAIL");
+    failed += !ok;
+    return failed != 0;
+}